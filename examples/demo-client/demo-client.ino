@@ -0,0 +1,61 @@
+
+#include "esp32-BG95.hpp"
+#include "esp32-BG95-client.hpp"
+#include "./credentials.h"
+
+#define PWKEY 4
+
+MODEMBGXX modem;
+
+struct TCP_CONNECTION {
+    uint8_t cid; // connection id 1-16, limited to MAX_CONNECTIONS
+    uint8_t clientID; // client idx 0-11, limited to MAX_TCP_CONNECTIONS
+};
+
+TCP_CONNECTION tcp1 = {
+  1,
+  0
+};
+
+// can be passed to any library expecting a Client (PubSubClient, ArduinoHttpClient, ..)
+MODEMBGXXClient client(&modem,tcp1.clientID,tcp1.cid);
+
+void setup() {
+  // put your setup code here, to run once:
+
+  Serial.begin(115200);
+
+  modem.init_port(115200,SERIAL_8N1);
+  modem.init(SETTINGS_NB_COPS,AUTO,PWKEY);
+
+  modem.setup(tcp1.cid,SETTINGS_NB_APN,SETTINGS_NB_USERNAME,SETTINGS_NB_PASSWORD);
+}
+
+void loop() {
+  // put your main code here, to run repeatedly:
+
+  while(client.available() > 0){
+    Serial.print((char)client.read());
+  }
+
+  if(modem.loop(5000)){ // state was updated
+    if(modem.has_context(tcp1.cid)){
+      if(!client.connected()){
+        if(client.connect("www.google.com",80)){
+          // small writes are sent in a single AT+QISEND
+          client.print("GET / HTTP/1.1\r\n");
+          client.print("Host: www.google.com\r\n");
+          client.print("Connection: close\r\n\r\n");
+          client.flush();
+        }else Serial.println("Connection has failed");
+      }
+    }else{
+      modem.open_pdp_context(tcp1.cid);
+    }
+
+    modem.log_status();
+  }
+
+  delay(200);
+
+}
@@ -0,0 +1,49 @@
+
+#include "esp32-BG95.hpp"
+
+// a sample message, compressor and decompressor must use the same dictionary
+const char dictionary[] = "{\"device\":\"bg95-000000\",\"ts\":0000000000,\"temperature\":00.0,\"humidity\":00.0,\"battery\":0000,\"rssi\":-00}";
+
+uint8_t compressed[512];
+uint8_t decompressed[512];
+
+void benchmark(const char *label, const uint8_t *dict, size_t dict_len) {
+
+  char msg[256];
+  snprintf(msg,sizeof(msg),"{\"device\":\"bg95-123456\",\"ts\":%lu,\"temperature\":%.1f,\"humidity\":%.1f,\"battery\":%u,\"rssi\":-%u}",
+    1700000000UL + millis()/1000, 15 + random(100)/10.0, 40 + random(200)/10.0, 3600 + random(500), 60 + random(40));
+  size_t len = strlen(msg);
+
+  uint32_t t = micros();
+  size_t c_len = lzss_compress((const uint8_t*)msg,len,compressed,sizeof(compressed),dict,dict_len);
+  uint32_t t_compress = micros() - t;
+
+  if(c_len == 0){ // small messages rarely compress without a dictionary
+    Serial.printf("%s: %u bytes, not compressible, %u us\n", label, len, t_compress);
+    return;
+  }
+
+  t = micros();
+  size_t d_len = lzss_decompress(compressed,c_len,decompressed,sizeof(decompressed),dict,dict_len);
+  uint32_t t_decompress = micros() - t;
+
+  bool ok = d_len == len && memcmp(msg,decompressed,len) == 0;
+
+  Serial.printf("%s: %u -> %u bytes (%u%%), compress %u us, decompress %u us, %s\n",
+    label, len, c_len, c_len * 100 / len, t_compress, t_decompress, ok ? "ok" : "failed");
+}
+
+void setup() {
+  // put your setup code here, to run once:
+
+  Serial.begin(115200);
+}
+
+void loop() {
+  // put your main code here, to run repeatedly:
+
+  benchmark("no dictionary",NULL,0);
+  benchmark("dictionary",(const uint8_t*)dictionary,strlen(dictionary));
+
+  delay(2000);
+}
@@ -76,6 +76,16 @@ void setup() {
   #ifdef MULTI_MQTT
   modem.MQTT_setup(mqtt2.clientID,mqtt2.cid,"state","offline");
   #endif
+
+  // modem keeps clients connected and subscribed, retrying with backoff
+  modem.MQTT_supervise(mqtt1.clientID,"test1",MQTT_USER_1,MQTT_PASSWORD_1,MQTT_HOST_1,1883);
+  for(uint8_t i=0; i<NUMITEMS(topic); i++)
+    modem.MQTT_supervise_subscribe(mqtt1.clientID,topic[i],topic_qos[i]);
+  #ifdef MULTI_MQTT
+  modem.MQTT_supervise(mqtt2.clientID,"test2",MQTT_USER_2,MQTT_PASSWORD_2,MQTT_HOST_2,1883);
+  for(uint8_t i=0; i<NUMITEMS(topic); i++)
+    modem.MQTT_supervise_subscribe(mqtt2.clientID,topic[i],topic_qos[i]);
+  #endif
 }
 
 void loop() {
@@ -83,25 +93,6 @@ void loop() {
 
 
   if(modem.loop(5000)){ // state was updated
-    if(modem.has_context(mqtt1.cid)){
-      if(!modem.MQTT_connected(mqtt1.clientID)){
-        if(modem.MQTT_connect(mqtt1.clientID,"test1",MQTT_USER_1,MQTT_PASSWORD_1,MQTT_HOST_1,1883))
-          modem.MQTT_subscribeTopics(mqtt1.clientID,++mqtt1.msg_id,topic,topic_qos,NUMITEMS(topic));
-      }
-    }else{
-      modem.open_pdp_context(mqtt1.cid);
-    }
-    #ifdef MULTI_MQTT
-      if(modem.has_context(mqtt2.cid)){
-        if(!modem.MQTT_connected(mqtt2.clientID)){
-          if(modem.MQTT_connect(mqtt2.clientID,"test2",MQTT_USER_2,MQTT_PASSWORD_2,MQTT_HOST_2,1883))
-            modem.MQTT_subscribeTopics(mqtt2.clientID,++mqtt2.msg_id,topic,topic_qos,NUMITEMS(topic));
-        }
-      }else{
-        modem.open_pdp_context(mqtt2.cid);
-      }
-    #endif
-
     modem.log_status();
   }
 
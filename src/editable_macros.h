@@ -4,9 +4,51 @@
 
 #define   MAX_CONNECTIONS       	4
 #define   MAX_TCP_CONNECTIONS     2
-#define   MAX_MQTT_CONNECTIONS    2
+#define   MAX_MQTT_CONNECTIONS    6 // mqtt clients 0-5
+#define   MAX_SSL_CONTEXTS        6 // ssl contexts 0-5
 #define   CONNECTION_BUFFER    		650 // bytes
+#define   TCP_READ_MIN        		64 // bytes, smallest AT+QIRD request
+#define   MAX_UDP_DATAGRAMS     	8 // datagrams kept on each buffer
+#define   UDP_MAX_DATAGRAM      	512 // bytes, biggest datagram received whole, up to CONNECTION_BUFFER
+#define   TCP_ACCEPT_QUEUE     		2 // connections waiting for tcp_accept
+#define   CLIENT_TX_BUFFER    		1460 // bytes, max AT+QISEND payload
 #define   CONNECTION_STATE   			10000 // millis
+#define   DNS_CACHE_SIZE      		4 // hosts
+#define   DNS_MAX_TTL         		3600 // seconds
 #define   SMS_CHECK_INTERVAL 			30000 // milli
+#define   TCP_MAX_UNACKED     		2048 // bytes waiting for ack before tcp_send is refused
+#define   TCP_SEND_STATUS_INTERVAL 	1000 // millis
+#define   TCP_TRANSPARENT_GUARD   	1000 // millis of silence around +++
+#define   TCP_POOL_IDLE_TIMEOUT   	120000 // millis before an idle pooled connection is closed
+#define   TCP_POOL_HEALTH_CHECK   	30000 // millis idle before state is checked on reuse
+#define   TCP_KEEPALIVE_IDLE      	1 // minutes
+#define   TCP_KEEPALIVE_INTERVAL  	30 // seconds
+#define   TCP_KEEPALIVE_COUNT     	3
 
-#define   MQTT_RECV_MODE    0
\ No newline at end of file
+#define   MQTT_RECV_MODE    0
+#define   MQTT_STATE_CHECK_INTERVAL 300000 // millis, state is kept from urcs, modem is queried only to confirm it
+#define   MQTT_RECONNECT_MIN      1000 // millis, first retry of a supervised client
+#define   MQTT_RECONNECT_MAX      300000 // millis
+#define   MQTT_SUPERVISOR_TOPICS  8 // subscriptions remembered per client
+#define   MQTT_INFLIGHT_WINDOW    8 // async publishes waiting for +QMTPUB
+#define   MQTT_INFLIGHT_TIMEOUT   20000 // millis
+#define   MQTT_RX_BUFFER          1024 // bytes, biggest mqtt payload received
+#define   MQTT_PAYLOAD_TIMEOUT    2000 // millis without bytes before a payload is given up
+#define   MQTT_ROUTE_NODES        32 // topic levels of subscriptions with handler
+#define   MQTT_BATCH_TOPICS       2 // topics that can be batched
+#define   MQTT_BATCH_SIZE         512 // bytes, payload of a batch
+#define   MQTT_BATCH_MAX_AGE      2000 // millis a message waits on batch
+// #define   MQTT_OUTBOX // keep messages published while disconnected on LittleFS
+#define   MQTT_OUTBOX_SIZE        32768 // bytes of circular log
+#define   MQTT_OUTBOX_DRAIN_INTERVAL 100 // millis between messages sent from outbox
+// #define   MQTT_JOURNAL // keep qos 1/2 publishes waiting for ack on LittleFS, replayed after reconnect
+#define   MQTT_JOURNAL_SLOTS      8 // publishes waiting for ack
+#define   MQTT_JOURNAL_PAYLOAD    512 // bytes, bigger payloads are not journaled
+#define   MQTT_JOURNAL_REPLAY_INTERVAL 1000 // millis between messages replayed
+#define   MQTT_DEDUP_ENTRIES      0 // received msg_ids remembered to discard redeliveries, 0 disables it
+#define   MQTT_DEDUP_WINDOW       30000 // millis a received msg_id is remembered
+// #define   MQTT_COMPRESSION // compress payloads of configured topics with lzss
+#define   MQTT_COMPRESS_TOPICS    4 // topics that can be compressed
+#define   MQTT_COMPRESS_BUFFER    1024 // bytes, biggest compressed or decompressed payload
+#define   MQTT_COMPRESS_SUFFIX    "/z" // appended to topic of compressed messages
+#define   LZSS_WINDOW             1024 // bytes searched back for matches, up to 4096
\ No newline at end of file
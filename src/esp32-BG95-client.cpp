@@ -0,0 +1,211 @@
+#include "esp32-BG95-client.hpp"
+
+MODEMBGXXClient::MODEMBGXXClient(MODEMBGXX *modem, uint8_t clientID, uint8_t contextID)
+{
+	bg = modem;
+	this->clientID = clientID;
+	this->contextID = contextID;
+}
+
+void MODEMBGXXClient::set_ssl(uint8_t sslClientID)
+{
+	ssl = true;
+	this->sslClientID = sslClientID;
+}
+
+int MODEMBGXXClient::connect(IPAddress ip, uint16_t port)
+{
+	return connect(ip.toString().c_str(), port);
+}
+
+int MODEMBGXXClient::connect(const char *host, uint16_t port)
+{
+	return connect(host, port, 10000);
+}
+
+int MODEMBGXXClient::connect(IPAddress ip, uint16_t port, int32_t timeout)
+{
+	return connect(ip.toString().c_str(), port, timeout);
+}
+
+int MODEMBGXXClient::connect(const char *host, uint16_t port, int32_t timeout)
+{
+	tx_len = 0;
+	rx_head = 0;
+	rx_len = 0;
+	clearWriteError();
+
+	uint16_t wait = 10000;
+	if (timeout > 0)
+		wait = timeout > 0xFFFF ? 0xFFFF : timeout;
+
+	if (ssl)
+		return bg->tcp_connect_ssl(contextID, sslClientID, clientID, String(host), port, wait);
+
+	return bg->tcp_connect(contextID, clientID, String(host), port, wait);
+}
+
+size_t MODEMBGXXClient::write(uint8_t b)
+{
+	return write(&b, 1);
+}
+
+size_t MODEMBGXXClient::write(const uint8_t *buf, size_t size)
+{
+	size_t written = 0;
+
+	while (written < size)
+	{
+		if (tx_len == CLIENT_TX_BUFFER)
+		{
+			flush();
+			if (tx_len != 0)
+				break; // connection is not accepting data
+		}
+
+		size_t len = size - written;
+		if (len > (size_t)(CLIENT_TX_BUFFER - tx_len))
+			len = CLIENT_TX_BUFFER - tx_len;
+
+		memcpy(&tx_buffer[tx_len], &buf[written], len);
+		tx_len += len;
+		written += len;
+	}
+
+	return written;
+}
+
+int MODEMBGXXClient::available()
+{
+	return (rx_len - rx_head) + bg->tcp_has_data(clientID);
+}
+
+int MODEMBGXXClient::read()
+{
+	uint8_t b;
+	if (read(&b, 1) != 1)
+		return -1;
+	return b;
+}
+
+int MODEMBGXXClient::read(uint8_t *buf, size_t size)
+{
+	if (tx_len > 0)
+		flush();
+
+	if (rx_head == rx_len && fill() == 0)
+	{
+		poll();
+		if (fill() == 0)
+			return -1;
+	}
+
+	size_t len = rx_len - rx_head;
+	if (len > size)
+		len = size;
+
+	memcpy(buf, &rx_buffer[rx_head], len);
+	rx_head += len;
+
+	return len;
+}
+
+int MODEMBGXXClient::peek()
+{
+	if (rx_head == rx_len && fill() == 0)
+	{
+		poll();
+		if (fill() == 0)
+			return -1;
+	}
+
+	return (uint8_t)rx_buffer[rx_head];
+}
+
+void MODEMBGXXClient::flush()
+{
+	if (tx_len == 0)
+		return;
+
+	uint32_t timeout = millis() + 10000;
+	while (timeout >= millis())
+	{
+		if (!bg->tcp_connected(clientID))
+			break;
+
+		// wait for remote to ack data already sent
+		if (!bg->tcp_writable(clientID, tx_len))
+		{
+			poll();
+			delay(AT_WAIT_RESPONSE);
+			continue;
+		}
+
+		if (bg->tcp_send(clientID, (const char *)tx_buffer, tx_len))
+		{
+			tx_len = 0;
+			return;
+		}
+		break;
+	}
+
+	// data can't be delivered, it is kept so write() reports it
+	setWriteError();
+}
+
+void MODEMBGXXClient::stop()
+{
+	flush();
+	bg->tcp_close(clientID);
+	tx_len = 0;
+	rx_head = 0;
+	rx_len = 0;
+}
+
+uint8_t MODEMBGXXClient::connected()
+{
+	if (tx_len > 0)
+		send_pending();
+
+	if (rx_head < rx_len || bg->tcp_has_data(clientID) > 0)
+		return 1;
+
+	poll();
+
+	if (bg->tcp_has_data(clientID) > 0)
+		return 1;
+
+	return bg->tcp_connected(clientID);
+}
+
+MODEMBGXXClient::operator bool()
+{
+	return bg->tcp_connected(clientID);
+}
+
+bool MODEMBGXXClient::send_pending()
+{
+	if (!bg->tcp_connected(clientID) || !bg->tcp_writable(clientID, tx_len))
+		return false;
+
+	if (!bg->tcp_send(clientID, (const char *)tx_buffer, tx_len))
+	{
+		setWriteError();
+		return false;
+	}
+
+	tx_len = 0;
+	return true;
+}
+
+uint16_t MODEMBGXXClient::fill()
+{
+	rx_head = 0;
+	rx_len = bg->tcp_recv(clientID, rx_buffer, sizeof(rx_buffer));
+	return rx_len;
+}
+
+void MODEMBGXXClient::poll()
+{
+	bg->tcp_poll();
+}
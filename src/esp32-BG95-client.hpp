@@ -0,0 +1,77 @@
+#ifndef ESP32_BG95_CLIENT_H
+#define ESP32_BG95_CLIENT_H
+
+#include <Arduino.h>
+#include <Client.h>
+
+#include "esp32-BG95.hpp"
+
+/*
+ * Arduino Client over a BG95 tcp connection.
+ * Small writes are coalesced into AT+QISEND payloads of up to CLIENT_TX_BUFFER bytes,
+ * reads are served from a local copy of the connection buffer.
+ * Call modem loop() as usual, pending writes are sent when the buffer is full, on flush() and read(),
+ * and on connected() if the connection can take them without waiting.
+ * available() only counts buffered data, modem is polled on read(), peek() and connected().
+ * Data that can't be delivered stays on the buffer and sets getWriteError()
+ */
+class MODEMBGXXClient : public Client
+{
+public:
+	/*
+	 * @modem - initialized modem
+	 * @clientID - connection id 0-11, yet it is limited to MAX_TCP_CONNECTIONS
+	 * @contextID - context id 1-16, yet it is limited to MAX_CONNECTIONS
+	 */
+	MODEMBGXXClient(MODEMBGXX *modem, uint8_t clientID, uint8_t contextID = 1);
+
+	/*
+	 * next connections will use ssl context sslClientID (0-5)
+	 */
+	void set_ssl(uint8_t sslClientID);
+
+	int connect(IPAddress ip, uint16_t port);
+	int connect(const char *host, uint16_t port);
+	/*
+	 * @timeout - millis to wait for connection
+	 */
+	int connect(IPAddress ip, uint16_t port, int32_t timeout);
+	int connect(const char *host, uint16_t port, int32_t timeout);
+	size_t write(uint8_t b);
+	size_t write(const uint8_t *buf, size_t size);
+	int available();
+	int read();
+	int read(uint8_t *buf, size_t size);
+	int peek();
+	/*
+	 * sends coalesced data, waits up to 10s for the connection to accept it.
+	 * On failure data is kept and write error is set
+	 */
+	void flush();
+	void stop();
+	uint8_t connected();
+	operator bool();
+
+private:
+	MODEMBGXX *bg;
+	uint8_t clientID;
+	uint8_t contextID;
+	bool ssl = false;
+	uint8_t sslClientID = 0;
+
+	uint8_t tx_buffer[CLIENT_TX_BUFFER];
+	uint16_t tx_len = 0;
+
+	char rx_buffer[CONNECTION_BUFFER];
+	uint16_t rx_head = 0;
+	uint16_t rx_len = 0;
+
+	// sends coalesced data if connection takes it now
+	bool send_pending();
+	// moves data from connection buffer to rx_buffer
+	uint16_t fill();
+	// reads pending urcs and connection data from modem
+	void poll();
+};
+
+#endif
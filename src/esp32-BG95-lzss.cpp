@@ -0,0 +1,128 @@
+#include "esp32-BG95-lzss.hpp"
+
+#define LZSS_MIN_MATCH 3
+#define LZSS_MAX_MATCH 18
+#define LZSS_MAX_OFFSET 4096
+
+/*
+ * byte i of dictionary followed by data
+ */
+static inline uint8_t lzss_at(const uint8_t *dict, size_t dict_len, const uint8_t *data, size_t i)
+{
+	return i < dict_len ? dict[i] : data[i - dict_len];
+}
+
+size_t lzss_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_size, const uint8_t *dict, size_t dict_len)
+{
+	if (dict == NULL)
+		dict_len = 0;
+
+	size_t window = LZSS_WINDOW < LZSS_MAX_OFFSET ? LZSS_WINDOW : LZSS_MAX_OFFSET;
+	size_t end = dict_len + in_len;
+	size_t pos = dict_len;
+	size_t o = 0;
+	size_t flags_index = 0;
+	uint8_t item = 8; // items on current group
+
+	while (pos < end)
+	{
+		if (item == 8)
+		{
+			if (o >= out_size)
+				return 0;
+			flags_index = o;
+			out[o++] = 0;
+			item = 0;
+		}
+
+		// longest match on window
+		size_t best_len = 0;
+		size_t best_distance = 0;
+		size_t max_len = end - pos < LZSS_MAX_MATCH ? end - pos : LZSS_MAX_MATCH;
+		size_t start = pos > window ? pos - window : 0;
+
+		if (max_len >= LZSS_MIN_MATCH)
+		{
+			for (size_t candidate = start; candidate < pos; candidate++)
+			{
+				size_t len = 0;
+				while (len < max_len && lzss_at(dict, dict_len, in, candidate + len) == in[pos - dict_len + len])
+					len++;
+
+				if (len > best_len)
+				{
+					best_len = len;
+					best_distance = pos - candidate;
+					if (len == max_len)
+						break;
+				}
+			}
+		}
+
+		if (best_len >= LZSS_MIN_MATCH)
+		{
+			if (o + 2 > out_size)
+				return 0;
+			size_t offset = best_distance - 1;
+			out[o++] = ((offset >> 4) & 0xF0) | (best_len - LZSS_MIN_MATCH);
+			out[o++] = offset & 0xFF;
+			pos += best_len;
+		}
+		else
+		{
+			if (o >= out_size)
+				return 0;
+			out[flags_index] |= 1 << item;
+			out[o++] = in[pos - dict_len];
+			pos++;
+		}
+		item++;
+	}
+
+	return o;
+}
+
+size_t lzss_decompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_size, const uint8_t *dict, size_t dict_len)
+{
+	if (dict == NULL)
+		dict_len = 0;
+
+	size_t i = 0;
+	size_t o = 0;
+
+	while (i < in_len)
+	{
+		uint8_t flags = in[i++];
+
+		for (uint8_t item = 0; item < 8 && i < in_len; item++)
+		{
+			if (flags & (1 << item))
+			{
+				if (o >= out_size)
+					return 0;
+				out[o++] = in[i++];
+				continue;
+			}
+
+			if (i + 2 > in_len)
+				return 0;
+
+			size_t len = (in[i] & 0x0F) + LZSS_MIN_MATCH;
+			size_t distance = (((size_t)(in[i] & 0xF0) << 4) | in[i + 1]) + 1;
+			i += 2;
+
+			if (distance > dict_len + o || o + len > out_size)
+				return 0;
+
+			// source may overlap with bytes being written
+			size_t from = dict_len + o - distance;
+			for (size_t k = 0; k < len; k++)
+			{
+				out[o] = lzss_at(dict, dict_len, out, from + k);
+				o++;
+			}
+		}
+	}
+
+	return o;
+}
@@ -0,0 +1,37 @@
+#ifndef ESP32_BG95_LZSS_H
+#define ESP32_BG95_LZSS_H
+
+#include <Arduino.h>
+
+#include "editable_macros.h"
+
+/*
+ * Small LZSS used to compress mqtt payloads and http bodies, no memory is allocated.
+ *
+ * Data is a sequence of groups: a flags byte followed by up to 8 items, bit i (lsb first) of flags
+ * is 1 for a literal byte and 0 for a match of 2 bytes: [offset 11..8 | length - 3] [offset 7..0],
+ * where offset is distance - 1 (up to 4096 bytes back) and length goes from 3 to 18.
+ *
+ * A dictionary, if used, works as if it was sent before data: matches can point into it.
+ * Compressor and decompressor must use the same dictionary
+ */
+
+/*
+ * compress in to out
+ *
+ * @dict - preset dictionary, NULL if not used
+ *
+ * returns compressed length, 0 if it doesn't fit on out_size
+ */
+size_t lzss_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_size, const uint8_t *dict = NULL, size_t dict_len = 0);
+
+/*
+ * decompress in to out
+ *
+ * @dict - preset dictionary used to compress data, NULL if not used
+ *
+ * returns decompressed length, 0 if data is invalid or it doesn't fit on out_size
+ */
+size_t lzss_decompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_size, const uint8_t *dict = NULL, size_t dict_len = 0);
+
+#endif
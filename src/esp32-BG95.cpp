@@ -1,7 +1,31 @@
 #include "esp32-BG95.hpp"
 
+#if defined(MQTT_OUTBOX) || defined(MQTT_JOURNAL)
+#include <LittleFS.h>
+#endif
+
+#ifdef MQTT_OUTBOX
+#define OUTBOX_LOG "/mqtt_outbox.log"
+#define OUTBOX_INDEX "/mqtt_outbox.idx"
+#define OUTBOX_WRAP 0xFFFF
+#define OUTBOX_SENT 0xFF
+#endif
+
+#ifdef MQTT_JOURNAL
+#define JOURNAL_FILE "/mqtt_journal.bin"
+#define JOURNAL_HEADER 10
+#define JOURNAL_TOPIC 64
+#define JOURNAL_RECORD (JOURNAL_HEADER + JOURNAL_TOPIC + MQTT_JOURNAL_PAYLOAD)
+#endif
+
 bool (*parseMQTTmessage)(uint8_t, String, String);
+bool (*parseMQTTclient[MAX_MQTT_CONNECTIONS])(uint8_t, String, String);
 void (*tcpOnClose)(uint8_t clientID);
+void (*tcpOnWritable)(uint8_t clientID);
+void (*mqttOnPublished)(uint8_t clientID, uint16_t msg_id, int8_t result);
+void (*mqttStreamBegin)(uint8_t clientID, const char *topic, uint32_t total_len);
+void (*mqttStreamData)(uint8_t clientID, const uint8_t *chunk, uint16_t len);
+void (*mqttStreamEnd)(uint8_t clientID, bool complete);
 void (*httpPendingCallback)(int16_t http_status, size_t content_length);
 void (*httpFinishedCallback)(void);
 void (*httpFailedCallback)(void);
@@ -23,7 +47,7 @@ void MODEMBGXX::init_port(uint32_t baudrate, uint32_t serial_config, uint8_t rx_
 #endif
 	while (modem->available())
 	{
-		String command = modem->readStringUntil(AT_TERMINATOR);
+		String command = read_line();
 
 		command.trim();
 
@@ -136,6 +160,9 @@ void MODEMBGXX::switchOn()
 
 bool MODEMBGXX::powerCycle()
 {
+#ifdef MQTT_JOURNAL
+	journal_session_lost(-1);
+#endif
 
 #ifdef DEBUG_BG95
 	log("power cycle modem");
@@ -177,10 +204,30 @@ bool MODEMBGXX::reset()
 		data_pending[i] = false;
 		tcp[i].connected = false;
 	}
+	accept_count = 0;
+	transparent_id = -1;
+	data_mode = false;
+	transparent_escape_at = 0;
+	transparent_confirming = false;
+	pool_keepalive_set = false;
+	for (uint8_t i = 0; i < MAX_SSL_CONTEXTS; i++)
+	{
+		ssl_applied[i].defined = false;
+	}
 	for (uint8_t i = 0; i < MAX_MQTT_CONNECTIONS; i++)
 	{
 		mqtt[i].connected = false;
+		mqtt[i].opened = false;
+		mqtt[i].socket_state = MQTT_STATE_DISCONNECTED;
+	}
+	for (uint8_t i = 0; i < MQTT_INFLIGHT_WINDOW; i++)
+	{
+		mqtt_inflight[i].used = false;
 	}
+#ifdef MQTT_JOURNAL
+	// acks of publishes in flight are lost with modem sessions
+	journal_session_lost(-1);
+#endif
 
 	return true;
 }
@@ -213,37 +260,353 @@ bool MODEMBGXX::set_error_message_format(int n)
 	return false;
 }
 
+/*
+ * applies ssl profile of ssl_cid, only settings that changed since last call are sent.
+ * Profile defaults: all ssl versions, all ciphersuites, no certificate verification, SNI on
+ *
+ * @ssl_cid - ssl context 0-5
+ *
+ * returns true if succeed
+ */
 bool MODEMBGXX::set_ssl(uint8_t ssl_cid)
 {
+	if (ssl_cid >= MAX_SSL_CONTEXTS)
+		return false;
+
+	ssl_default_profile(ssl_cid);
+
+	return ssl_apply(ssl_cid);
+}
+
+/*
+ * define ssl profile of ssl_cid, it is sent to modem only if something changed
+ *
+ * @ssl_cid - ssl context 0-5
+ * @sslversion - 0 SSL3.0, 1 TLS1.0, 2 TLS1.1, 3 TLS1.2, 4 all
+ * @ciphersuite - 0xFFFF for all
+ * @seclevel - 0 no authentication, 1 server authentication, 2 server and client authentication
+ * @sni - send server name indication
+ *
+ * returns true if succeed
+ */
+bool MODEMBGXX::ssl_configure(uint8_t ssl_cid, uint8_t sslversion, uint16_t ciphersuite, uint8_t seclevel, bool sni)
+{
+	if (ssl_cid >= MAX_SSL_CONTEXTS)
+		return false;
+
+	ssl_default_profile(ssl_cid); // defaults for fields not passed
+
+	SSLProfile *profile = &ssl_profile[ssl_cid];
+	profile->sslversion = sslversion;
+	profile->ciphersuite = ciphersuite;
+	profile->seclevel = seclevel;
+	profile->sni = sni;
 
-	if (!check_command("AT+QSSLCFG=\"sslversion\"," + String(ssl_cid) + ",4", "OK", "ERROR")) // allow all
-																							  // if(!check_command("AT+QSSLCFG=\"sslversion\","+String(ssl_cid)+",1","OK","ERROR")) // TLS v3.0
+	return ssl_apply(ssl_cid);
+}
+
+/*
+ * enable tls session resumption of ssl_cid (AT+QSSLCFG="session").
+ * Reconnections to the same server skip the full handshake
+ *
+ * returns true if succeed
+ */
+bool MODEMBGXX::ssl_session_resumption(uint8_t ssl_cid, bool enable)
+{
+	if (ssl_cid >= MAX_SSL_CONTEXTS)
 		return false;
 
-	if (!check_command("AT+QSSLCFG=\"ciphersuite\"," + String(ssl_cid) + ",0XFFFF", "OK", "ERROR")) // support all
-																									// if(!check_command("AT+QSSLCFG=\"ciphersuite\","+String(ssl_cid)+",0X0035","OK","ERROR")) // TLS_RSA_WITH_AES_256_CBC_SHA
+	ssl_default_profile(ssl_cid);
+
+	ssl_profile[ssl_cid].session = enable;
+
+	return ssl_apply(ssl_cid);
+}
+
+/*
+ * connect times of ssl_cid, measured from open command to its result (dns, tcp and tls handshake)
+ *
+ * @connects - number of successful connections
+ * @full_ms - connect time of last full handshake with current server
+ * @resumed_ms - average connect time of resumed sessions, only counted with session resumption enabled
+ *
+ * returns true if there are measures
+ */
+bool MODEMBGXX::ssl_metrics(uint8_t ssl_cid, uint32_t *connects, uint32_t *full_ms, uint32_t *resumed_ms)
+{
+	if (ssl_cid >= MAX_SSL_CONTEXTS)
 		return false;
 
-	// if(!check_command("AT+QSSLCFG=\"seclevel\","+String(ssl_cid)+",1","OK","ERROR")) // Verify server certificate
-	if (!check_command("AT+QSSLCFG=\"seclevel\"," + String(ssl_cid) + ",0", "OK", "ERROR")) // Don't verify server certificate
+	SSLProfile *profile = &ssl_profile[ssl_cid];
+
+	if (connects != NULL)
+		*connects = profile->connects;
+	if (full_ms != NULL)
+		*full_ms = profile->full_ms;
+	if (resumed_ms != NULL)
+		*resumed_ms = profile->resumed > 0 ? profile->resumed_total_ms / profile->resumed : 0;
+
+	return profile->connects > 0;
+}
+
+/*
+ * uploads certificates to UFS and binds them to ssl_cid with certificate verification.
+ * Files are named cacert<ssl_cid>.pem, client<ssl_cid>.pem and key<ssl_cid>.pem, a SHA-256 of
+ * each one is kept in <name>.sha and upload is skipped when modem's copy matches.
+ * seclevel is 1 (server authentication) or 2 if client certificate and key are passed
+ *
+ * @ssl_cid - ssl context 0-5
+ * @cacert - CA certificate (PEM)
+ * @clientcert - client certificate (PEM), NULL if not used
+ * @clientkey - client private key (PEM), NULL if not used
+ *
+ * returns true if succeed
+ */
+bool MODEMBGXX::ssl_set_certificates(uint8_t ssl_cid, const char *cacert, const char *clientcert, const char *clientkey)
+{
+	if (ssl_cid >= MAX_SSL_CONTEXTS || cacert == NULL)
 		return false;
 
-	if (!check_command("AT+QSSLCFG=\"SNI\"," + String(ssl_cid) + ",1", "OK", "ERROR")) // set SNI (required for some servers hosting multiple domains/certs on a single IP)
+	ssl_default_profile(ssl_cid);
+
+	SSLProfile *profile = &ssl_profile[ssl_cid];
+
+	String filename = "cacert" + String(ssl_cid) + ".pem";
+	if (!ssl_store_file(filename, (const uint8_t *)cacert, strlen(cacert)))
 		return false;
+	memset(profile->cacert, 0, sizeof(profile->cacert));
+	strncpy(profile->cacert, filename.c_str(), sizeof(profile->cacert) - 1);
+	profile->seclevel = 1;
+
+	if (clientcert != NULL && clientkey != NULL)
+	{
+		filename = "client" + String(ssl_cid) + ".pem";
+		if (!ssl_store_file(filename, (const uint8_t *)clientcert, strlen(clientcert)))
+			return false;
+		memset(profile->clientcert, 0, sizeof(profile->clientcert));
+		strncpy(profile->clientcert, filename.c_str(), sizeof(profile->clientcert) - 1);
+
+		filename = "key" + String(ssl_cid) + ".pem";
+		if (!ssl_store_file(filename, (const uint8_t *)clientkey, strlen(clientkey)))
+			return false;
+		memset(profile->clientkey, 0, sizeof(profile->clientkey));
+		strncpy(profile->clientkey, filename.c_str(), sizeof(profile->clientkey) - 1);
+
+		profile->seclevel = 2;
+	}
+
+	return ssl_apply(ssl_cid);
+}
+
+/*
+ * private - uploads file unless modem already has one with the same size and its <name>.sha sidecar,
+ * written on upload, holds the same SHA-256. Content of the file on modem is not read back
+ */
+bool MODEMBGXX::ssl_store_file(String filename, const uint8_t *data, size_t size)
+{
+	uint8_t digest[32];
+	sha256(data, size, digest);
+
+	String hash_filename = filename + ".sha";
+
+	// file must exist with the same size and its digest must match
+	if (check_command("AT+QFLST=\"" + filename + "\"", "+QFLST: \"" + filename + "\"," + String(size), 1000))
+	{
+		char stored[32];
+		size_t read_bytes = 0;
+		FILE_get_chunk(hash_filename, stored, sizeof(stored), 0, &read_bytes);
+		if (read_bytes == sizeof(stored) && memcmp(stored, digest, sizeof(digest)) == 0)
+		{
+#ifdef DEBUG_BG95
+			log(filename + " is up to date");
+#endif
+			return true;
+		}
+	}
+
+#ifdef DEBUG_BG95
+	log("uploading " + filename + " (" + String(size) + " bytes)");
+#endif
 
-	if (!check_command("AT+QSSLCFG=\"cacert\"," + String(ssl_cid) + ",\"cacert.pem\"", "OK", "ERROR")) // Not needed for seclevel 0
+	if (!FILE_upload(filename, data, size))
 		return false;
 
+	return FILE_upload(hash_filename, digest, sizeof(digest));
+}
+
+/*
+ * private - SHA-256 of data
+ */
+void MODEMBGXX::sha256(const uint8_t *data, size_t size, uint8_t *digest)
+{
+	mbedtls_md_init(&ctx);
+	mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0);
+	mbedtls_md_starts(&ctx);
+	mbedtls_md_update(&ctx, data, size);
+	mbedtls_md_finish(&ctx, digest);
+	mbedtls_md_free(&ctx);
+}
+
+/*
+ * private - fills profile with default settings if it was never configured, nothing is sent to modem
+ */
+void MODEMBGXX::ssl_default_profile(uint8_t ssl_cid)
+{
+	SSLProfile *profile = &ssl_profile[ssl_cid];
+	if (profile->defined)
+		return;
+
+	profile->defined = true;
+	profile->sslversion = 4;	   // allow all
+	profile->ciphersuite = 0xFFFF; // support all
+	profile->seclevel = 0;		   // Don't verify server certificate
+	profile->sni = true;		   // required for some servers hosting multiple domains/certs on a single IP
+	profile->session = false;
+	strncpy(profile->cacert, "cacert.pem", sizeof(profile->cacert) - 1); // Not needed for seclevel 0
+}
+
+/*
+ * private - sends settings of ssl profile that differ from the ones already on modem
+ */
+bool MODEMBGXX::ssl_apply(uint8_t ssl_cid)
+{
+	SSLProfile *profile = &ssl_profile[ssl_cid];
+	SSLProfile *modem_profile = &ssl_applied[ssl_cid];
+	String id = String(ssl_cid);
+	bool all = !modem_profile->defined;
+
+	if (all || profile->sslversion != modem_profile->sslversion)
+	{
+		if (!check_command("AT+QSSLCFG=\"sslversion\"," + id + "," + String(profile->sslversion), "OK", "ERROR"))
+			return false;
+		modem_profile->sslversion = profile->sslversion;
+	}
+
+	if (all || profile->ciphersuite != modem_profile->ciphersuite)
+	{
+		char ciphersuite[8];
+		snprintf(ciphersuite, sizeof(ciphersuite), "0X%04X", profile->ciphersuite);
+		if (!check_command("AT+QSSLCFG=\"ciphersuite\"," + id + "," + String(ciphersuite), "OK", "ERROR"))
+			return false;
+		modem_profile->ciphersuite = profile->ciphersuite;
+	}
+
+	if (all || profile->seclevel != modem_profile->seclevel)
+	{
+		if (!check_command("AT+QSSLCFG=\"seclevel\"," + id + "," + String(profile->seclevel), "OK", "ERROR"))
+			return false;
+		modem_profile->seclevel = profile->seclevel;
+	}
+
+	if (all || profile->sni != modem_profile->sni)
+	{
+		if (!check_command("AT+QSSLCFG=\"SNI\"," + id + "," + String(profile->sni), "OK", "ERROR"))
+			return false;
+		modem_profile->sni = profile->sni;
+	}
+
+	if (all || strcmp(profile->cacert, modem_profile->cacert) != 0)
+	{
+		if (!check_command("AT+QSSLCFG=\"cacert\"," + id + ",\"" + String(profile->cacert) + "\"", "OK", "ERROR"))
+			return false;
+		memcpy(modem_profile->cacert, profile->cacert, sizeof(profile->cacert));
+	}
+
+	if (strlen(profile->clientcert) > 0 && (all || strcmp(profile->clientcert, modem_profile->clientcert) != 0))
+	{
+		if (!check_command("AT+QSSLCFG=\"clientcert\"," + id + ",\"" + String(profile->clientcert) + "\"", "OK", "ERROR"))
+			return false;
+		memcpy(modem_profile->clientcert, profile->clientcert, sizeof(profile->clientcert));
+	}
+
+	if (strlen(profile->clientkey) > 0 && (all || strcmp(profile->clientkey, modem_profile->clientkey) != 0))
+	{
+		if (!check_command("AT+QSSLCFG=\"clientkey\"," + id + ",\"" + String(profile->clientkey) + "\"", "OK", "ERROR"))
+			return false;
+		memcpy(modem_profile->clientkey, profile->clientkey, sizeof(profile->clientkey));
+	}
+
+	if (all || profile->session != modem_profile->session)
+	{
+		if (!check_command("AT+QSSLCFG=\"session\"," + id + "," + String(profile->session), "OK", "ERROR"))
+			return false;
+		modem_profile->session = profile->session;
+	}
+
+	modem_profile->defined = true;
 	return true;
 }
 
+/*
+ * private - stores connect time of a successful ssl connection.
+ * It is counted as resumed only if session resumption is enabled on modem and server is the same as before
+ */
+void MODEMBGXX::ssl_record_connect(uint8_t ssl_cid, String host, uint32_t duration)
+{
+	if (ssl_cid >= MAX_SSL_CONTEXTS)
+		return;
+
+	SSLProfile *profile = &ssl_profile[ssl_cid];
+	profile->connects++;
+
+	bool same_host = host == profile->last_host;
+	if (!same_host)
+	{
+		// new server, resumed times of previous one don't apply
+		memset(profile->last_host, 0, sizeof(profile->last_host));
+		strncpy(profile->last_host, host.c_str(), sizeof(profile->last_host) - 1);
+		profile->resumed = 0;
+		profile->resumed_total_ms = 0;
+	}
+
+	if (same_host && ssl_applied[ssl_cid].session)
+	{
+		profile->resumed++;
+		profile->resumed_total_ms += duration;
+	}
+	else
+		profile->full_ms = duration;
+
+#ifdef DEBUG_BG95
+	log("ssl connect to " + host + " took " + String(duration) + " ms");
+#endif
+}
+
 bool MODEMBGXX::loop(uint32_t wait)
 {
 
+	// uart is a pipe to the transparent connection, no commands can be sent
+	if (data_mode)
+	{
+		tcp_transparent_read();
+		return false;
+	}
+
 	check_messages();
 
+	tcp_check_close_pending();
+
 	tcp_check_data_pending();
 
+	tcp_check_send_window();
+
+	tcp_pool_check();
+
+	dns_check_prefetch();
+
+	mqtt_check_inflight();
+
+	mqtt_check_batches();
+
+	mqtt_supervise();
+
+#ifdef MQTT_OUTBOX
+	outbox_drain();
+#endif
+#ifdef MQTT_JOURNAL
+	journal_replay();
+#endif
+
 	if (MQTT_RECV_MODE)
 	{
 		for (uint8_t i = 0; i < MAX_MQTT_CONNECTIONS; i++)
@@ -321,6 +684,32 @@ void MODEMBGXX::log_status()
 			log("tcp server: " + String(tcp[i].server) + ":" + String(tcp[i].port) + " connected");
 		else
 			log("tcp server: " + String(tcp[i].server) + ":" + String(tcp[i].port) + " disconnected");
+
+		TCPStats *stats = &tcp[i].stats;
+		uint32_t elapsed = (millis() - stats->since) / 1000;
+		if (elapsed == 0)
+			elapsed = 1;
+		String line = "  tx " + String(stats->bytes_sent) + " B (" + String(stats->bytes_sent / elapsed) + " B/s)";
+		line += ", rx " + String(stats->bytes_received) + " B (" + String(stats->bytes_received / elapsed) + " B/s)";
+		line += ", dropped " + String(stats->dropped_bytes) + " B, buffer peak " + String(stats->buffer_high_water);
+		log(line);
+		if (stats->sends > 0)
+			log("  prompt avg " + String(stats->prompt_ms_total / stats->sends) + " ms max " + String(stats->prompt_ms_max) +
+				" ms, send ok avg " + String(stats->send_ok_ms_total / stats->sends) + " ms max " + String(stats->send_ok_ms_max) + " ms");
+		if (stats->reads > 0)
+			log("  read avg " + String(stats->read_ms_total / stats->reads) + " ms max " + String(stats->read_ms_max) + " ms");
+	}
+
+	for (uint8_t i = 0; i < MAX_SSL_CONTEXTS; i++)
+	{
+		if (ssl_profile[i].connects == 0)
+			continue;
+		uint32_t connects = 0, full_ms = 0, resumed_ms = 0;
+		ssl_metrics(i, &connects, &full_ms, &resumed_ms);
+		String line = "ssl " + String(i) + ": " + String(connects) + " connects, full handshake " + String(full_ms) + " ms";
+		if (resumed_ms > 0)
+			line += ", resumed " + String(resumed_ms) + " ms (saved " + String((int32_t)(full_ms - resumed_ms)) + " ms)";
+		log(line);
 	}
 
 	for (uint8_t i = 0; i < MAX_MQTT_CONNECTIONS; i++)
@@ -483,7 +872,7 @@ void MODEMBGXX::check_sms()
 	{
 		if (modem->available())
 		{
-			String response = modem->readStringUntil(AT_TERMINATOR);
+			String response = read_line();
 
 			response.trim();
 			if (response.length() == 0)
@@ -501,7 +890,7 @@ void MODEMBGXX::check_sms()
 
 			if (!response.startsWith("+CMGL:"))
 			{
-				TIMEIT(response = parse_command_line(response, true));
+				response = parse_command_line(response, true);
 				continue;
 			}
 
@@ -553,7 +942,7 @@ void MODEMBGXX::check_sms()
 
 			if (modem->available())
 			{
-				String ret = modem->readStringUntil(AT_TERMINATOR);
+				String ret = read_line();
 				ret.trim();
 				msg = ret;
 #ifdef DEBUG_BG95
@@ -650,6 +1039,12 @@ void MODEMBGXX::tcp_set_callback_on_close(void (*callback)(uint8_t clientID))
 
 	tcpOnClose = callback;
 }
+
+void MODEMBGXX::tcp_set_callback_on_writable(void (*callback)(uint8_t clientID))
+{
+
+	tcpOnWritable = callback;
+}
 /*
  * connect to a host:port
  *
@@ -661,31 +1056,7 @@ void MODEMBGXX::tcp_set_callback_on_close(void (*callback)(uint8_t clientID))
  */
 bool MODEMBGXX::tcp_connect(uint8_t clientID, String host, uint16_t port, uint16_t wait)
 {
-
-	uint8_t contextID = 1;
-	if (apn_connected(contextID) != 1)
-		return false;
-
-	if (clientID >= MAX_TCP_CONNECTIONS)
-		return false;
-
-	memset(tcp[clientID].server, 0, sizeof(tcp[clientID].server));
-	memcpy(tcp[clientID].server, host.c_str(), host.length());
-	tcp[clientID].port = port;
-	tcp[clientID].active = true;
-	tcp[clientID].ssl = false;
-
-	if (check_command_no_ok("AT+QIOPEN=" + String(contextID) + "," + String(clientID) + ",\"TCP\",\"" + host + "\"," + String(port), "+QIOPEN: " + String(clientID) + ",0", "ERROR"), wait)
-	{
-		tcp[clientID].connected = true;
-		return true;
-	}
-	else
-		tcp_close(clientID);
-
-	get_command("AT+QIGETERROR");
-
-	return false;
+	return tcp_open(1, clientID, SOCKET_TCP, host, port, 0, wait);
 }
 
 /*
@@ -700,30 +1071,26 @@ bool MODEMBGXX::tcp_connect(uint8_t clientID, String host, uint16_t port, uint16
  */
 bool MODEMBGXX::tcp_connect(uint8_t contextID, uint8_t clientID, String host, uint16_t port, uint16_t wait)
 {
-	if (apn_connected(contextID) != 1)
-		return false;
-
-	if (contextID == 0 || contextID > MAX_CONNECTIONS)
-		return false;
-
-	if (clientID >= MAX_TCP_CONNECTIONS)
-		return false;
-
-	memset(tcp[clientID].server, 0, sizeof(tcp[clientID].server));
-	memcpy(tcp[clientID].server, host.c_str(), host.length());
-	tcp[clientID].port = port;
-	tcp[clientID].active = true;
-	tcp[clientID].ssl = false;
-
-	if (check_command_no_ok("AT+QIOPEN=" + String(contextID) + "," + String(clientID) + ",\"TCP\",\"" + host + "\"," + String(port), "+QIOPEN: " + String(clientID) + ",0", "ERROR"), wait)
-	{
-		tcp[clientID].connected = true;
-		return true;
-	}
-	else
-		tcp_close(clientID);
+	return tcp_open(contextID, clientID, SOCKET_TCP, host, port, 0, wait);
+}
 
-	get_command("AT+QIGETERROR");
+/*
+ * connect to a host:port
+ *
+ * @ccontextID - context id 1-16, yet it is limited to MAX_CONNECTIONS
+ * @clientID - connection id 0-11, yet it is limited to MAX_TCP_CONNECTIONS
+ * @proto - "TCP" or "UDP"
+ * @host - can be IP or DNS
+ * @wait - maximum time to wait for at command response in ms
+ *
+ * return true if connection was established
+ */
+bool MODEMBGXX::tcp_connect(uint8_t contextID, uint8_t clientID, String proto, String host, uint16_t port, uint16_t wait)
+{
+	if (proto == "UDP")
+		return tcp_open(contextID, clientID, SOCKET_UDP, host, port, 0, wait);
+	else if (proto == "TCP")
+		return tcp_open(contextID, clientID, SOCKET_TCP, host, port, 0, wait);
 
 	return false;
 }
@@ -756,10 +1123,21 @@ bool MODEMBGXX::tcp_connect_ssl(uint8_t contextID, uint8_t sslClientID, uint8_t
 	tcp[clientID].active = true;
 	tcp[clientID].ssl = true;
 	tcp[clientID].sslClientID = sslClientID;
+	buffer_len[clientID] = 0;
+	tcp[clientID].proto = SOCKET_TCP;
+	datagram_count[clientID] = 0;
 
-	if (check_command_no_ok("AT+QSSLOPEN=" + String(contextID) + "," + String(sslClientID) + "," + String(clientID) + ",\"" + host + "\"," + String(port), "+QSSLOPEN: " + String(clientID) + ",0", "ERROR"), wait)
+	String s = "AT+QSSLOPEN=" + String(contextID) + "," + String(sslClientID) + "," + String(clientID) + ",\"" + host + "\"," + String(port);
+	if (tcp[clientID].access_mode != TCP_ACCESS_BUFFER)
+		s += "," + String(tcp[clientID].access_mode);
+
+	uint32_t start = millis();
+	if (check_command_no_ok(s, "+QSSLOPEN: " + String(clientID) + ",0", "ERROR", wait))
 	{
+		ssl_record_connect(sslClientID, host, millis() - start);
 		tcp[clientID].connected = true;
+		tcp_reset_send_window(clientID);
+		tcp_reset_stats(clientID);
 		return true;
 	}
 	else
@@ -771,2183 +1149,5543 @@ bool MODEMBGXX::tcp_connect_ssl(uint8_t contextID, uint8_t sslClientID, uint8_t
 }
 
 /*
- * return tcp connection status
+ * open an udp socket to send datagrams to host:port
+ *
+ * @contextID - context id 1-16, yet it is limited to MAX_CONNECTIONS
+ * @clientID - connection id 0-11, yet it is limited to MAX_TCP_CONNECTIONS
+ * @host - can be IP or DNS
+ * @wait - maximum time to wait for at command response in ms
+ *
+ * return true if socket was opened
  */
-bool MODEMBGXX::tcp_connected(uint8_t clientID)
+bool MODEMBGXX::udp_connect(uint8_t contextID, uint8_t clientID, String host, uint16_t port, uint16_t wait)
 {
-
-	if (clientID >= MAX_TCP_CONNECTIONS)
-		return false;
-	return tcp[clientID].connected;
+	return tcp_open(contextID, clientID, SOCKET_UDP, host, port, 0, wait);
 }
+
 /*
- * close tcp connection
+ * open an udp service socket, it receives datagrams from any host and sends with udp_send_to
  *
- * return tcp connection status
+ * @contextID - context id 1-16, yet it is limited to MAX_CONNECTIONS
+ * @clientID - connection id 0-11, yet it is limited to MAX_TCP_CONNECTIONS
+ * @local_port - port to listen on
+ * @wait - maximum time to wait for at command response in ms
+ *
+ * return true if socket was opened
  */
-bool MODEMBGXX::tcp_close(uint8_t clientID)
+bool MODEMBGXX::udp_open_service(uint8_t contextID, uint8_t clientID, uint16_t local_port, uint16_t wait)
 {
+	return tcp_open(contextID, clientID, SOCKET_UDP_SERVICE, "127.0.0.1", 0, local_port, wait);
+}
 
-	if (clientID >= MAX_TCP_CONNECTIONS)
-		return false;
-
-	tcp[clientID].active = false;
-	connected_since[clientID] = 0;
-	data_pending[clientID] = false;
-
-	if (tcp[clientID].ssl)
-	{
-		if (check_command("AT+QSSLCLOSE=" + String(clientID), "OK", "ERROR", 10000))
-		{
-			tcp[clientID].connected = false;
-			if (tcpOnClose != NULL)
-				tcpOnClose(clientID);
-		}
-	}
-	else
-	{
-		if (check_command("AT+QICLOSE=" + String(clientID), "OK", "ERROR", 10000))
-		{
-			tcp[clientID].connected = false;
-			if (tcpOnClose != NULL)
-				tcpOnClose(clientID);
-		}
-	}
-
-	return tcp[clientID].connected;
-}
 /*
- * send data through open channel
+ * open a tcp listener, accepted connections are retrieved with tcp_accept.
+ * Modem assigns connectIDs of incoming connections, those not under MAX_TCP_CONNECTIONS are refused
  *
- * returns true if succeed
+ * @contextID - context id 1-16, yet it is limited to MAX_CONNECTIONS
+ * @clientID - connection id 0-11, yet it is limited to MAX_TCP_CONNECTIONS
+ * @local_port - port to listen on
+ * @wait - maximum time to wait for at command response in ms
+ *
+ * return true if listener was opened
  */
-bool MODEMBGXX::tcp_send(uint8_t clientID, const char *data, uint16_t size)
+bool MODEMBGXX::tcp_listen(uint8_t contextID, uint8_t clientID, uint16_t local_port, uint16_t wait)
 {
-	if (clientID >= MAX_CONNECTIONS)
-		return false;
-	if (tcp_connected(clientID) == 0)
-		return false;
+	return tcp_open(contextID, clientID, SOCKET_TCP_LISTENER, "127.0.0.1", 0, local_port, wait);
+}
 
-	while (modem->available())
+/*
+ * takes the oldest connection accepted by a listener
+ *
+ * @serverID - clientID used on tcp_listen
+ * @remote_ip - if not NULL, filled with remote ip
+ * @remote_port - if not NULL, filled with remote port
+ *
+ * returns clientID of the accepted connection, -1 if there is none.
+ * Use it with tcp_send, tcp_recv and tcp_close
+ */
+int8_t MODEMBGXX::tcp_accept(uint8_t serverID, String *remote_ip, uint16_t *remote_port)
+{
+	for (uint8_t i = 0; i < accept_count; i++)
 	{
-		String line = modem->readStringUntil(AT_TERMINATOR);
+		if (accept_queue[i].serverID != serverID)
+			continue;
 
-		line.trim();
+		int8_t clientID = accept_queue[i].connectID;
+		if (remote_ip != NULL)
+			*remote_ip = String(tcp[clientID].server);
+		if (remote_port != NULL)
+			*remote_port = tcp[clientID].port;
 
-		parse_command_line(line, true);
+		accept_count--;
+		for (uint8_t j = i; j < accept_count; j++)
+			accept_queue[j] = accept_queue[j + 1];
+
+		return clientID;
 	}
 
-	while (modem->available())
-		modem->read(); // delete garbage on buffer
+	return -1;
+}
 
-	if (tcp[clientID].ssl)
-	{
-		if (!check_command_no_ok("AT+QSSLSEND=" + String(clientID) + "," + String(size), ">", "ERROR"))
-			return false;
-	}
-	else
+/*
+ * returns number of connections waiting on tcp_accept for serverID
+ */
+uint8_t MODEMBGXX::tcp_pending_accepts(uint8_t serverID)
+{
+	uint8_t counter = 0;
+	for (uint8_t i = 0; i < accept_count; i++)
 	{
-		if (!check_command_no_ok("AT+QISEND=" + String(clientID) + "," + String(size), ">", "ERROR"))
-			return false;
+		if (accept_queue[i].serverID == serverID)
+			counter++;
 	}
+	return counter;
+}
 
-	send_command(data, size);
-	delay(AT_WAIT_RESPONSE);
+/*
+ * private - registers a connection reported by +QIURC: "incoming"
+ *
+ * @params - <connectID>,<serverID>,"<remote ip>",<remote port>
+ */
+void MODEMBGXX::tcp_incoming(String params)
+{
+	int8_t index = params.indexOf(",");
+	if (index == -1)
+		return;
 
-	uint32_t timeout = millis() + 10000;
-	String new_data_command = "";
+	uint8_t connectID = params.substring(0, index).toInt();
+	params = params.substring(index + 1);
 
-	while (timeout >= millis())
-	{
-		if (modem->available())
-		{
-			String line = modem->readStringUntil(AT_TERMINATOR);
+	index = params.indexOf(",");
+	if (index == -1)
+		return;
 
-			line.trim();
+	uint8_t serverID = params.substring(0, index).toInt();
+	params = params.substring(index + 1);
 
-			if (line.length() == 0)
-				continue;
+	index = params.lastIndexOf(",");
+	if (index == -1)
+		return;
+
+	String ip = params.substring(0, index);
+	ip.replace("\"", "");
+	uint16_t port = params.substring(index + 1).toInt();
+
+	if (connectID >= MAX_TCP_CONNECTIONS || accept_count >= TCP_ACCEPT_QUEUE)
+	{
+		log("incoming connection from " + ip + " refused");
+		if (connectID < 16)
+			close_pending |= 1 << connectID;
+		return;
+	}
 
-// log("[send] ? '" + line + "'");
 #ifdef DEBUG_BG95
-			log("parse: " + line);
+	log("incoming connection " + String(connectID) + " from " + ip + ":" + String(port));
 #endif
-			parse_command_line(line, true);
-
-			if (line.indexOf("SEND OK") > -1 || line.indexOf("OK") > -1)
-				return true;
-		}
 
-		delay(AT_WAIT_RESPONSE);
+	memset(tcp[connectID].server, 0, sizeof(tcp[connectID].server));
+	strncpy(tcp[connectID].server, ip.c_str(), sizeof(tcp[connectID].server) - 1);
+	tcp[connectID].port = port;
+	if (serverID < MAX_TCP_CONNECTIONS)
+	{
+		tcp[connectID].contextID = tcp[serverID].contextID;
+		tcp[connectID].access_mode = tcp[serverID].access_mode;
 	}
+	tcp[connectID].active = true;
+	tcp[connectID].connected = true;
+	tcp[connectID].ssl = false;
+	tcp[connectID].proto = SOCKET_TCP;
+	buffer_len[connectID] = 0;
+	data_pending[connectID] = false;
+	datagram_count[connectID] = 0;
+	tcp_reset_send_window(connectID);
+	tcp_reset_stats(connectID);
+
+	accept_queue[accept_count].connectID = connectID;
+	accept_queue[accept_count].serverID = serverID;
+	accept_count++;
+}
 
-	tcp_check_data_pending();
+/*
+ * private - closes connections flagged while parsing urcs
+ */
+void MODEMBGXX::tcp_check_close_pending()
+{
+	for (uint8_t id = 0; id < 16 && close_pending != 0; id++)
+	{
+		if ((close_pending & (1 << id)) == 0)
+			continue;
 
-	return false;
+		close_pending &= ~(1 << id);
+		if (id < MAX_TCP_CONNECTIONS && tcp[id].active)
+			tcp_close(id);
+		else
+			check_command("AT+QICLOSE=" + String(id), "OK", "ERROR", 10000);
+	}
 }
+
 /*
- * copies data to pointer if available
+ * private - opens a socket in buffer access mode
  *
- * returns len of data copied
+ * @proto - one of SOCKET_TCP, SOCKET_UDP, SOCKET_UDP_SERVICE, SOCKET_TCP_LISTENER
+ * @local_port - 0 lets modem choose
+ *
+ * return true if socket was opened
  */
-uint16_t MODEMBGXX::tcp_recv(uint8_t clientID, char *data, uint16_t size)
+bool MODEMBGXX::tcp_open(uint8_t contextID, uint8_t clientID, uint8_t proto, String host, uint16_t port, uint16_t local_port, uint16_t wait)
 {
+	if (apn_connected(contextID) != 1)
+		return false;
+
+	if (contextID == 0 || contextID > MAX_CONNECTIONS)
+		return false;
 
 	if (clientID >= MAX_TCP_CONNECTIONS)
 		return false;
 
-	if (buffer_len[clientID] == 0)
-		return 0;
+	String service_type = "";
+	switch (proto)
+	{
+	case SOCKET_TCP:
+		service_type = "TCP";
+		break;
+	case SOCKET_UDP:
+		service_type = "UDP";
+		break;
+	case SOCKET_UDP_SERVICE:
+		service_type = "UDP SERVICE";
+		break;
+	case SOCKET_TCP_LISTENER:
+		service_type = "TCP LISTENER";
+		break;
+	default:
+		return false;
+	}
 
-	uint16_t i;
+	// only one connection can be in transparent mode
+	if (tcp[clientID].access_mode == TCP_ACCESS_TRANSPARENT && transparent_id != -1)
+		return false;
 
-	if (buffer_len[clientID] < size)
-		size = buffer_len[clientID];
+	memset(tcp[clientID].server, 0, sizeof(tcp[clientID].server));
+	memcpy(tcp[clientID].server, host.c_str(), host.length());
+	tcp[clientID].port = port;
+	tcp[clientID].contextID = contextID;
+	tcp[clientID].active = true;
+	tcp[clientID].ssl = false;
+	tcp[clientID].proto = proto;
+	buffer_len[clientID] = 0;
+	datagram_count[clientID] = 0;
 
-	for (i = 0; i < size; i++)
-	{
-		data[i] = buffers[clientID][i];
-	}
+	String address = host;
+	if (proto == SOCKET_TCP || proto == SOCKET_UDP)
+		address = dns_resolve(contextID, host);
+
+	String s = "AT+QIOPEN=" + String(contextID) + "," + String(clientID) + ",\"" + service_type + "\",\"" + address + "\"," + String(port);
+	if (local_port != 0 || tcp[clientID].access_mode != TCP_ACCESS_BUFFER)
+		s += "," + String(local_port) + "," + String(tcp[clientID].access_mode);
 
-	if (buffer_len[clientID] > size)
+	if (tcp[clientID].access_mode == TCP_ACCESS_TRANSPARENT)
 	{
-		for (i = size; i < buffer_len[clientID]; i++)
+		if (check_command_no_ok(s, "CONNECT", "ERROR", wait))
 		{
-			buffers[clientID][i - size] = buffers[clientID][i];
+			tcp[clientID].connected = true;
+			tcp_reset_send_window(clientID);
+			tcp_reset_stats(clientID);
+			transparent_id = clientID;
+			transparent_last_write = millis();
+			data_mode = true;
+			return true;
 		}
+		tcp_close(clientID);
+	}
+	else if (check_command_no_ok(s, "+QIOPEN: " + String(clientID) + ",0", "ERROR", wait))
+	{
+		tcp[clientID].connected = true;
+		tcp_reset_send_window(clientID);
+		tcp_reset_stats(clientID);
+		return true;
 	}
+	else
+		tcp_close(clientID);
 
-	buffer_len[clientID] -= size;
+	// cached address may be outdated
+	if (address != host)
+		dns_invalidate(contextID, host);
 
-	return size;
+	get_command("AT+QIGETERROR");
+
+	return false;
 }
+
 /*
- * returns len of data available for clientID
+ * select how data is received on next connections of clientID
+ *
+ * @mode - TCP_ACCESS_BUFFER: modem keeps data until it is read with AT+QIRD (default)
+ *         TCP_ACCESS_PUSH: data is sent by modem after +QIURC: "recv" and stored directly on buffer,
+ *         a tcp connection is closed if its buffer overflows
+ *         TCP_ACCESS_TRANSPARENT: after connect, uart is a pipe to the connection (only one at a time).
+ *         loop() only moves received data to buffer until tcp_transparent_escape is called
+ *
+ * returns true if mode is supported
  */
-uint16_t MODEMBGXX::tcp_has_data(uint8_t clientID)
+bool MODEMBGXX::tcp_set_access_mode(uint8_t clientID, uint8_t mode)
 {
-
 	if (clientID >= MAX_TCP_CONNECTIONS)
-		return 0;
+		return false;
 
-	return buffer_len[clientID];
+	if (mode != TCP_ACCESS_BUFFER && mode != TCP_ACCESS_PUSH && mode != TCP_ACCESS_TRANSPARENT)
+		return false;
+
+	tcp[clientID].access_mode = mode;
+	return true;
 }
 
-String MODEMBGXX::get_subscriber_number(uint16_t wait)
+/*
+ * return tcp connection status
+ */
+bool MODEMBGXX::tcp_connected(uint8_t clientID)
 {
-	return "";
-
-	uint32_t timeout = millis() + wait;
 
-	send_command("AT+CNUM");
-	delay(AT_WAIT_RESPONSE);
+	if (clientID >= MAX_TCP_CONNECTIONS)
+		return false;
+	return tcp[clientID].connected;
+}
+/*
+ * close tcp connection
+ *
+ * return tcp connection status
+ */
+bool MODEMBGXX::tcp_close(uint8_t clientID)
+{
 
-	String number;
+	if (clientID >= MAX_TCP_CONNECTIONS)
+		return false;
 
-	while (timeout >= millis())
+	if (data_mode && clientID == transparent_id)
 	{
-		if (modem->available())
-		{
-			String response = modem->readStringUntil(AT_TERMINATOR);
-
-			response.trim();
+		if (!tcp_transparent_escape())
+			return tcp[clientID].connected;
+	}
 
-			if (response.length() == 0)
-				continue;
+	tcp[clientID].active = false;
+	tcp[clientID].pooled = false;
+	tcp[clientID].in_use = false;
+	connected_since[clientID] = 0;
+	data_pending[clientID] = false;
 
-			if (response != "ERROR" && isNumeric(response))
-			{
-#ifdef DEBUG_BG95
-				log("[number] response = '" + response + "'");
-#endif
-			}
+	if (tcp[clientID].proto == SOCKET_TCP_LISTENER)
+	{
+		// connections not accepted yet are closed with the listener
+		int8_t connectID = tcp_accept(clientID);
+		while (connectID > -1)
+		{
+			tcp_close(connectID);
+			connectID = tcp_accept(clientID);
 		}
+	}
 
-		delay(AT_WAIT_RESPONSE);
+	if (tcp[clientID].ssl)
+	{
+		if (check_command("AT+QSSLCLOSE=" + String(clientID), "OK", "ERROR", 10000))
+		{
+			tcp[clientID].connected = false;
+			if (tcpOnClose != NULL)
+				tcpOnClose(clientID);
+		}
+	}
+	else
+	{
+		if (check_command("AT+QICLOSE=" + String(clientID), "OK", "ERROR", 10000))
+		{
+			tcp[clientID].connected = false;
+			if (tcpOnClose != NULL)
+				tcpOnClose(clientID);
+		}
 	}
 
-	return "";
+	if (clientID == transparent_id && !tcp[clientID].connected)
+		transparent_id = -1;
+
+	return tcp[clientID].connected;
 }
 
 /*
- * returns the state of context id
+ * configure tcp keepalive of connections opened after this call (AT+QICFG="tcp/keepalive")
+ *
+ * @idle - minutes without traffic before probing 1-120
+ * @interval - seconds between probes 25-100
+ * @count - probes before connection is dropped 1-10
+ *
+ * returns true if succeed
  */
-String MODEMBGXX::check_context_state(uint8_t contextID)
+bool MODEMBGXX::tcp_keepalive(uint8_t idle, uint8_t interval, uint8_t count)
 {
+	String s = "AT+QICFG=\"tcp/keepalive\",1," + String(idle) + "," + String(interval) + "," + String(count);
+	if (!check_command(s, "OK", "ERROR", 1000))
+		return false;
 
-	if (contextID == 0 || contextID > MAX_CONNECTIONS)
-		return "";
-
-	String query = "AT+QISTATE=0," + String(contextID);
-	return get_command(query);
+	pool_keepalive_set = true;
+	return true;
 }
 
 /*
- * returns the state of connection id
+ * get a connection to host:port from the pool, opening it if there is no idle one.
+ * Idle connections are kept with tcp keepalive and closed after TCP_POOL_IDLE_TIMEOUT
+ *
+ * @contextID - context id 1-16, yet it is limited to MAX_CONNECTIONS
+ * @host - can be IP or DNS
+ * @sslClientID - ssl context 0-5, -1 for plain tcp
+ * @wait - maximum time to wait for at command response in ms
+ *
+ * returns clientID to use with tcp_send/tcp_recv, -1 if connection failed.
+ * Give it back with tcp_pool_release
  */
-String MODEMBGXX::check_connection_state(uint8_t connectionID)
+int8_t MODEMBGXX::tcp_pool_acquire(uint8_t contextID, String host, uint16_t port, int8_t sslClientID, uint16_t wait)
 {
+	// tried once per modem reset, idle connections are still checked before reuse if it fails
+	if (!pool_keepalive_set)
+	{
+		pool_keepalive_set = true;
+		if (!tcp_keepalive(TCP_KEEPALIVE_IDLE, TCP_KEEPALIVE_INTERVAL, TCP_KEEPALIVE_COUNT))
+			log("tcp keepalive couldn't be configured, pooled connections rely on health check");
+	}
 
-	if (connectionID >= MAX_CONNECTIONS)
-		return "";
-
-	String query = "";
-	if (tcp[connectionID].ssl)
-		query = "AT+QSSLSTATE=1," + String(connectionID);
-	else
-		query = "AT+QISTATE=1," + String(connectionID);
-
-	return get_command(query);
-}
+	bool ssl = sslClientID >= 0;
 
-String MODEMBGXX::check_messages()
-{
+	// reuse a warm connection
+	for (uint8_t i = 0; i < MAX_TCP_CONNECTIONS; i++)
+	{
+		if (!tcp[i].pooled || tcp[i].in_use)
+			continue;
+		if (tcp[i].contextID != contextID || tcp[i].port != port || String(tcp[i].server) != host)
+			continue;
+		if (tcp[i].ssl != ssl || (ssl && tcp[i].sslClientID != sslClientID))
+			continue;
 
-	String command = "";
-	String at_terminator = String(AT_TERMINATOR);
-	while (modem->available() > 0)
+		if (!tcp_pool_healthy(i))
+		{
+			tcp_close(i);
+			continue;
+		}
+
+		tcp[i].in_use = true;
+		return i;
+	}
+
+	// open a new one on a free slot, or on the slot idle for longer
+	int8_t clientID = -1;
+	for (uint8_t i = 0; i < MAX_TCP_CONNECTIONS; i++)
 	{
+		if (!tcp[i].active && !tcp[i].connected)
+		{
+			clientID = i;
+			break;
+		}
+		if (tcp[i].pooled && !tcp[i].in_use)
+		{
+			if (clientID == -1 || tcp[i].idle_since < tcp[clientID].idle_since)
+				clientID = i;
+		}
+	}
 
-		command += modem->readStringUntil(AT_TERMINATOR);
+	if (clientID == -1)
+		return -1;
 
-		command.trim();
+	if (tcp[clientID].active || tcp[clientID].connected)
+		tcp_close(clientID);
 
-#ifdef DEBUG_BG95_HIGH
-		log("[command] '" + command + "'");
-#endif
+	bool connected = false;
+	if (ssl)
+		connected = tcp_connect_ssl(contextID, sslClientID, clientID, host, port, wait);
+	else
+		connected = tcp_connect(contextID, clientID, host, port, wait);
 
-		if (command.length() == 0)
+	if (!connected)
+		return -1;
+
+	tcp[clientID].pooled = true;
+	tcp[clientID].in_use = true;
+	return clientID;
+}
+
+/*
+ * give back a connection taken with tcp_pool_acquire, it is kept open for reuse
+ */
+void MODEMBGXX::tcp_pool_release(uint8_t clientID)
+{
+	if (clientID >= MAX_TCP_CONNECTIONS)
+		return;
+
+	if (!tcp[clientID].pooled)
+		return;
+
+	tcp[clientID].in_use = false;
+	tcp[clientID].idle_since = millis();
+
+	if (!tcp[clientID].connected)
+		tcp_close(clientID);
+}
+
+/*
+ * private - closes pooled connections idle for more than TCP_POOL_IDLE_TIMEOUT
+ */
+void MODEMBGXX::tcp_pool_check()
+{
+	for (uint8_t i = 0; i < MAX_TCP_CONNECTIONS; i++)
+	{
+		if (!tcp[i].pooled || tcp[i].in_use)
 			continue;
 
-		TIMEIT(command = parse_command_line(command, true));
+		if (!tcp[i].connected || millis() - tcp[i].idle_since > TCP_POOL_IDLE_TIMEOUT)
+		{
+#ifdef DEBUG_BG95
+			log("closing idle connection " + String(i));
+#endif
+			tcp_close(i);
+		}
 	}
-	return command;
 }
 
-String MODEMBGXX::parse_command_line(String line, bool set_data_pending)
+/*
+ * private - checks an idle pooled connection before reusing it
+ */
+bool MODEMBGXX::tcp_pool_healthy(uint8_t clientID)
 {
-	// log("parse: "+line);
+	if (!tcp[clientID].connected)
+		return false;
 
-	String _cgreg = "+CGREG: ";
-	String _cereg = "+CEREG: ";
-	String _creg = "+CREG: ";
+	// something was received while idle (ex: server closing), can't be passed to a new request
+	if (buffer_len[clientID] > 0 || data_pending[clientID])
+		return false;
+
+	if (millis() - tcp[clientID].idle_since < TCP_POOL_HEALTH_CHECK)
+		return true;
+
+	// +QISTATE: <connectID>,"<service_type>","<IP_address>",<remote_port>,<local_port>,<socket_state>,..
+	String response = check_connection_state(clientID);
 	int8_t index = -1;
+	for (uint8_t i = 0; i < 5; i++)
+	{
+		index = response.indexOf(",", index + 1);
+		if (index == -1)
+			return false;
+	}
 
-	if (line.startsWith("AT+"))
+	return response.substring(index + 1, index + 2).toInt() == 2; // connected
+}
+
+/*
+ * leave data mode of the transparent connection (+++), the connection is kept open.
+ * Waits TCP_TRANSPARENT_GUARD without writing before and after the escape sequence
+ *
+ * returns true if modem accepts AT commands again
+ */
+bool MODEMBGXX::tcp_transparent_escape()
+{
+	if (!data_mode)
+		return true;
+
+	int32_t guard = TCP_TRANSPARENT_GUARD - (millis() - transparent_last_write);
+	if (guard > 0)
 	{
-		log("echo is enabled, disable it");
-		send_command("ATE0");
+		tcp_transparent_read();
+		delay(guard);
 	}
 
-	if (line.startsWith(_cgreg))
+	tcp_transparent_read();
+
+	// an escape started while confirming NO CARRIER may still be waiting for its OK
+	if (transparent_escape_at == 0)
 	{
-		index = line.indexOf(",");
-		if (index > -1)
-			line = line.substring(index + 1, index + 2);
-		else
-			line = line.substring(_cgreg.length(), _cgreg.length() + 1);
-#ifdef DEBUG_BG95
-		if (isNumeric(line))
-		{
-			int radio_state = line.toInt();
-			switch (radio_state)
-			{
-			case NOT_REGISTERED:
-				log("EGPRS not registered");
-				break;
-			case REGISTERED:
-				log("EGPRS registered");
-				break;
-			case CONNECTING:
-				log("EGPRS connecting");
-				break;
-			case DENIED:
-				log("EGPRS registration denied");
-				break;
-			case UNKNOWN:
-				log("EGPRS Unknown");
-				break;
-			case ROAMING:
-				log("EGPRS registered, roaming");
-				break;
-			}
-		}
-#endif		
-		return "";
+		modem->print("+++");
+		modem->flush();
+		transparent_escape_at = millis() | 1;
 	}
-	else if (line.startsWith(_cereg))
+
+	uint32_t timeout = millis() + TCP_TRANSPARENT_GUARD + 1000;
+	while (timeout >= millis())
 	{
-		index = line.indexOf(",");
-		if (index > -1)
-			line = line.substring(index + 1, index + 2);
-		else
-			line = line.substring(_cereg.length(), _cereg.length() + 1);
-		if (isNumeric(line))
-		{
-			int8_t radio_state = line.toInt();
-			switch (radio_state)
-			{
-			case NOT_REGISTERED:
-				log("LTE not registered");
-				break;
-			case REGISTERED:
-				log("LTE registered");
-				break;
-			case CONNECTING:
-				log("LTE connecting");
-				break;
-			case DENIED:
-				log("LTE registration denied");
-				break;
-			case UNKNOWN:
-				log("LTE Unknown");
-				break;
-			case ROAMING:
-				log("LTE registered, roaming");
-				break;
-			}
-		}
-		return "";
+		tcp_transparent_read();
+		if (!data_mode)
+			return true;
+		delay(AT_WAIT_RESPONSE);
 	}
-	else if (line.startsWith(_creg))
+
+	// +++ was lost, next call sends it again
+	transparent_escape_at = 0;
+	return false;
+}
+
+/*
+ * return to data mode of the transparent connection (ATO)
+ *
+ * returns true if data mode was resumed
+ */
+bool MODEMBGXX::tcp_transparent_resume()
+{
+	if (data_mode)
+		return true;
+
+	if (transparent_id == -1 || !tcp[transparent_id].connected)
+		return false;
+
+	if (!check_command_no_ok("ATO", "CONNECT", "ERROR", 2000))
+		return false;
+
+	transparent_last_write = millis();
+	data_mode = true;
+	return true;
+}
+
+/*
+ * returns true if uart is in data mode
+ */
+bool MODEMBGXX::tcp_transparent_active()
+{
+	return data_mode;
+}
+
+/*
+ * private - moves data received in data mode to connection buffer.
+ * Detects the end of data mode: "OK" is only accepted while an escape (+++) is in progress and after its guard time.
+ * Payload can end with "NO CARRIER" too, the close is confirmed with an escape that modem only answers in data mode.
+ * Last bytes of buffer are kept free for the modem answer while not escaping
+ */
+void MODEMBGXX::tcp_transparent_read()
+{
+	if (transparent_id == -1)
+		return;
+
+	uint8_t index = transparent_id;
+
+	const char *no_carrier = "\r\nNO CARRIER\r\n";
+	const char *ok = "\r\nOK\r\n";
+
+	uint16_t limit = CONNECTION_BUFFER;
+	if (transparent_escape_at == 0)
+		limit -= strlen(no_carrier);
+
+	uint16_t received = 0;
+	while (modem->available())
 	{
-		String connected_ = "";
-		String technology_ = "";
+		if (buffer_len[index] >= limit)
+			break; // data waits on uart buffer
+		uint16_t left_space = limit - buffer_len[index];
+
+		uint16_t len = modem->available();
+		if (len > left_space)
+			len = left_space;
+
+		len = modem->readBytes(&buffers[index][buffer_len[index]], len);
+		buffer_len[index] += len;
+		received += len;
+		tcp[index].stats.bytes_received += len;
+		tcp_update_high_water(index);
+	}
 
-		index = line.indexOf(",");
-		if (index > -1)
-		{
-			line = line.substring(index + 1);
-			index = line.indexOf(",");
-			if (index > -1)
-			{
-				connected_ = line.substring(0, index);
-				// log("connected: "+String(connected_));
-				line = line.substring(index + 1);
-			}
-			else
-			{
-				connected_ = line;
-				// log("connected: "+String(connected_));
-			}
-		}
-		else
-			return "";
+	// answers of modem end what was just received
+	if (received == 0)
+		return;
 
-		index = line.indexOf(",");
-		if (index > -1)
+	if (transparent_escape_at != 0)
+	{
+		// modem answers after the guard time that follows +++
+		if (millis() - transparent_escape_at >= TCP_TRANSPARENT_GUARD && buffer_ends_with(index, ok))
 		{
-			line = line.substring(index + 1);
-			index = line.indexOf(",");
-			if (index > -1)
-			{
-				technology_ = line.substring(index + 1);
-				// log("technology: "+String(technology_));
-			}
-			else
-				return "";
+			buffer_len[index] -= strlen(ok);
+			transparent_escape_at = 0;
+			data_mode = false;
 		}
-		else
-			return "";
+		return;
+	}
 
-		if (isNumeric(connected_))
-		{
-			int8_t act = -1;
-			int8_t radio_state = connected_.toInt();
-			if (technology_ != "")
-				act = technology_.toInt();
-			else
-				act = -1;
+	if (transparent_confirming || !buffer_ends_with(index, no_carrier))
+		return;
 
-			switch (radio_state)
-			{
-			case 0:
-				// st.apn_lte = false;
-				// st.apn_gsm = false;
-				break;
-			case 1:
-				if (act == 0)
-				{
-					// st.apn_gsm = true;
-					// st.apn_lte = false;
-				}
-				else if (act == 9)
-				{
-					// st.apn_gsm = false;
-					// st.apn_lte = true;
-				}
-				break;
-			case 2:
-				if (act == 0)
-				{
-					////st.apn_gsm = 2;
-					// st.apn_gsm = false;
-					// st.apn_lte = false;
-				}
-				else if (act == 9)
-				{
-					// st.apn_gsm = false;
-					////st.apn_lte = 2;
-					// st.apn_lte = false;
-				}
-				break;
-			case 3:
-				// st.apn_gsm = false;
-				// st.apn_lte = false;
-				break;
-			case 4:
-				// st.apn_gsm = false;
-				// st.apn_lte = false;
-				break;
-			case 5:
-				if (act == 0)
-				{
-					// st.apn_gsm = true;
-					// st.apn_lte = false;
-				}
-				else if (act == 9)
-				{
-					// st.apn_gsm = false;
-					// st.apn_lte = true;
-				}
-				break;
-			}
-		}
-	}
-	else if (line.startsWith("+QIOPEN:"))
+	// still on data mode, bytes were payload
+	transparent_confirming = true;
+	bool escaped = tcp_transparent_escape();
+	transparent_confirming = false;
+	if (escaped)
 	{
+		tcp_transparent_resume();
+		return;
+	}
 
-		int8_t index = line.indexOf(",");
-		uint8_t cid = 0;
-		int8_t state = -1;
-		if (index > -1)
-		{
-			cid = line.substring(index - 1, index).toInt();
-			state = line.substring(index + 1).toInt();
-		}
-		if (cid >= MAX_TCP_CONNECTIONS)
-			return "";
+	// modem didn't answer +++, it is on command mode. Ends the line started by +++
+	transparent_escape_at = 0;
+	check_command("AT", "OK", "ERROR", 1000);
 
-		if (state == 0)
-		{
+	buffer_len[index] -= strlen(no_carrier);
+	data_mode = false;
+	transparent_id = -1;
+	tcp[index].connected = false;
+	tcp[index].active = false;
 #ifdef DEBUG_BG95
-			log("TCP is connected");
+	log("transparent connection closed");
 #endif
-			tcp[cid].connected = true;
-		}
-		else
-		{
-			log("Error opening TCP");
-			tcp[cid].connected = false;
-		}
-		/*
-		for (uint8_t index = 0; index < MAX_CONNECTIONS; index++) {
-			if (!line.startsWith("C: " + String(index) + ",")) continue;
+	if (tcpOnClose != NULL)
+		tcpOnClose(index);
+}
 
-			connected_until[index] = millis() + CONNECTION_STATE;
-			connected_state[index] = line.endsWith("\"CONNECTED\"");
+/*
+ * private - returns true if connection buffer ends with suffix
+ */
+bool MODEMBGXX::buffer_ends_with(uint8_t index, const char *suffix)
+{
+	uint16_t len = strlen(suffix);
+	if (buffer_len[index] < len)
+		return false;
 
-			#ifdef DEBUG_BG95
-			if (connected_state[index]) log("socket " + String(index) + " = connected");
-			#endif
-		}
-		*/
-		return "";
+	return memcmp(&buffers[index][buffer_len[index] - len], suffix, len) == 0;
+}
+/*
+ * send data through open channel
+ *
+ * returns true if succeed
+ */
+bool MODEMBGXX::tcp_send(uint8_t clientID, const char *data, uint16_t size)
+{
+	if (clientID >= MAX_TCP_CONNECTIONS)
+		return false;
+	if (tcp_connected(clientID) == 0)
+		return false;
+
+	if (data_mode)
+	{
+		if (clientID != transparent_id)
+			return false;
+
+		modem->write((const uint8_t *)data, size);
+		modem->flush();
+		transparent_last_write = millis();
+		tcp[clientID].sent_bytes += size;
+		tcp[clientID].stats.bytes_sent += size;
+		return true;
 	}
-	else if (line.startsWith("+QIURC: \"recv\","))
+	if (!tcp_writable(clientID, size))
+		return false;
+
+	while (modem->available())
 	{
-		String cid_str = line.substring(15);
-		uint8_t cid = cid_str.toInt();
-		if (cid >= MAX_TCP_CONNECTIONS)
-			return "";
-		if (set_data_pending)
-		{
-			data_pending[cid] = true;
-			return "";
-		}
-		else
-		{
-			tcp_read_buffer(cid);
-			return "";
-		}
+		String line = read_line();
+
+		line.trim();
+
+		parse_command_line(line, true);
 	}
-	else if (line.startsWith("+QIURC: \"closed\","))
+
+	while (modem->available())
+		modem->read(); // delete garbage on buffer
+
+	if (!socket_send(clientID, "", 0, data, size))
 	{
-#ifdef DEBUG_BG95
-		log("QIURC closed: " + line);
-#endif
-		int8_t index = line.indexOf(",");
-		int8_t cid = -1;
-		if (index > -1)
-		{
-			state = state.substring(index + 1, index + 1);
-			cid = state.toInt();
-			if (cid >= MAX_TCP_CONNECTIONS)
-				return "";
-#ifdef DEBUG_BG95_HIGH
-			log("connection: " + String(cid) + " closed");
-#endif
-			tcp[cid].connected = false;
-			tcp_close(cid);
-		}
+		tcp_check_data_pending();
+		return false;
 	}
-	else if (line.startsWith("+QSSLURC: \"recv\","))
+
+	return true;
+}
+
+/*
+ * send a datagram through an udp service socket
+ *
+ * @ip - remote ip
+ * @port - remote port
+ *
+ * returns true if succeed
+ */
+bool MODEMBGXX::udp_send_to(uint8_t clientID, String ip, uint16_t port, const char *data, uint16_t size)
+{
+	if (clientID >= MAX_TCP_CONNECTIONS)
+		return false;
+	if (tcp_connected(clientID) == 0)
+		return false;
+	if (tcp[clientID].proto != SOCKET_UDP_SERVICE)
+		return false;
+
+	while (modem->available())
 	{
-		String cid_str = line.substring(17);
-		uint8_t cid = cid_str.toInt();
-		if (cid >= MAX_TCP_CONNECTIONS)
-			return "";
-		if (set_data_pending)
-		{
-			data_pending[cid] = true;
-			return "";
-		}
-		else
-		{
-			tcp_read_buffer(cid);
-			return "";
-		}
+		String line = read_line();
+
+		line.trim();
+
+		parse_command_line(line, true);
 	}
-	else if (line.startsWith("+QSSLURC: \"closed\","))
+
+	return socket_send(clientID, ip, port, data, size);
+}
+
+/*
+ * send several datagrams with consecutive AT+QISEND commands
+ *
+ * @ip - remote ip, use "" for udp sockets opened with udp_connect
+ * @port - remote port, ignored if ip is ""
+ * @data - array of datagrams
+ * @size - array with the size of each datagram
+ * @count - number of datagrams
+ *
+ * returns number of datagrams sent, stops on first failure
+ */
+uint8_t MODEMBGXX::udp_send_batch(uint8_t clientID, String ip, uint16_t port, const char *data[], const uint16_t size[], uint8_t count)
+{
+	if (clientID >= MAX_TCP_CONNECTIONS)
+		return 0;
+	if (tcp_connected(clientID) == 0)
+		return 0;
+	if (tcp[clientID].proto == SOCKET_TCP)
+		return 0;
+	if (ip != "" && tcp[clientID].proto != SOCKET_UDP_SERVICE)
+		return 0;
+
+	// pending lines are parsed once for the whole batch
+	while (modem->available())
 	{
-#ifdef DEBUG_BG95
-		log("QIURC closed: " + line);
-#endif
-		int8_t index = line.indexOf(",");
-		int8_t cid = -1;
-		if (index > -1)
-		{
-			state = state.substring(index + 1, index + 1);
-			cid = state.toInt();
-			if (cid >= MAX_TCP_CONNECTIONS)
-				return "";
-#ifdef DEBUG_BG95_HIGH
-			log("connection: " + String(cid) + " closed");
-#endif
-			tcp[cid].connected = false;
-			tcp_close(cid);
-		}
+		String line = read_line();
+
+		line.trim();
+
+		parse_command_line(line, true);
 	}
-	else if (line.startsWith("+CMTI"))
+
+	uint8_t i = 0;
+	while (i < count)
 	{
-		check_sms();
-		return "";
+		if (!socket_send(clientID, ip, port, data[i], size[i]))
+			break;
+		i++;
 	}
-	else if (line.startsWith("+QIACT: "))
+
+	return i;
+}
+
+/*
+ * private - issues AT+QISEND/AT+QSSLSEND, writes data after prompt and waits for SEND OK
+ *
+ * @ip - remote ip for udp service sockets, "" otherwise
+ *
+ * returns true if succeed
+ */
+bool MODEMBGXX::socket_send(uint8_t clientID, String ip, uint16_t port, const char *data, uint16_t size)
+{
+	TCPStats *stats = &tcp[clientID].stats;
+	uint32_t start = millis();
+
+	if (tcp[clientID].ssl)
 	{
-		line = line.substring(8);
-		int8_t index = line.indexOf(",");
-		uint8_t cid = 0;
-		if (index > -1)
-		{
-			cid = line.substring(0, index).toInt(); // connection
-			line = line.substring(index + 1);
-		}
-		else
-		{
-			return "";
-		}
+		if (!check_command_no_ok("AT+QSSLSEND=" + String(clientID) + "," + String(size), ">", "ERROR"))
+			return false;
+	}
+	else
+	{
+		String s = "AT+QISEND=" + String(clientID) + "," + String(size);
+		if (ip != "")
+			s += ",\"" + ip + "\"," + String(port);
+		if (!check_command_no_ok(s, ">", "ERROR"))
+			return false;
+	}
 
-		if (cid == 0 || cid > MAX_CONNECTIONS)
-			return "";
+	uint32_t prompt_ms = millis() - start;
+	stats->prompt_ms_total += prompt_ms;
+	if (prompt_ms > stats->prompt_ms_max)
+		stats->prompt_ms_max = prompt_ms;
 
-		int8_t state = line.substring(0, 1).toInt(); // connection
-		if (state == 1)
+	start = millis();
+	send_command((uint8_t *)data, size);
+	delay(AT_WAIT_RESPONSE);
+
+	uint32_t timeout = millis() + 10000;
+
+	while (timeout >= millis())
+	{
+		if (modem->available())
 		{
-#ifdef DEBUG_BG95_HIGH
-			log("network connected: " + String(cid));
-#endif
-			apn[cid - 1].connected = true;
-			apn[cid - 1].retry = 0;
+			String line = read_line();
+
+			line.trim();
+
+			if (line.length() == 0)
+				continue;
+
+// log("[send] ? '" + line + "'");
+#ifdef DEBUG_BG95
+			log("parse: " + line);
+#endif
+			parse_command_line(line, true);
+
+			if (line.indexOf("SEND FAIL") > -1 || line.indexOf("ERROR") > -1)
+				return false;
+
+			if (line.indexOf("SEND OK") > -1 || line.indexOf("OK") > -1)
+			{
+				uint32_t send_ok_ms = millis() - start;
+				stats->sends++;
+				stats->bytes_sent += size;
+				stats->send_ok_ms_total += send_ok_ms;
+				if (send_ok_ms > stats->send_ok_ms_max)
+					stats->send_ok_ms_max = send_ok_ms;
+				tcp[clientID].sent_bytes += size;
+				if (tcp[clientID].proto == SOCKET_TCP)
+					tcp[clientID].unacked_bytes += size; // estimation until next window update
+				return true;
+			}
 		}
-		else
+
+		delay(AT_WAIT_RESPONSE);
+	}
+
+	return false;
+}
+
+/*
+ * copies data to pointer if available
+ * for udp sockets it behaves as udp_recv
+ *
+ * returns len of data copied
+ */
+uint16_t MODEMBGXX::tcp_recv(uint8_t clientID, char *data, uint16_t size)
+{
+
+	if (clientID >= MAX_TCP_CONNECTIONS)
+		return false;
+
+	if (tcp[clientID].proto != SOCKET_TCP)
+		return udp_recv(clientID, data, size);
+
+	if (buffer_len[clientID] == 0)
+		return 0;
+
+	if (buffer_len[clientID] < size)
+		size = buffer_len[clientID];
+
+	return buffer_take(clientID, data, size, size);
+}
+
+/*
+ * copies next datagram to pointer if available.
+ * If datagram is bigger than size, the remaining bytes are discarded
+ *
+ * @ip - if not NULL, filled with remote ip
+ * @port - if not NULL, filled with remote port
+ *
+ * returns len of data copied
+ */
+uint16_t MODEMBGXX::udp_recv(uint8_t clientID, char *data, uint16_t size, String *ip, uint16_t *port)
+{
+	if (clientID >= MAX_TCP_CONNECTIONS)
+		return 0;
+
+	if (datagram_count[clientID] == 0)
+		return 0;
+
+	Datagram *dgram = &datagrams[clientID][0];
+
+	if (ip != NULL)
+		*ip = String(dgram->ip);
+	if (port != NULL)
+		*port = dgram->port;
+
+	uint16_t len = buffer_take(clientID, data, size, dgram->len);
+
+	datagram_count[clientID]--;
+	for (uint8_t i = 0; i < datagram_count[clientID]; i++)
+		datagrams[clientID][i] = datagrams[clientID][i + 1];
+
+	return len;
+}
+
+/*
+ * returns len of next datagram available for clientID
+ */
+uint16_t MODEMBGXX::udp_has_data(uint8_t clientID)
+{
+	if (clientID >= MAX_TCP_CONNECTIONS)
+		return 0;
+
+	if (datagram_count[clientID] == 0)
+		return 0;
+
+	return datagrams[clientID][0].len;
+}
+
+/*
+ * private - copies up to size bytes to data and removes len bytes from buffer
+ *
+ * returns len of data copied
+ */
+uint16_t MODEMBGXX::buffer_take(uint8_t clientID, char *data, uint16_t size, uint16_t len)
+{
+	uint16_t i;
+
+	if (len > buffer_len[clientID])
+		len = buffer_len[clientID];
+
+	if (size > len)
+		size = len;
+
+	for (i = 0; i < size; i++)
+	{
+		data[i] = buffers[clientID][i];
+	}
+
+	if (buffer_len[clientID] > len)
+	{
+		for (i = len; i < buffer_len[clientID]; i++)
+		{
+			buffers[clientID][i - len] = buffers[clientID][i];
+		}
+	}
+
+	buffer_len[clientID] -= len;
+
+	return size;
+}
+/*
+ * returns len of data available for clientID
+ */
+uint16_t MODEMBGXX::tcp_has_data(uint8_t clientID)
+{
+
+	if (clientID >= MAX_TCP_CONNECTIONS)
+		return 0;
+
+	return buffer_len[clientID];
+}
+
+/*
+ * reads pending urcs and connection data, lighter than loop()
+ */
+void MODEMBGXX::tcp_poll()
+{
+	check_messages();
+	tcp_check_data_pending();
+}
+
+/*
+ * reads the send window of a connection
+ *
+ * @sent - total bytes sent
+ * @acked - total bytes acknowledged by remote
+ * @unacked - bytes sent but not yet acknowledged
+ *
+ * ssl connections can't be queried, only sent bytes are tracked
+ *
+ * returns true if values were updated
+ */
+bool MODEMBGXX::tcp_send_status(uint8_t clientID, uint32_t *sent, uint32_t *acked, uint32_t *unacked)
+{
+	if (clientID >= MAX_TCP_CONNECTIONS)
+		return false;
+
+	if (!tcp[clientID].connected)
+		return false;
+
+	tcp[clientID].send_status_until = millis() + TCP_SEND_STATUS_INTERVAL;
+
+	if (!tcp[clientID].ssl)
+	{
+		// +QISEND: <total_send_length>,<ackedbytes>,<unackedbytes>
+		String response = get_command("AT+QISEND=" + String(clientID) + ",0", "+QISEND: ", 1000);
+		int8_t index = response.indexOf(",");
+		int8_t last_index = response.lastIndexOf(",");
+		if (index == -1 || index == last_index)
+			return false;
+
+		tcp[clientID].sent_bytes = (uint32_t)response.substring(0, index).toInt();
+		tcp[clientID].acked_bytes = (uint32_t)response.substring(index + 1, last_index).toInt();
+		tcp[clientID].unacked_bytes = (uint32_t)response.substring(last_index + 1).toInt();
+	}
+	else
+	{
+		tcp[clientID].acked_bytes = tcp[clientID].sent_bytes;
+		tcp[clientID].unacked_bytes = 0;
+	}
+
+	if (sent != NULL)
+		*sent = tcp[clientID].sent_bytes;
+	if (acked != NULL)
+		*acked = tcp[clientID].acked_bytes;
+	if (unacked != NULL)
+		*unacked = tcp[clientID].unacked_bytes;
+
+	return true;
+}
+
+/*
+ * copies counters of clientID, modem is not queried.
+ * Counters are cleared on each connection
+ *
+ * @stats - bytes sent/received, latencies of AT+QISEND prompt, SEND OK and AT+QIRD,
+ *          buffer high-water mark and bytes discarded because buffer was full
+ *
+ * returns true if succeed
+ */
+bool MODEMBGXX::tcp_stats(uint8_t clientID, TCPStats *stats)
+{
+	if (clientID >= MAX_TCP_CONNECTIONS || stats == NULL)
+		return false;
+
+	memcpy(stats, &tcp[clientID].stats, sizeof(TCPStats));
+	return true;
+}
+
+/*
+ * checks if size bytes can be sent without exceeding TCP_MAX_UNACKED.
+ * Window is refreshed from modem at most every TCP_SEND_STATUS_INTERVAL
+ *
+ * returns true if connection accepts data
+ */
+bool MODEMBGXX::tcp_writable(uint8_t clientID, uint16_t size)
+{
+	if (clientID >= MAX_TCP_CONNECTIONS)
+		return false;
+
+	if (!tcp[clientID].connected)
+		return false;
+
+	// a single send bigger than the window is allowed when nothing is pending
+	if (tcp[clientID].unacked_bytes == 0 || tcp[clientID].unacked_bytes + size <= TCP_MAX_UNACKED)
+		return true;
+
+	if (tcp[clientID].send_status_until < millis())
+		tcp_send_status(clientID, NULL, NULL, NULL);
+
+	if (tcp[clientID].unacked_bytes == 0 || tcp[clientID].unacked_bytes + size <= TCP_MAX_UNACKED)
+		return true;
+
+	tcp[clientID].send_blocked = true;
+	return false;
+}
+
+/*
+ * returns last known number of bytes waiting for ack
+ */
+uint32_t MODEMBGXX::tcp_unacked(uint8_t clientID)
+{
+	if (clientID >= MAX_TCP_CONNECTIONS)
+		return 0;
+
+	return tcp[clientID].unacked_bytes;
+}
+
+// --- DNS ---
+
+/*
+ * resolve host using cache, AT+QIDNSGIP is used if there is no valid entry
+ *
+ * @contextID - context id 1-16, yet it is limited to MAX_CONNECTIONS
+ * @host - DNS, IP addresses are returned as they are
+ * @wait - maximum time to wait for the lookup in ms
+ *
+ * returns ip address, or host if it couldn't be resolved (modem will try it on open)
+ */
+String MODEMBGXX::dns_resolve(uint8_t contextID, String host, uint32_t wait)
+{
+	if (is_ip_address(host) || host.length() >= sizeof(dns_cache[0].host))
+		return host;
+
+	int8_t slot = dns_find(contextID, host);
+	if (slot > -1 && dns_cache[slot].ip[0] != 0 && dns_cache[slot].expires > millis())
+		return String(dns_cache[slot].ip);
+
+	if (!apn_connected(contextID))
+		return host;
+
+	// take the slot of this host, a free one or the one expiring sooner
+	if (slot == -1)
+	{
+		slot = 0;
+		for (uint8_t i = 0; i < DNS_CACHE_SIZE; i++)
+		{
+			if (!dns_cache[i].used)
+			{
+				slot = i;
+				break;
+			}
+			if (dns_cache[i].expires < dns_cache[slot].expires)
+				slot = i;
+		}
+	}
+
+	memset(&dns_cache[slot], 0, sizeof(dns_cache[slot]));
+	strncpy(dns_cache[slot].host, host.c_str(), sizeof(dns_cache[slot].host) - 1);
+	dns_cache[slot].contextID = contextID;
+	dns_cache[slot].used = true;
+
+	dns_lookup = slot;
+	dns_lookup_ips = -1;
+
+	if (!check_command("AT+QIDNSGIP=" + String(contextID) + ",\"" + host + "\"", "OK", "ERROR", 1000))
+	{
+		dns_lookup = -1;
+		return host;
+	}
+
+	uint32_t timeout = millis() + wait;
+	while (timeout >= millis() && dns_lookup != -1)
+	{
+		if (modem->available())
 		{
+			String response = read_line();
+			response.trim();
+			if (response.length() > 0)
+				parse_command_line(response);
+			continue;
+		}
+		delay(AT_WAIT_RESPONSE);
+	}
+	dns_lookup = -1;
+
+	if (dns_cache[slot].ip[0] == 0)
+		return host;
+
 #ifdef DEBUG_BG95
-			log("network disconnected: " + String(cid));
+	log("dns: " + host + " -> " + String(dns_cache[slot].ip));
 #endif
-			apn[cid - 1].connected = false;
+	return String(dns_cache[slot].ip);
+}
+
+/*
+ * resolve host each time contextID is activated, so first connection doesn't wait for dns
+ *
+ * returns true if host was registered
+ */
+bool MODEMBGXX::dns_prefetch(uint8_t contextID, String host)
+{
+	if (contextID == 0 || contextID > MAX_CONNECTIONS)
+		return false;
+
+	if (is_ip_address(host) || host.length() >= sizeof(dns_prefetch_hosts[0].host))
+		return false;
+
+	for (uint8_t i = 0; i < DNS_CACHE_SIZE; i++)
+	{
+		if (dns_prefetch_hosts[i].contextID == 0)
+		{
+			strncpy(dns_prefetch_hosts[i].host, host.c_str(), sizeof(dns_prefetch_hosts[i].host) - 1);
+			dns_prefetch_hosts[i].contextID = contextID;
+			if (apn_connected(contextID))
+				dns_prefetch_pending[contextID - 1] = true;
+			return true;
 		}
-		line = line.substring(index + 1);
+	}
+
+	return false;
+}
+
+/*
+ * clear dns cache
+ */
+void MODEMBGXX::dns_flush()
+{
+	memset(dns_cache, 0, sizeof(dns_cache));
+}
+
+/*
+ * private - removes host from cache
+ */
+void MODEMBGXX::dns_invalidate(uint8_t contextID, String host)
+{
+	int8_t slot = dns_find(contextID, host);
+	if (slot > -1)
+		dns_cache[slot].used = false;
+}
+
+/*
+ * private - returns cache slot of host, -1 if not found
+ */
+int8_t MODEMBGXX::dns_find(uint8_t contextID, String host)
+{
+	for (uint8_t i = 0; i < DNS_CACHE_SIZE; i++)
+	{
+		if (dns_cache[i].used && dns_cache[i].contextID == contextID && host == dns_cache[i].host)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * private - parses +QIURC: "dnsgip" of the lookup in progress
+ *
+ * @params - <err>,<IP_count>,<DNS_ttl> or "<hostIPaddr>"
+ */
+void MODEMBGXX::dns_urc(String params)
+{
+	if (dns_lookup == -1)
+		return;
+
+	if (params.startsWith("\""))
+	{
+		params.replace("\"", "");
+		// first address is used
+		if (dns_cache[dns_lookup].ip[0] == 0)
+			strncpy(dns_cache[dns_lookup].ip, params.c_str(), sizeof(dns_cache[dns_lookup].ip) - 1);
+		if (--dns_lookup_ips <= 0)
+			dns_lookup = -1;
+		return;
+	}
+
+	int8_t index = params.indexOf(",");
+	int8_t last_index = params.lastIndexOf(",");
+	if (params.toInt() != 0 || index == -1 || index == last_index)
+	{
+		log("dns lookup of " + String(dns_cache[dns_lookup].host) + " failed: " + params);
+		dns_cache[dns_lookup].used = false;
+		dns_lookup = -1;
+		return;
+	}
+
+	dns_lookup_ips = params.substring(index + 1, last_index).toInt();
+	uint32_t ttl = params.substring(last_index + 1).toInt();
+	if (ttl == 0 || ttl > DNS_MAX_TTL)
+		ttl = DNS_MAX_TTL;
+	dns_cache[dns_lookup].expires = millis() + ttl * 1000;
+
+	if (dns_lookup_ips <= 0)
+	{
+		dns_cache[dns_lookup].used = false;
+		dns_lookup = -1;
+	}
+}
+
+/*
+ * private - resolves registered hosts of contexts that were activated
+ */
+void MODEMBGXX::dns_check_prefetch()
+{
+	for (uint8_t cid = 1; cid <= MAX_CONNECTIONS; cid++)
+	{
+		if (!dns_prefetch_pending[cid - 1])
+			continue;
+
+		dns_prefetch_pending[cid - 1] = false;
+
+		for (uint8_t i = 0; i < DNS_CACHE_SIZE; i++)
+		{
+			if (dns_prefetch_hosts[i].contextID == cid)
+				dns_resolve(cid, String(dns_prefetch_hosts[i].host));
+		}
+	}
+}
+
+/*
+ * private - true if host is an ipv4 or ipv6 address
+ */
+bool MODEMBGXX::is_ip_address(String host)
+{
+	if (host.length() == 0)
+		return false;
+
+	if (host.indexOf(":") > -1)
+		return true;
+
+	for (uint8_t i = 0; i < host.length(); i++)
+	{
+		if (!isDigit(host.charAt(i)) && host.charAt(i) != '.')
+			return false;
+	}
+	return true;
+}
+
+String MODEMBGXX::get_subscriber_number(uint16_t wait)
+{
+	return "";
+
+	uint32_t timeout = millis() + wait;
+
+	send_command("AT+CNUM");
+	delay(AT_WAIT_RESPONSE);
+
+	String number;
+
+	while (timeout >= millis())
+	{
+		if (modem->available())
+		{
+			String response = read_line();
+
+			response.trim();
+
+			if (response.length() == 0)
+				continue;
+
+			if (response != "ERROR" && isNumeric(response))
+			{
+#ifdef DEBUG_BG95
+				log("[number] response = '" + response + "'");
+#endif
+			}
+		}
+
+		delay(AT_WAIT_RESPONSE);
+	}
+
+	return "";
+}
+
+/*
+ * returns the state of context id
+ */
+String MODEMBGXX::check_context_state(uint8_t contextID)
+{
+
+	if (contextID == 0 || contextID > MAX_CONNECTIONS)
+		return "";
+
+	String query = "AT+QISTATE=0," + String(contextID);
+	return get_command(query);
+}
+
+/*
+ * returns the state of connection id
+ */
+String MODEMBGXX::check_connection_state(uint8_t connectionID)
+{
+
+	if (connectionID >= MAX_TCP_CONNECTIONS)
+		return "";
+
+	String query = "";
+	if (tcp[connectionID].ssl)
+		query = "AT+QSSLSTATE=1," + String(connectionID);
+	else
+		query = "AT+QISTATE=1," + String(connectionID);
+
+	return get_command(query);
+}
+
+String MODEMBGXX::check_messages()
+{
+
+	String command = "";
+
+	if (data_mode)
+	{
+		tcp_transparent_read();
+		return command;
+	}
+
+	String at_terminator = String(AT_TERMINATOR);
+	while (modem->available() > 0)
+	{
+
+		command = read_line();
+
+		command.trim();
+
+#ifdef DEBUG_BG95_HIGH
+		log("[command] '" + command + "'");
+#endif
+
+		if (command.length() == 0)
+			continue;
+
+		command = parse_command_line(command, true);
+	}
+	return command;
+}
+
+String MODEMBGXX::parse_command_line(String line, bool set_data_pending)
+{
+	// log("parse: "+line);
+
+	String _cgreg = "+CGREG: ";
+	String _cereg = "+CEREG: ";
+	String _creg = "+CREG: ";
+	int8_t index = -1;
+
+	if (line.startsWith("AT+"))
+	{
+		log("echo is enabled, disable it");
+		send_command("ATE0");
+	}
+
+	if (line.startsWith(_cgreg))
+	{
+		index = line.indexOf(",");
+		if (index > -1)
+			line = line.substring(index + 1, index + 2);
+		else
+			line = line.substring(_cgreg.length(), _cgreg.length() + 1);
+#ifdef DEBUG_BG95
+		if (isNumeric(line))
+		{
+			int radio_state = line.toInt();
+			switch (radio_state)
+			{
+			case NOT_REGISTERED:
+				log("EGPRS not registered");
+				break;
+			case REGISTERED:
+				log("EGPRS registered");
+				break;
+			case CONNECTING:
+				log("EGPRS connecting");
+				break;
+			case DENIED:
+				log("EGPRS registration denied");
+				break;
+			case UNKNOWN:
+				log("EGPRS Unknown");
+				break;
+			case ROAMING:
+				log("EGPRS registered, roaming");
+				break;
+			}
+		}
+#endif		
+		return "";
+	}
+	else if (line.startsWith(_cereg))
+	{
+		index = line.indexOf(",");
+		if (index > -1)
+			line = line.substring(index + 1, index + 2);
+		else
+			line = line.substring(_cereg.length(), _cereg.length() + 1);
+		if (isNumeric(line))
+		{
+			int8_t radio_state = line.toInt();
+			switch (radio_state)
+			{
+			case NOT_REGISTERED:
+				log("LTE not registered");
+				break;
+			case REGISTERED:
+				log("LTE registered");
+				break;
+			case CONNECTING:
+				log("LTE connecting");
+				break;
+			case DENIED:
+				log("LTE registration denied");
+				break;
+			case UNKNOWN:
+				log("LTE Unknown");
+				break;
+			case ROAMING:
+				log("LTE registered, roaming");
+				break;
+			}
+		}
+		return "";
+	}
+	else if (line.startsWith(_creg))
+	{
+		String connected_ = "";
+		String technology_ = "";
+
+		index = line.indexOf(",");
+		if (index > -1)
+		{
+			line = line.substring(index + 1);
+			index = line.indexOf(",");
+			if (index > -1)
+			{
+				connected_ = line.substring(0, index);
+				// log("connected: "+String(connected_));
+				line = line.substring(index + 1);
+			}
+			else
+			{
+				connected_ = line;
+				// log("connected: "+String(connected_));
+			}
+		}
+		else
+			return "";
+
+		index = line.indexOf(",");
+		if (index > -1)
+		{
+			line = line.substring(index + 1);
+			index = line.indexOf(",");
+			if (index > -1)
+			{
+				technology_ = line.substring(index + 1);
+				// log("technology: "+String(technology_));
+			}
+			else
+				return "";
+		}
+		else
+			return "";
+
+		if (isNumeric(connected_))
+		{
+			int8_t act = -1;
+			int8_t radio_state = connected_.toInt();
+			if (technology_ != "")
+				act = technology_.toInt();
+			else
+				act = -1;
+
+			switch (radio_state)
+			{
+			case 0:
+				// st.apn_lte = false;
+				// st.apn_gsm = false;
+				break;
+			case 1:
+				if (act == 0)
+				{
+					// st.apn_gsm = true;
+					// st.apn_lte = false;
+				}
+				else if (act == 9)
+				{
+					// st.apn_gsm = false;
+					// st.apn_lte = true;
+				}
+				break;
+			case 2:
+				if (act == 0)
+				{
+					////st.apn_gsm = 2;
+					// st.apn_gsm = false;
+					// st.apn_lte = false;
+				}
+				else if (act == 9)
+				{
+					// st.apn_gsm = false;
+					////st.apn_lte = 2;
+					// st.apn_lte = false;
+				}
+				break;
+			case 3:
+				// st.apn_gsm = false;
+				// st.apn_lte = false;
+				break;
+			case 4:
+				// st.apn_gsm = false;
+				// st.apn_lte = false;
+				break;
+			case 5:
+				if (act == 0)
+				{
+					// st.apn_gsm = true;
+					// st.apn_lte = false;
+				}
+				else if (act == 9)
+				{
+					// st.apn_gsm = false;
+					// st.apn_lte = true;
+				}
+				break;
+			}
+		}
+	}
+	else if (line.startsWith("+QIOPEN:"))
+	{
+
+		int8_t index = line.indexOf(",");
+		uint8_t cid = 0;
+		int8_t state = -1;
+		if (index > -1)
+		{
+			cid = line.substring(index - 1, index).toInt();
+			state = line.substring(index + 1).toInt();
+		}
+		if (cid >= MAX_TCP_CONNECTIONS)
+			return "";
+
+		if (state == 0)
+		{
+#ifdef DEBUG_BG95
+			log("TCP is connected");
+#endif
+			tcp[cid].connected = true;
+		}
+		else
+		{
+			log("Error opening TCP");
+			tcp[cid].connected = false;
+		}
+		/*
+		for (uint8_t index = 0; index < MAX_CONNECTIONS; index++) {
+			if (!line.startsWith("C: " + String(index) + ",")) continue;
+
+			connected_until[index] = millis() + CONNECTION_STATE;
+			connected_state[index] = line.endsWith("\"CONNECTED\"");
+
+			#ifdef DEBUG_BG95
+			if (connected_state[index]) log("socket " + String(index) + " = connected");
+			#endif
+		}
+		*/
+		return "";
+	}
+	else if (line.startsWith("+QIURC: \"recv\","))
+	{
+		String cid_str = line.substring(15);
+		uint8_t cid = cid_str.toInt();
+		if (cid >= MAX_TCP_CONNECTIONS)
+			return "";
+		if (tcp[cid].access_mode == TCP_ACCESS_PUSH)
+		{
+			// data follows the urc: <len>[,"<remote ip>",<remote port>]
+			index = cid_str.indexOf(",");
+			if (index > -1)
+				tcp_push_data(cid, cid_str.substring(index + 1));
+			return "";
+		}
+		if (set_data_pending)
+		{
+			data_pending[cid] = true;
+			return "";
+		}
+		else
+		{
+			tcp_read_buffer(cid);
+			return "";
+		}
+	}
+	else if (line.startsWith("+QIURC: \"dnsgip\","))
+	{
+		dns_urc(line.substring(17));
+		return "";
+	}
+	else if (line.startsWith("+QIURC: \"incoming full\""))
+	{
+		log("tcp listener can't accept more connections");
+		return "";
+	}
+	else if (line.startsWith("+QIURC: \"incoming\","))
+	{
+		// +QIURC: "incoming",<connectID>,<serverID>,"<remote ip>",<remote port>
+		tcp_incoming(line.substring(19));
+		return "";
+	}
+	else if (line.startsWith("+QIURC: \"closed\","))
+	{
+#ifdef DEBUG_BG95
+		log("QIURC closed: " + line);
+#endif
+		int8_t index = line.indexOf(",");
+		int8_t cid = -1;
+		if (index > -1)
+		{
+			cid = line.substring(index + 1).toInt();
+			if (cid >= MAX_TCP_CONNECTIONS)
+				return "";
+#ifdef DEBUG_BG95_HIGH
+			log("connection: " + String(cid) + " closed");
+#endif
+			tcp[cid].connected = false;
+			tcp_close(cid);
+		}
+	}
+	else if (line.startsWith("+QSSLURC: \"recv\","))
+	{
+		String cid_str = line.substring(17);
+		uint8_t cid = cid_str.toInt();
+		if (cid >= MAX_TCP_CONNECTIONS)
+			return "";
+		if (tcp[cid].access_mode == TCP_ACCESS_PUSH)
+		{
+			// data follows the urc: <len>[,"<remote ip>",<remote port>]
+			index = cid_str.indexOf(",");
+			if (index > -1)
+				tcp_push_data(cid, cid_str.substring(index + 1));
+			return "";
+		}
+		if (set_data_pending)
+		{
+			data_pending[cid] = true;
+			return "";
+		}
+		else
+		{
+			tcp_read_buffer(cid);
+			return "";
+		}
+	}
+	else if (line.startsWith("+QSSLURC: \"closed\","))
+	{
+#ifdef DEBUG_BG95
+		log("QIURC closed: " + line);
+#endif
+		int8_t index = line.indexOf(",");
+		int8_t cid = -1;
+		if (index > -1)
+		{
+			cid = line.substring(index + 1).toInt();
+			if (cid >= MAX_TCP_CONNECTIONS)
+				return "";
+#ifdef DEBUG_BG95_HIGH
+			log("connection: " + String(cid) + " closed");
+#endif
+			tcp[cid].connected = false;
+			tcp_close(cid);
+		}
+	}
+	else if (line.startsWith("+CMTI"))
+	{
+		check_sms();
+		return "";
+	}
+	else if (line.startsWith("+QIACT: "))
+	{
+		line = line.substring(8);
+		int8_t index = line.indexOf(",");
+		uint8_t cid = 0;
+		if (index > -1)
+		{
+			cid = line.substring(0, index).toInt(); // connection
+			line = line.substring(index + 1);
+		}
+		else
+		{
+			return "";
+		}
+
+		if (cid == 0 || cid > MAX_CONNECTIONS)
+			return "";
+
+		int8_t state = line.substring(0, 1).toInt(); // connection
+		if (state == 1)
+		{
+#ifdef DEBUG_BG95_HIGH
+			log("network connected: " + String(cid));
+#endif
+			if (!apn[cid - 1].connected)
+				dns_prefetch_pending[cid - 1] = true;
+			apn[cid - 1].connected = true;
+			apn[cid - 1].retry = 0;
+		}
+		else
+		{
+#ifdef DEBUG_BG95
+			log("network disconnected: " + String(cid));
+#endif
+			apn[cid - 1].connected = false;
+		}
+		line = line.substring(index + 1);
+
+		index = line.lastIndexOf(",");
+		if (index > -1)
+		{
+			String ip = line.substring(index + 1);
+			ip.replace("\"", "");
+			memset(apn[cid - 1].ip, 0, sizeof(apn[cid - 1].ip));
+			memcpy(apn[cid - 1].ip, ip.c_str(), ip.length());
+		}
+		else
+		{
+			return "";
+		}
+	}
+	else if (line.startsWith("+QMTSTAT"))
+	{
+		// error ocurred, channel is disconnected
+		String filter = "+QMTSTAT: ";
+		int8_t index = line.indexOf(filter);
+		line = line.substring(index);
+		index = line.indexOf(",");
+		if (index > -1)
+		{
+			String client = line.substring(filter.length(), index);
+#ifdef DEBUG_BG95_HIGH
+			log("client: " + client);
+#endif
+			if (isNumeric(client))
+			{
+				uint8_t id = client.toInt();
+				if (id < MAX_MQTT_CONNECTIONS)
+				{
+					mqtt[id].socket_state = MQTT_STATE_DISCONNECTED;
+					mqtt[id].connected = false;
+					mqtt[id].opened = false;
+#ifdef MQTT_JOURNAL
+					journal_session_lost(id);
+#endif
+				}
+#ifdef DEBUG_BG95
+				log("MQTT closed");
+#endif
+			}
+		}
+	}
+	else if (line.startsWith("+QMTRECV:"))
+	{
+		return mqtt_message_received(line);
+	}
+	else if (line.startsWith("+QMTOPEN: ") || line.startsWith("+QMTCLOSE: ") || line.startsWith("+QMTDISC: "))
+	{
+		mqtt_state_urc(line);
+		return "";
+	}
+	else if (line.startsWith("+QMTPUB: "))
+	{
+		// completion of an async publish, synchronous ones are handled by MQTT_publish
+		mqtt_published_urc(line.substring(9));
+	}
+	else if (line.startsWith("+QMTCONN: "))
+	{
+		String filter = "+QMTCONN: ";
+		line = line.substring(filter.length());
+		index = line.indexOf(",");
+		if (index > -1)
+		{
+			uint8_t cidx = line.substring(0, index).toInt();
+			if (cidx < MAX_MQTT_CONNECTIONS)
+			{
+				mqtt_state_reported |= 1 << cidx;
+				if (line.lastIndexOf(",") != index)
+				{
+					index = line.lastIndexOf(",");
+					String state = line.substring(index + 1, index + 2);
+					if ((int)state.toInt() == 0)
+					{
+						mqtt[cidx].socket_state = MQTT_STATE_CONNECTED;
+						mqtt[cidx].connected = true;
+					}
+					else
+					{
+						mqtt[cidx].socket_state = MQTT_STATE_DISCONNECTED;
+						mqtt[cidx].connected = false;
+						switch ((int)state.toInt())
+						{
+						case 0:
+							log("mqtt client " + String(cidx) + " Connection refused - Unacceptable Protocol Version");
+							break;
+						case 1:
+							log("mqtt client " + String(cidx) + " Connection refused - Identifier Rejected");
+							break;
+						case 2:
+							log("mqtt client " + String(cidx) + " Connection refused - Server Unavailable");
+							break;
+						case 3:
+							log("mqtt client " + String(cidx) + " Connection refused - Not Authorized");
+						}
+					}
+				}
+				else
+				{
+					String state = line.substring(index + 1, index + 2);
+					if (isdigit(state.c_str()[0]))
+					{
+						mqtt[cidx].socket_state = (int)state.toInt();
+						mqtt[cidx].connected = (int)(state.toInt() == MQTT_STATE_CONNECTED);
+						mqtt[cidx].opened = mqtt[cidx].socket_state != MQTT_STATE_DISCONNECTED;
+#ifdef DEBUG_BG95
+						if (mqtt[cidx].connected)
+							log("mqtt client " + String(cidx) + " is connected");
+						else
+							log("mqtt client " + String(cidx) + " is disconnected");
+#endif
+						return "";
+					}
+				}
+			}
+		}
+	}
+	else if (line.startsWith("+QHTTPGET: "))
+	{
+		return _HTTP_response_received(line.substring(11));
+	}
+	else if (line.startsWith("+QHTTPREADFILE: ") && this->_HTTP_request_in_progress) 
+	{
+		return _HTTP_file_downloaded(line.substring(16));
+	}
+	else if (line.startsWith("+CME ERROR: ") && this->_HTTP_request_in_progress)
+	{
+		return _HTTP_file_download_error(line.substring(12));
+	}
+	else if (line.startsWith("OK"))
+		return "";
+
+	return line;
+}
+
+String MODEMBGXX::mqtt_message_received(String line)
+{
+	/*
+	 * +QMTRECV: <client>,<channel>								message stored on channel (recv mode 1)
+	 * +QMTRECV: <client>,<msg_id>,"<topic>",<payload_len>,"<payload>"	message (payload is still on uart, see read_line)
+	 */
+	const char *start = line.c_str();
+	const char *p = start + strlen("+QMTRECV: ");
+	char *end;
+
+	uint8_t clientID = strtoul(p, &end, 10);
+	if (end == p || *end != ',' || clientID >= MAX_MQTT_CONNECTIONS)
+		return "";
+
+	p = end + 1;
+	uint16_t id = strtoul(p, &end, 10);
+	if (end == p)
+		return "";
+
+	if (*end == '\0')
+	{
+		if (id < 5)
+			mqtt_channels[clientID] |= 1 << id; // read on next MQTT_readMessages
+		return "";
+	}
+
+	// header ends with ,<payload_len>,
+	uint16_t line_len = line.length();
+	if (*end != ',' || end[1] != '"' || start[line_len - 1] != ',')
+		return "";
+
+	int16_t len_index = line.lastIndexOf(',', line_len - 2);
+	if (len_index < 0 || start[len_index - 1] != '"')
+		return "";
+
+	const char *topic = end + 2;
+	uint16_t topic_len = &start[len_index - 1] - topic;
+	uint32_t len = strtoul(&start[len_index + 1], NULL, 10);
+
+	if (mqttStreamBegin != NULL && len > mqtt_stream_threshold)
+	{
+		mqtt_stream_payload(clientID, topic, topic_len, len);
+		return "";
+	}
+
+	uint16_t read = mqtt_read_payload(len);
+
+	// msg_id is 0 for qos 0
+	if (id != 0 && mqtt_duplicate(clientID, id, topic, topic_len, mqtt_rx_buffer, read))
+	{
+#ifdef DEBUG_BG95
+		log("mqtt message " + String(id) + " of client " + String(clientID) + " is duplicated, discarded");
+#endif
+		return "";
+	}
+
+	mqtt_route(clientID, topic, topic_len, mqtt_rx_buffer, read);
+
+	return "";
+}
+
+/*
+ * private - delivers "<payload>" of a +QMTRECV line in chunks of MQTT_RX_BUFFER bytes to stream handlers
+ */
+void MODEMBGXX::mqtt_stream_payload(uint8_t clientID, const char *topic, uint16_t topic_len, uint32_t len)
+{
+	char full_topic[128];
+	if (topic_len >= sizeof(full_topic))
+		topic_len = sizeof(full_topic) - 1;
+	memcpy(full_topic, topic, topic_len);
+	full_topic[topic_len] = '\0';
+
+	mqttStreamBegin(clientID, full_topic, len);
+
+	char quote = 0;
+	modem->readBytes(&quote, 1);
+
+	uint32_t left = len;
+	while (left > 0)
+	{
+		uint16_t n = left > MQTT_RX_BUFFER ? MQTT_RX_BUFFER : left;
+		n = modem->readBytes(mqtt_rx_buffer, n);
+		if (n == 0)
+			break; // timeout
+		left -= n;
+		if (mqttStreamData != NULL)
+			mqttStreamData(clientID, mqtt_rx_buffer, n);
+	}
+
+	if (left > 0)
+		log("mqtt stream of " + String(full_topic) + " is incomplete");
+
+	mqtt_discard_payload(left);
+
+	if (mqttStreamEnd != NULL)
+		mqttStreamEnd(clientID, left == 0);
+}
+
+/*
+ * private - reads "<payload>" of a +QMTRECV line to mqtt_rx_buffer.
+ * Bytes beyond MQTT_RX_BUFFER are discarded
+ *
+ * returns bytes stored
+ */
+uint16_t MODEMBGXX::mqtt_read_payload(uint32_t len)
+{
+	char quote = 0;
+	modem->readBytes(&quote, 1);
+
+	uint16_t stored = len > MQTT_RX_BUFFER ? MQTT_RX_BUFFER : len;
+	stored = modem->readBytes(mqtt_rx_buffer, stored);
+	mqtt_rx_buffer[stored] = '\0';
+
+	if (stored < len && stored == MQTT_RX_BUFFER)
+		log("mqtt payload of " + String(len) + " bytes doesn't fit on buffer");
+
+	mqtt_discard_payload(len - stored);
+
+	return stored;
+}
+
+/*
+ * private - consumes what is left of a +QMTRECV payload and its closing quote, so it isn't read as responses.
+ * Waits while bytes keep arriving
+ */
+void MODEMBGXX::mqtt_discard_payload(uint32_t left)
+{
+	uint8_t discard[32];
+	uint32_t last = millis();
+	while (left > 0 && millis() - last < MQTT_PAYLOAD_TIMEOUT)
+	{
+		if (!modem->available())
+		{
+			delay(1);
+			continue;
+		}
+		uint16_t n = modem->readBytes(discard, left > sizeof(discard) ? sizeof(discard) : left);
+		left -= n;
+		last = millis();
+	}
+
+	if (left > 0)
+		log("mqtt payload is incomplete, " + String(left) + " bytes missing");
+
+	modem->readStringUntil(AT_TERMINATOR); // closing quote
+}
+
+// deprecated
+void MODEMBGXX::read_data(uint8_t index, String command, uint16_t bytes)
+{
+// 4 assumes MAX_CONNECTIONS will be under 10 (0 to 9)
+#ifdef DEBUG_BG95_HIGH
+	log("[read_data] '" + command + "'");
+#endif
+
+	// command = command.substring(4, command.length() - 2);
+
+	// bytes = command.toInt();
+
+#ifdef DEBUG_BG95_HIGH
+	log("[read_data] available bytes (" + String(index) + ") = " + String(bytes));
+#endif
+
+	if (bytes == 0)
+		return;
+
+	if (bytes + index < CONNECTION_BUFFER)
+	{
+		command.toCharArray(&buffers[index][buffer_len[index]], bytes);
+		buffer_len[index] += bytes;
+	}
+	else
+		log("buffer is full");
+
+	/**
+	 * This previous read can take "forever" and expire the connection state,
+	 * so in this particular case, we will assume the connection is still valid
+	 * and reset the timestamp.
+	 **/
+	connected_until[index] = millis() + CONNECTION_STATE;
+
+#ifdef DEBUG_BG95_HIGH
+	log("[read_data] all bytes read, in buffer " + String(buffer_len[index]) + " bytes");
+#endif
+
+	while (modem->available())
+	{
+		String line = read_line();
+
+		line.trim();
+
+		if (line == "OK")
+			break;
+
+		if (!parse_command_line(line, true))
+		{
+#ifdef DEBUG_BG95_HIGH
+			log("[read_data] ? = '" + line + "'");
+#endif
+		}
+	}
+
+	return tcp_check_data_pending();
+}
+
+bool MODEMBGXX::open_pdp_context(uint8_t contextID)
+{
+	if (contextID == 0 || contextID > MAX_CONNECTIONS)
+		return false;
+
+	if (op.technology == 0)
+		return false;
+
+	if (apn[contextID - 1].connected)
+		return false;
+
+	apn[contextID - 1].retry *= 2;
+	if (apn[contextID - 1].retry > 6 * 60 * 60 * 1000)
+		apn[contextID - 1].retry = 6 * 60 * 60 * 1000;
+
+	if (!check_command("AT+QIACT=" + String(contextID), "OK", "ERROR", 30000))
+	{
+		close_pdp_context(contextID);
+		return false;
+	}
+	return true;
+}
+
+bool MODEMBGXX::close_pdp_context(uint8_t tcp_cid)
+{
+
+	if (tcp_cid < 1 || tcp_cid > MAX_CONNECTIONS)
+		return false;
+
+	return check_command("AT+QIDEACT=" + String(tcp_cid), "OK", "ERROR");
+}
+
+bool MODEMBGXX::disable_pdp(uint8_t tcp_cid)
+{
+
+	if (tcp_cid < 1 || tcp_cid > MAX_CONNECTIONS)
+		return false;
+
+	if (!check_command("AT+CGACT=0," + String(tcp_cid), "OK", "ERROR", 10000))
+		return false;
+
+#ifdef DEBUG_BG95
+	log("PDP disabled");
+#endif
+
+	return true;
+}
+
+bool MODEMBGXX::enable_pdp(uint8_t tcp_cid)
+{
+
+	if (tcp_cid < 1 || tcp_cid > MAX_CONNECTIONS)
+		return false;
+
+	if (!check_command("AT+CGACT=1," + String(tcp_cid), "OK", "ERROR", 10000))
+		return false;
+
+#ifdef DEBUG_BG95
+	log("PDP enabled");
+#endif
+
+	return true;
+}
+
+int16_t MODEMBGXX::get_rssi()
+{
+
+	if (rssi_until > millis())
+	{
+		return rssi_last;
+	}
+
+	rssi_until = millis() + 20000;
+
+	String command = "AT+QCSQ";
+	String response = get_command(command, "+QCSQ: ", 300);
+
+	response.trim();
+	if (response.length() == 0)
+		return 0;
+
+	int p = response.indexOf(",");
+	String tech = response.substring(0, p);
+	tech.replace("\"", "");
+#ifdef DEBUG_BG95_HIGH
+	log("tech in use: " + tech);
+#endif
+	if (tech == "NBIoT")
+		op.technology = NB;
+	else if (tech == "GSM")
+		op.technology = GPRS;
+	else if (tech == "eMTC")
+		op.technology = CATM1;
+	else if (tech == "NOSERVICE")
+		op.technology = 0;
+
+	memset(op.tech_string, 0, sizeof(op.tech_string));
+	memcpy(op.tech_string, tech.c_str(), sizeof(op.tech_string));
+
+	response = response.substring(p + 1);
+	p = response.indexOf(",");
+	if (p > -1)
+		response = response.substring(0, p);
+
+	int rssi = 0;
+	if (isNumeric(response))
+	{
+		rssi = response.toInt();
+#ifdef DEBUG_BG95_HIGH
+		log("rssi: " + response);
+#endif
+	}
+
+	if (rssi != 0)
+		rssi_last = rssi;
+
+	rssi_until = millis() + 5000;
+	return rssi_last;
+
+	/*
+	for CSQ command
+	if (rssi == 0) {
+		rssi_last = -115;
+	} else if (rssi == 1) {
+		rssi_last = -111;
+	} else if (rssi == 31) {
+		rssi_last = -52;
+	} else if (rssi >= 2 && rssi <= 30) {
+		rssi_last = -110 + (rssi * 56 / 29);
+	} else {
+		rssi_last = 99;
+	}
+	*/
+}
+
+int16_t MODEMBGXX::rssi()
+{
+
+	return rssi_last;
+}
+
+String MODEMBGXX::technology()
+{
+
+	return String(op.tech_string);
+}
+
+// use it to get network clock
+bool MODEMBGXX::get_clock(tm *t)
+{
+	String response = get_command("AT+CCLK?", "+CCLK: ", 300);
+
+	if (response.length() == 0)
+		return false;
+
+	int8_t index = 0;
+
+	index = response.indexOf("/");
+	if (index == -1)
+		return false;
+
+	t->tm_year = (int)response.substring(index - 2, index).toInt();
+	response = response.substring(index + 1);
+
+	// log("year: "+String(t->tm_year));
+	// log("response: "+response);
+
+	index = response.indexOf("/");
+	if (index == -1)
+		return false;
+
+	t->tm_mon = (int)response.substring(index - 2, index).toInt();
+	response = response.substring(index + 1);
+
+	// log("month: "+String(t->tm_mon));
+	// log("response: "+response);
+
+	index = response.indexOf(",");
+	if (index > 0)
+		t->tm_mday = (int)response.substring(index - 2, index).toInt();
+	response = response.substring(index + 1);
+
+	// log("day: "+String(t->tm_mday));
+	// log("response: "+response);
+
+	index = response.indexOf(":");
+	if (index == -1)
+		return false;
+
+	t->tm_hour = (int)response.substring(index - 2, index).toInt();
+	response = response.substring(index + 1);
+
+	// log("hour: "+String(t->tm_hour));
+	// log("response: "+response);
+
+	index = response.indexOf(":");
+	if (index == -1)
+		return false;
+
+	t->tm_min = (int)response.substring(index - 2, index).toInt();
+	response = response.substring(index + 1);
+
+	// log("min: "+String(t->tm_min));
+	// log("response: "+response);
+
+	bool minus = false;
+	index = response.indexOf("+");
+	if (index == -1)
+	{
+		index = response.indexOf("-");
+		minus = true;
+	}
+
+	t->tm_sec = (int)response.substring(index - 2, index).toInt();
+	response = response.substring(index + 1);
+
+	// log("sec: "+String(t->tm_sec));
+
+	if (t->tm_year < 19)
+		return false;
+
+	if (response.toInt() != 0)
+	{
+		if (minus)
+		{
+			tz = -response.toInt() / 4 * 3600;
+			tz -= response.toInt() % 4 * 15 * 60;
+
+			t->tm_hour -= response.toInt() / 4;
+			t->tm_min -= response.toInt() % 4 * 15;
+		}
+		else
+		{
+			tz = response.toInt() / 4 * 3600;
+			tz += response.toInt() % 4 * 15 * 60;
+
+			t->tm_hour += response.toInt() / 4;
+			t->tm_min += response.toInt() % 4 * 15;
+		}
+	}
+
+	return true;
+}
+
+int32_t MODEMBGXX::get_tz()
+{
+	return tz;
+}
+
+void MODEMBGXX::sync_clock_ntp(bool force)
+{
+
+	if (clock_sync_timeout < millis() || force)
+		clock_sync_timeout = millis() + (3600 * 1000);
+	else
+		return;
+
+	if (!apn[0].connected)
+		return;
+
+	get_command("AT+QNTP=1,\"pool.ntp.org\",123", "+QNTP: ", 60000);
+}
+
+void MODEMBGXX::update_sys_clock()
+{
+
+	struct tm t;
+	if (get_clock(&t))
+	{
+
+		int y = t.tm_year;
+		int mo = t.tm_mon;
+		int d = t.tm_mday;
+		int h = t.tm_hour;
+		int m = t.tm_min;
+		int s = t.tm_sec;
+
+#ifdef DEBUG_BG95
+		log_output->printf("date(yyyy/mm/dd hh:mm:ss) - %d/%d/%d %d:%d:%d \n", y + 2000, mo, d, h, m, s);
+		log("tz: " + String(tz));
+#endif
+
+		setTime(h, m, s, d, mo, y);
+
+		log_output->println(now());
+	}
+}
+
+String MODEMBGXX::scan_cells()
+{
+#ifdef DEBUG_BG95
+	log("getting cells information..");
+#endif
+
+	// send_command("AT+CNETSCAN");
+	send_command("AT+QENG=\"NEIGHBOURCELL\"");
+	delay(AT_WAIT_RESPONSE);
+
+	uint32_t timeout = millis() + 50000;
+	String cells = "";
+
+	uint16_t counter = 0;
+	while (timeout >= millis())
+	{
+		if (modem->available())
+		{
+			String response = read_line();
+			counter += response.length();
+			response.trim();
+
+			if (response.length() == 0)
+				continue;
+
+			log(response);
+
+			if (response == "ERROR")
+				return "";
+			else if (response == "OK")
+			{
+#ifdef DEBUG_BG95
+				log("[cells info] response = '" + response + "'");
+#endif
+				return cells;
+			}
+			else
+				cells += response;
+
+			if (counter >= 255)
+			{
+				log("!! overflow");
+				return cells;
+			}
+		}
+
+		delay(AT_WAIT_RESPONSE);
+	}
+	return cells;
+}
+
+String MODEMBGXX::get_position()
+{
+#ifdef DEBUG_BG95
+	log("getting cells information..");
+#endif
+	log(get_command("AT+QGPSCFG=\"gnssconfig\""));
+
+	if (!check_command("AT+QGPS=1", "OK", "ERROR", 400))
+		return "";
+
+	String response = "";
+	// uint32_t timeout = millis() + 120000;
+	uint32_t timeout = millis() + 20000;
+	while (millis() < timeout)
+	{
+		response = get_command("AT+QGPSLOC=2", "+QGPSLOC: ", 300);
+#ifdef DEBUG_BG95
+		log(response);
+		log("response len: " + String(response.length()));
+#endif
+		if (response.length() > 0)
+		{
+			check_command("AT+QGPSEND", "OK", "ERROR", 400);
+			return response;
+		}
+		delay(2000);
+	}
+
+	check_command("AT+QGPSEND", "OK", "ERROR", 400);
+	/*
+
+	check_command("AT+QGPS=1", "OK", "ERROR", 400);
+
+	check_command("AT+QGPSCFG=\"nmeasrc\",1", "OK", "ERROR", 400);
+
+	check_command("AT+QGPSGNMEA=\"GGA\"", "OK", "ERROR", 400);
+
+	check_command("AT+QGPSGNMEA=\"RMC\"", "OK", "ERROR", 400);
+
+	check_command("AT+QGPSGNMEA=\"GSV\"", "OK", "ERROR", 400);
+
+	check_command("AT+QGPSGNMEA=\"GSA\"", "OK", "ERROR", 400);
+
+	check_command("AT+QGPSGNMEA=\"VTG\"", "OK", "ERROR", 400);
+
+	check_command("AT+QGPSGNMEA=\"GNS\"", "OK", "ERROR", 400);
+
+	check_command("AT+QGPSCFG=\"nmeasrc\",0", "OK", "ERROR", 400);
+	*/
+	return response;
+}
+
+bool MODEMBGXX::set_priority_mode(int priority_type, bool save)
+{
+	if (priority_type != PRIORITY_GNSS && priority_type != PRIORITY_WWAN)
+		return false;
+	
+	return check_command("AT+QGPSCFG=\"priority\"," + String(priority_type) + "," + String(int(save)), "OK", 300);
+}
+
+bool MODEMBGXX::switch_radio_off()
+{
+#ifdef DEBUG_BG95
+	log("switch radio off");
+#endif
+	if (check_command("AT+CFUN=0", "OK", "ERROR", 15000))
+	{
+		for (uint8_t i = 0; i < MAX_CONNECTIONS; i++)
+		{
+			apn[i].connected = false;
+		}
+		for (uint8_t i = 0; i < MAX_TCP_CONNECTIONS; i++)
+		{
+			data_pending[i] = false;
+			tcp[i].connected = false;
+		}
+		for (uint8_t i = 0; i < MAX_MQTT_CONNECTIONS; i++)
+		{
+			mqtt[i].connected = false;
+		}
+		return true;
+	}
+	else
+		return false;
+}
+
+String MODEMBGXX::get_imei()
+{
+	if (imei != "")
+		return imei;
+
+	String command = "AT+CGSN";
+	imei = get_command(command, 300);
+	return imei;
+}
+
+String MODEMBGXX::get_ccid()
+{
+	String command = "AT+QCCID";
+	return get_command(command, "+QCCID: ", 1000);
+}
+
+String MODEMBGXX::get_imsi()
+{
+	String command = "AT+CIMI";
+	return get_command(command, 300);
+}
+
+String MODEMBGXX::get_ip(uint8_t cid)
+{
+	if (cid == 0 || cid > MAX_CONNECTIONS)
+		return "";
+
+	String command = "AT+CGPADDR=" + String(cid);
+	return get_command(command, "+CGPADDR: " + String(cid) + ",", 300);
+}
+
+// --- MQTT ---
+/*
+ * init mqtt
+ *
+ * @callback - register callback to parse mqtt messages
+ */
+void MODEMBGXX::MQTT_init(bool (*callback)(uint8_t, String, String))
+{
+	parseMQTTmessage = callback;
+
+#ifdef MQTT_OUTBOX
+	outbox_begin();
+#endif
+#ifdef MQTT_JOURNAL
+	journal_begin();
+#endif
+
+	uint8_t i = 0;
+	while (i < MAX_MQTT_CONNECTIONS)
+	{
+		mqtt[i++].active = false;
+	}
+}
+
+/*
+ * register callback to parse mqtt messages of clientID, replaces the one of MQTT_init for this client.
+ * Allows each client (broker session) to have its own parser
+ *
+ * @callback - NULL to use the MQTT_init callback again
+ */
+void MODEMBGXX::MQTT_set_callback(uint8_t clientID, bool (*callback)(uint8_t, String, String))
+{
+	if (clientID >= MAX_MQTT_CONNECTIONS)
+		return;
+
+	parseMQTTclient[clientID] = callback;
+}
+
+/*
+ * setup mqtt
+ *
+ * @clientID - 0-5, limited to MAX_MQTT_CONNECTIONS
+ * @contextID - index of TCP tcp[] - choose 1 connection
+ * @willTopic - topic to be sent if mqtt loses connection
+ * @willPayload - payload to be sent with will topic
+ *
+ * returns true if configuration was succeed
+ */
+bool MODEMBGXX::MQTT_setup(uint8_t clientID, uint8_t contextID, String willTopic, String willPayload, uint16_t keepalive)
+{
+#ifdef DEBUG_BG95
+	log("Setup: clientID:" + String(clientID) + " contextID:" + String(contextID) + " willTopic:" + willTopic + " willPayload:" + willPayload);
+#endif
+
+	if (clientID >= MAX_MQTT_CONNECTIONS)
+		return false;
+
+	mqtt[clientID].contextID = contextID;
+	mqtt[clientID].clientID = clientID;
+	mqtt[clientID].active = true;
+
+	String s = "AT+QMTCFG=\"pdpcid\"," + String(clientID) + "," + String(mqtt[clientID].contextID);
+	check_command(s.c_str(), "OK", 2000);
+	// return false;
+
+	/*
+	 * By the BG96 MQTT Application Note V1.1:
+	 *
+	 * +QMTCFG: "recv/mode",<msg_recv_mode>[,<msg_len_enable>]
+	 *
+	 * <msg_recv_mode> Integer type. The MQTT message receiving mode.
+	 *   0 MQTT message received from server will be contained in URC
+	 *   1 MQTT message received from server will not be contained in URC
+	 * <msg_len_enable> Integer type.
+	 *   0 Length of MQTT message received from server will not be contained in URC
+	 *   1 Length of MQTT message received from server will be contained in URC
+	 *
+	 * URC = Unsolicited Result Code
+	 */
+
+	// payload_len is always reported, payload is read by length
+	s = "AT+QMTCFG=\"recv/mode\"," + String(clientID) + "," + String(MQTT_RECV_MODE) + ",1";
+	check_command(s.c_str(), "OK", 2000);
+	// return false;
+
+	s = "AT+QMTCFG=\"will\"," + String(clientID) + ",1,2,1,\"" + willTopic + "\",\"" + willPayload + "\"";
+	check_command(s.c_str(), "OK", 2000);
+	// return false;
+
+	s = "AT+QMTCFG=\"keepalive\"," + String(clientID) + "," + String(keepalive);
+	check_command(s.c_str(), "OK", 2000);
+
+	return true;
+}
+
+bool MODEMBGXX::MQTT_set_ssl(uint8_t clientID, uint8_t contextID, uint8_t sslClientID)
+{
+	if (clientID >= MAX_MQTT_CONNECTIONS)
+		return false;
+
+	String s = "AT+QMTCFG=\"ssl\"," + String(clientID) + ",1," + String(sslClientID);
+	if (!check_command(s.c_str(), "OK", 2000))
+		return false;
+	mqtt[clientID].ssl = true;
+	mqtt[clientID].sslClientID = sslClientID;
+	return set_ssl(sslClientID);
+}
+
+/*
+ * Connects to a mqtt broker
+ *
+ * @clientID: 0-5, limited to MAX_MQTT_CONNECTIONS
+ * @uid: id to register device on broker
+ * @uid: uid to register device on broker
+ * @user: credential
+ * @pass: credential
+ * @host: DNS or IP
+ * @port: default 1883
+ * @cleanSession: default 1 to start a clean session in broker
+ *
+ * return true if connection is open
+ */
+bool MODEMBGXX::MQTT_connect(uint8_t clientID, const char *uid, const char *user, const char *pass, const char *host, uint16_t port, uint8_t cleanSession)
+{
+	if (clientID >= MAX_MQTT_CONNECTIONS)
+		return false;
+
+	String host_str = String(host);
+	bool same_host = host_str == mqtt[clientID].host && port == mqtt[clientID].port;
+	memset(mqtt[clientID].host, 0, sizeof(mqtt[clientID].host));
+	memcpy(mqtt[clientID].host, host_str.c_str(), host_str.length());
+	mqtt[clientID].port = port;
+
+#ifdef DEBUG_BG95
+	log("Connect: " + String(host) + " cleanSession:" + String(cleanSession));
+#endif
+	// ssl needs the name for SNI and certificate validation
+	String address = host_str;
+	if (!mqtt[clientID].ssl)
+		address = dns_resolve(mqtt[clientID].contextID, host_str);
+
+	// state comes from +QMTOPEN/+QMTCLOSE/+QMTSTAT urcs, no need to query modem
+	if (!mqtt[clientID].opened || !same_host)
+	{
+		String s = "AT+QMTCFG=\"session\"," + String(clientID) + "," + String(cleanSession);
+		check_command(s.c_str(), "OK", 2000);
+
+		if (!MQTT_open(clientID, address.c_str(), port))
+		{
+			if (address != host_str)
+				dns_invalidate(mqtt[clientID].contextID, host_str);
+			return false;
+		}
+	}
+
+	uint8_t state = mqtt[clientID].socket_state;
+
+	if (state == MQTT_STATE_DISCONNECTING)
+	{
+		MQTT_close(clientID);
+		MQTT_disconnect(clientID);
+		MQTT_readAllBuffers(clientID);
+		return false;
+	}
+
+	if (state != MQTT_STATE_CONNECTING && state != MQTT_STATE_CONNECTED)
+	{
+		String s = "AT+QMTCONN=" + String(clientID) + ",\"" + String(uid) + "\",\"" + String(user) + "\",\"" + String(pass) + "\"";
+		check_command_no_ok(s.c_str(), "+QMTCONN: " + String(clientID) + ",0,0", 5000); // +QMTCONN updates state
+	}
+
+	return mqtt[clientID].connected;
+}
+
+/*
+ * return true if connection is open
+ */
+bool MODEMBGXX::MQTT_connected(uint8_t clientID)
+{
+	if (clientID >= MAX_MQTT_CONNECTIONS)
+		return false;
+
+	return mqtt[clientID].connected;
+}
+
+/*
+ * 0 Failed to close connection
+ *	1 Connection closed successfully
+ */
+int8_t MODEMBGXX::MQTT_disconnect(uint8_t clientID)
+{
+	if (clientID >= MAX_MQTT_CONNECTIONS)
+		return -1;
+
+	String s = "AT+QMTDISC=" + String(clientID);
+	String f = "+QMTDISC: " + String(clientID) + ",";
+	String response = get_command(s.c_str(), f.c_str(), 5000);
+
+	if (response.length() > 0)
+	{
+		int8_t rsp = -1;
+		if (isdigit(response.c_str()[0]))
+			rsp = (int)response.toInt();
+
+		if (rsp == 0)
+			mqtt[clientID].connected = false;
+
+		return (mqtt[clientID].connected == 0);
+	}
+	else
+		return 0;
+}
+
+/*
+ * return true if has succeed
+ */
+bool MODEMBGXX::MQTT_subscribeTopic(uint8_t clientID, uint16_t msg_id, String topic, uint8_t qos)
+{
+	if (clientID >= MAX_MQTT_CONNECTIONS)
+		return false;
+
+	String s;
+	s.reserve(512);
+	s = "AT+QMTSUB=" + String(clientID) + "," + String(msg_id);
+	s += ",\"" + topic + "\"," + String(qos);
+
+	String f = "+QMTSUB: " + String(clientID) + "," + String(msg_id) + ",";
+	// logging.println("BGxx","String: ",s);
+	// String response = getAtCommandResponseNoOK(s.c_str(),f.c_str(),18000);
+	String response = get_command_no_ok(s.c_str(), f.c_str(), 18000);
+	int8_t index = response.indexOf(",");
+#ifdef DEBUG_BG95_HIGH
+	log("response: " + String(response));
+#endif
+	if (index > -1)
+	{
+		response = response.substring(0, index);
+		if (isNumeric(response))
+		{
+			if ((int8_t)response.toInt() == 0)
+			{
+#ifdef DEBUG_BG95_HIGH
+				log("packet sent successfully");
+#endif
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/*
+ * subscribe topic and route its messages to handler instead of the callback registered on MQTT_init
+ *
+ * @topic - may contain + and # wildcards
+ * @handler - called with topic (without quotes) and payload of each message matching topic
+ *
+ * return true if has succeed
+ */
+bool MODEMBGXX::MQTT_subscribeTopic(uint8_t clientID, uint16_t msg_id, String topic, uint8_t qos, MQTTHandler handler)
+{
+	if (clientID >= MAX_MQTT_CONNECTIONS)
+		return false;
+
+	if (!MQTT_subscribeTopic(clientID, msg_id, topic, qos))
+		return false;
+
+	if (!mqtt_route_add(clientID, topic.c_str(), handler))
+	{
+		log("mqtt route of " + topic + " can't be stored");
+		String quoted = "\"" + topic + "\"";
+		MQTT_unSubscribeTopic(clientID, msg_id, &quoted, 1);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * return true if has succeed
+ */
+bool MODEMBGXX::MQTT_subscribeTopics(uint8_t clientID, uint16_t msg_id, String topic[], uint8_t qos[], uint8_t len)
+{
+	if (clientID >= MAX_MQTT_CONNECTIONS)
+		return false;
+
+	String s;
+	s.reserve(512);
+	s = "AT+QMTSUB=" + String(clientID) + "," + String(msg_id);
+	uint8_t i = 0;
+	while (i < len)
+	{
+		s += ",\"" + topic[i] + "\"," + String(qos[i]);
+		i++;
+	}
+
+	String f = "+QMTSUB: " + String(clientID) + "," + String(msg_id) + ",";
+
+	String response = get_command_no_ok(s.c_str(), f.c_str(), 18000);
+	int8_t index = response.indexOf(",");
+#ifdef DEBUG_BG95_HIGH
+	log("response: " + String(response));
+#endif
+	if (index > -1)
+	{
+		response = response.substring(0, index);
+		if (isNumeric(response))
+		{
+			if ((int8_t)response.toInt() == 0)
+			{
+#ifdef DEBUG_BG95_HIGH
+				log("packet sent successfully");
+#endif
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/*
+ * return true if has succeed
+ */
+int8_t MODEMBGXX::MQTT_unSubscribeTopic(uint8_t clientID, uint16_t msg_id, String topic[], uint8_t len)
+{
+	if (clientID >= MAX_MQTT_CONNECTIONS)
+		return -1;
+
+	String s = "AT+QMTUNS=" + String(clientID) + "," + String(msg_id);
+	uint8_t i = 0;
+	while (i < len)
+	{
+		s += "," + topic[i];
+		i++;
+	}
+
+	String f = "+QMTUNS: " + String(clientID) + "," + String(msg_id) + ",";
+	String response = get_command(s.c_str(), f.c_str(), 10000);
+	response = response.substring(0, 1);
+	int8_t result = (int8_t)response.toInt();
+	if (result != 0)
+		return result;
+
+	for (i = 0; i < len; i++)
+	{
+		String route = topic[i];
+		route.replace("\"", "");
+		mqtt_route_add(clientID, route.c_str(), NULL);
+	}
+	return result;
+}
+
+/*
+ *	return
+ *	-1 error
+ *	0 Packet sent successfully and ACK received from server (message that published when <qos>=0 does not require ACK)
+ *	1 Packet retransmission
+ *	2 Failed to send packet
+ */
+int8_t MODEMBGXX::MQTT_publish(uint8_t clientID, uint16_t msg_id, uint8_t qos, uint8_t retain, String topic, String msg)
+{
+	// payload is sent raw, quotes used by previous versions are not part of the message
+	if (msg.length() >= 2 && msg.startsWith("\"") && msg.endsWith("\""))
+		return MQTT_publish(clientID, msg_id, qos, retain, topic, (const uint8_t *)msg.c_str() + 1, msg.length() - 2);
+
+	return MQTT_publish(clientID, msg_id, qos, retain, topic, (const uint8_t *)msg.c_str(), msg.length());
+}
+
+/*
+ * publish binary payload, data is written after the '>' prompt of AT+QMTPUBEX so it doesn't need escaping
+ *
+ * @payload - message, may contain any byte
+ * @len - length of payload
+ *
+ *	return
+ *	-1 error
+ *	0 Packet sent successfully and ACK received from server (message that published when <qos>=0 does not require ACK)
+ *	1 Packet retransmission
+ *	2 Failed to send packet
+ *	Messages stored on outbox (MQTT_OUTBOX) or added to a batch (MQTT_batch) also return 0, they are sent later.
+ *	-1 is returned if a pending batch of topic can't be sent first, so order is kept
+ *
+ *	With MQTT_JOURNAL, msg_id of a qos 1/2 message must not be in use by a message waiting for ack,
+ *	including messages from before a reboot (MQTT_journal_pending), otherwise -1 is returned
+ */
+int8_t MODEMBGXX::MQTT_publish(uint8_t clientID, uint16_t msg_id, uint8_t qos, uint8_t retain, String topic, const uint8_t *payload, uint16_t len)
+{
+	if (clientID >= MAX_MQTT_CONNECTIONS)
+		return -1;
+
+	int8_t batch = mqtt_batch_find(clientID, topic);
+	if (batch > -1)
+	{
+		if (retain == 0 && qos <= mqtt_batch[batch].qos)
+		{
+			if (mqtt_batch_append(batch, payload, len))
+				return 0;
+		}
+		// priority messages and messages that don't fit go after what is already on batch, never ahead of it
+		if (!mqtt_batch_send(batch))
+			return -1;
+	}
+
+	int8_t result = mqtt_publish_direct(clientID, msg_id, qos, retain, topic, payload, len);
+
+	// stored on outbox, it is sent once client is connected
+	if (result == 3)
+		return 0;
+
+	return result;
+}
+
+/*
+ * private - publish without batching
+ */
+int8_t MODEMBGXX::mqtt_publish_direct(uint8_t clientID, uint16_t msg_id, uint8_t qos, uint8_t retain, String topic, const uint8_t *payload, uint16_t len)
+{
+#ifdef MQTT_COMPRESSION
+	mqtt_compress_payload(clientID, topic, payload, len);
+#endif
+
+#ifdef MQTT_OUTBOX
+	// older messages of client go first
+	if (!mqtt[clientID].connected || outbox_client_count[clientID] > 0)
+		return outbox_store(clientID, msg_id, qos, retain, topic, payload, len) ? 3 : -1;
+#else
+	if (!mqtt[clientID].connected)
+		return -1;
+#endif
+
+	uint32_t msg_id_ = msg_id;
+	if (qos == 0)
+		msg_id_ = 0;
+
+#ifdef MQTT_JOURNAL
+	int8_t slot = qos > 0 ? journal_store(clientID, msg_id_, qos, retain, topic, payload, len) : -1;
+	if (slot == -2)
+		return -1;
+	bool journaled = slot >= 0;
+#endif
+
+	if (!mqtt_send_publish(clientID, msg_id_, qos, retain, topic, payload, len))
+	{
+#ifdef MQTT_JOURNAL
+		if (journaled)
+			journal_remove(clientID, msg_id_);
+#endif
+		return -1;
+	}
+
+	int8_t result = mqtt_wait_published(clientID, msg_id_);
+
+#ifdef MQTT_JOURNAL
+	// without answer it is published again after reconnect, result 1 (retransmission) is completed by +QMTPUB urc
+	if (journaled && (result == 0 || result == 2))
+		journal_remove(clientID, msg_id_);
+	else if (journaled && result == -1)
+		journal_mark_replay(clientID, msg_id_);
+#endif
+
+	return result;
+}
+
+/*
+ * publish without waiting for broker ack, result is delivered to the callback set on
+ * MQTT_set_callback_on_published when +QMTPUB arrives. Messages with qos 0 complete once modem accepts them.
+ * Up to MQTT_INFLIGHT_WINDOW messages can wait for ack, each one must use a different msg_id.
+ * With MQTT_JOURNAL, msg_id must also differ from messages journaled before a reboot
+ *
+ * returns true if message was sent to modem, false if window is full, msg_id is in use or command failed
+ */
+bool MODEMBGXX::MQTT_publish_async(uint8_t clientID, uint16_t msg_id, uint8_t qos, uint8_t retain, String topic, const uint8_t *payload, uint16_t len)
+{
+	if (clientID >= MAX_MQTT_CONNECTIONS)
+		return false;
+
+	if (!mqtt[clientID].connected)
+		return false;
+
+#ifdef MQTT_COMPRESSION
+	mqtt_compress_payload(clientID, topic, payload, len);
+#endif
+
+	if (qos == 0)
+	{
+		if (!mqtt_send_publish(clientID, 0, 0, retain, topic, payload, len))
+			return false;
+		if (!wait_command("OK", 5000))
+			return false;
+		if (mqttOnPublished != NULL)
+			mqttOnPublished(clientID, msg_id, 0);
+		return true;
+	}
+
+	int8_t slot = -1;
+	for (uint8_t i = 0; i < MQTT_INFLIGHT_WINDOW; i++)
+	{
+		if (!mqtt_inflight[i].used)
+		{
+			slot = i;
+			break;
+		}
+	}
+	if (slot == -1)
+		return false;
+
+#ifdef MQTT_JOURNAL
+	int8_t stored = journal_store(clientID, msg_id, qos, retain, topic, payload, len);
+	if (stored == -2)
+		return false;
+	bool journaled = stored >= 0;
+#endif
+
+	if (!mqtt_send_publish(clientID, msg_id, qos, retain, topic, payload, len))
+	{
+#ifdef MQTT_JOURNAL
+		if (journaled)
+			journal_remove(clientID, msg_id);
+#endif
+		return false;
+	}
+
+	// track it before OK, +QMTPUB may arrive while waiting
+	mqtt_inflight[slot].used = true;
+	mqtt_inflight[slot].clientID = clientID;
+	mqtt_inflight[slot].msg_id = msg_id;
+	mqtt_inflight[slot].sent_at = millis();
+
+	if (!wait_command("OK", 5000) && mqtt_inflight[slot].used && mqtt_inflight[slot].msg_id == msg_id)
+	{
+		mqtt_inflight[slot].used = false;
+#ifdef MQTT_JOURNAL
+		if (journaled)
+			journal_remove(clientID, msg_id);
+#endif
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * returns number of async publishes of clientID waiting for ack
+ */
+uint8_t MODEMBGXX::MQTT_inflight(uint8_t clientID)
+{
+	uint8_t count = 0;
+	for (uint8_t i = 0; i < MQTT_INFLIGHT_WINDOW; i++)
+	{
+		if (mqtt_inflight[i].used && mqtt_inflight[i].clientID == clientID)
+			count++;
+	}
+	return count;
+}
+
+/*
+ * register callback for async publishes
+ *
+ * @result - 0 ack received, 2 failed to send, -1 no answer during MQTT_INFLIGHT_TIMEOUT
+ */
+void MODEMBGXX::MQTT_set_callback_on_published(void (*callback)(uint8_t clientID, uint16_t msg_id, int8_t result))
+{
+	mqttOnPublished = callback;
+}
+
+/*
+ * collect messages of topic into batches, MQTT_publish calls for topic don't need to change.
+ * A batch is published when next message doesn't fit on MQTT_BATCH_SIZE bytes, when its first message is
+ * older than MQTT_BATCH_MAX_AGE, or before a message with higher qos or retain flag is published on topic
+ *
+ * @topic - exact topic, wildcards are not supported
+ * @qos - qos of batches, messages with higher qos are priority and are not batched
+ * @format - MQTT_BATCH_JSON joins payloads on a json array [p1,p2,...]
+ *           MQTT_BATCH_LENGTH_PREFIXED writes each payload as <len:2 big endian><payload>
+ *
+ * returns true if succeed, false if there are no free batches
+ */
+bool MODEMBGXX::MQTT_batch(uint8_t clientID, String topic, uint8_t qos, uint8_t format)
+{
+	if (clientID >= MAX_MQTT_CONNECTIONS || topic.length() >= sizeof(mqtt_batch[0].topic))
+		return false;
+
+	int8_t batch = mqtt_batch_find(clientID, topic);
+	if (batch == -1)
+	{
+		for (uint8_t i = 0; i < MQTT_BATCH_TOPICS; i++)
+		{
+			if (!mqtt_batch[i].used)
+			{
+				batch = i;
+				break;
+			}
+		}
+		if (batch == -1)
+			return false;
+
+		memset(mqtt_batch[batch].topic, 0, sizeof(mqtt_batch[batch].topic));
+		strncpy(mqtt_batch[batch].topic, topic.c_str(), sizeof(mqtt_batch[batch].topic) - 1);
+		mqtt_batch[batch].clientID = clientID;
+		mqtt_batch[batch].len = 0;
+		mqtt_batch[batch].count = 0;
+		mqtt_batch[batch].used = true;
+	}
+	else
+	{
+		mqtt_batch_send(batch);
+	}
+
+	mqtt_batch[batch].qos = qos;
+	mqtt_batch[batch].format = format;
+
+	return true;
+}
+
+/*
+ * publish pending batches and stop batching topic
+ */
+void MODEMBGXX::MQTT_batch_remove(uint8_t clientID, String topic)
+{
+	int8_t batch = mqtt_batch_find(clientID, topic);
+	if (batch == -1)
+		return;
+
+	mqtt_batch_send(batch);
+	mqtt_batch[batch].used = false;
+}
+
+/*
+ * publish all pending batches now
+ */
+void MODEMBGXX::MQTT_batch_flush()
+{
+	for (uint8_t i = 0; i < MQTT_BATCH_TOPICS; i++)
+	{
+		if (mqtt_batch[i].used)
+			mqtt_batch_send(i);
+	}
+}
+
+#ifdef MQTT_COMPRESSION
+/*
+ * compress payloads published on topic with lzss, compressed messages are published on topic + MQTT_COMPRESS_SUFFIX.
+ * If payload doesn't get smaller it is published as is on topic.
+ * Received messages on topic + MQTT_COMPRESS_SUFFIX are decompressed and delivered with topic,
+ * subscribe both topics (or a wildcard) to receive them.
+ * Messages delivered in chunks (MQTT_set_stream_handler) are not decompressed
+ *
+ * @topic - exact topic, wildcards are not supported
+ * @dict - preset dictionary, usually a sample message, it must be the same on both ends and stay valid while in use
+ *
+ * returns true if succeed, false if there are no free topics
+ */
+bool MODEMBGXX::MQTT_compress(uint8_t clientID, String topic, const uint8_t *dict, uint16_t dict_len)
+{
+	if (clientID >= MAX_MQTT_CONNECTIONS || topic.length() >= sizeof(mqtt_compress[0].topic))
+		return false;
+
+	int8_t index = mqtt_compress_find(clientID, topic.c_str(), topic.length());
+	if (index == -1)
+	{
+		for (uint8_t i = 0; i < MQTT_COMPRESS_TOPICS; i++)
+		{
+			if (!mqtt_compress[i].used)
+			{
+				index = i;
+				break;
+			}
+		}
+		if (index == -1)
+			return false;
+
+		memset(mqtt_compress[index].topic, 0, sizeof(mqtt_compress[index].topic));
+		strncpy(mqtt_compress[index].topic, topic.c_str(), sizeof(mqtt_compress[index].topic) - 1);
+		mqtt_compress[index].clientID = clientID;
+		mqtt_compress[index].used = true;
+	}
+
+	mqtt_compress[index].dict = dict;
+	mqtt_compress[index].dict_len = dict == NULL ? 0 : dict_len;
+
+	return true;
+}
+
+/*
+ * stop compressing topic
+ */
+void MODEMBGXX::MQTT_compress_remove(uint8_t clientID, String topic)
+{
+	int8_t index = mqtt_compress_find(clientID, topic.c_str(), topic.length());
+	if (index != -1)
+		mqtt_compress[index].used = false;
+}
+#endif
+
+/*
+ * messages bigger than threshold are delivered in chunks instead of going to subscription handlers
+ * or to the MQTT_init callback, so they don't need to fit on RAM
+ *
+ * @threshold - payload length in bytes, limited to MQTT_RX_BUFFER
+ * @begin - called with topic and payload length
+ * @data - called for each chunk of payload, up to MQTT_RX_BUFFER bytes
+ * @end - called when message ends, complete is false if payload didn't arrive entirely
+ */
+void MODEMBGXX::MQTT_set_stream_handler(uint32_t threshold,
+	void (*begin)(uint8_t clientID, const char *topic, uint32_t total_len),
+	void (*data)(uint8_t clientID, const uint8_t *chunk, uint16_t len),
+	void (*end)(uint8_t clientID, bool complete))
+{
+	if (threshold > MQTT_RX_BUFFER)
+		threshold = MQTT_RX_BUFFER;
+
+	mqtt_stream_threshold = threshold;
+	mqttStreamBegin = begin;
+	mqttStreamData = data;
+	mqttStreamEnd = end;
+}
+
+/*
+ * keep clientID connected: pdp context, AT+QMTOPEN, AT+QMTCONN and subscriptions are handled on loop.
+ * Failed attempts are retried with exponential backoff, from MQTT_RECONNECT_MIN up to MQTT_RECONNECT_MAX,
+ * with random jitter so devices don't reconnect at the same time
+ *
+ * @clientID, @uid, @user, @pass, @host, @port, @cleanSession - same as MQTT_connect
+ *
+ * return true if clientID is valid
+ */
+bool MODEMBGXX::MQTT_supervise(uint8_t clientID, const char *uid, const char *user, const char *pass, const char *host, uint16_t port, uint8_t cleanSession)
+{
+	if (clientID >= MAX_MQTT_CONNECTIONS)
+		return false;
+
+	MQTTSupervisor *sv = &mqtt_supervisor[clientID];
+	memset(sv, 0, sizeof(MQTTSupervisor));
+	strncpy(sv->uid, uid, sizeof(sv->uid) - 1);
+	strncpy(sv->user, user, sizeof(sv->user) - 1);
+	strncpy(sv->pass, pass, sizeof(sv->pass) - 1);
+	strncpy(sv->host, host, sizeof(sv->host) - 1);
+	sv->port = port;
+	sv->clean_session = cleanSession;
+	sv->active = true;
+
+	return true;
+}
+
+/*
+ * remember a subscription of a supervised client, subscriptions are sent after each connection,
+ * up to 5 on each AT+QMTSUB
+ *
+ * return false if there is no space for more topics (MQTT_SUPERVISOR_TOPICS)
+ */
+bool MODEMBGXX::MQTT_supervise_subscribe(uint8_t clientID, String topic, uint8_t qos)
+{
+	if (clientID >= MAX_MQTT_CONNECTIONS || topic.length() >= sizeof(mqtt_supervisor[0].topic[0]))
+		return false;
+
+	MQTTSupervisor *sv = &mqtt_supervisor[clientID];
+	if (sv->topics >= MQTT_SUPERVISOR_TOPICS)
+		return false;
+
+	strncpy(sv->topic[sv->topics], topic.c_str(), sizeof(sv->topic[0]) - 1);
+	sv->qos[sv->topics] = qos;
+	sv->topics++;
+	sv->subscribed = false; // new topic is sent on next loop
+
+	return true;
+}
+
+/*
+ * stop supervising clientID, connection is kept
+ */
+void MODEMBGXX::MQTT_supervise_stop(uint8_t clientID)
+{
+	if (clientID >= MAX_MQTT_CONNECTIONS)
+		return;
+
+	mqtt_supervisor[clientID].active = false;
+}
+
+/*
+ * Forces reading data from mqtt modem buffers
+ * call it only if unsolicited messages are not being processed
+ */
+void MODEMBGXX::MQTT_readAllBuffers(uint8_t clientID)
+{
+	if (clientID >= MAX_MQTT_CONNECTIONS)
+		return;
 
-		index = line.lastIndexOf(",");
-		if (index > -1)
-		{
-			String ip = line.substring(index + 1);
-			ip.replace("\"", "");
-			memset(apn[cid - 1].ip, 0, sizeof(apn[cid - 1].ip));
-			memcpy(apn[cid - 1].ip, ip.c_str(), ip.length());
-		}
-		else
+	String s = "";
+	if (MQTT_connected(clientID))
+	{
+		for (uint8_t i = 0; i < 5; i++)
 		{
-			return "";
+			s = "AT+QMTRECV=" + String(clientID) + "," + String(i);
+			get_command(s.c_str(), 400);
 		}
+		mqtt_channels[clientID] = 0;
 	}
-	else if (line.startsWith("+QMTSTAT"))
+
+	return;
+}
+
+/*
+ * private - Updates mqtt.socket_state of each initialized connection
+ *
+ *	0 MQTT is disconnected
+ *	1 MQTT is initializing
+ *	2 MQTT is connecting
+ *	3 MQTT is connected
+ *	4 MQTT is disconnecting
+ */
+void MODEMBGXX::MQTT_checkConnection()
+{
+	if (mqtt_check_until > millis())
+		return;
+
+	mqtt_check_until = millis() + MQTT_STATE_CHECK_INTERVAL;
+
+	// modem only lists clients that are not disconnected
+	mqtt_state_reported = 0;
+	// clients are only cleared when the list is complete, a timeout would mark all of them as disconnected
+	if (!check_command("AT+QMTCONN?", "OK", "ERROR", 2000))
+		return;
+
+	for (uint8_t i = 0; i < MAX_MQTT_CONNECTIONS; i++)
 	{
-		// error ocurred, channel is disconnected
-		String filter = "+QMTSTAT: ";
-		int8_t index = line.indexOf(filter);
-		line = line.substring(index);
-		index = line.indexOf(",");
-		if (index > -1)
-		{
-			String client = line.substring(filter.length(), index);
-#ifdef DEBUG_BG95_HIGH
-			log("client: " + client);
-#endif
-			if (isNumeric(client))
-			{
-				uint8_t id = client.toInt();
-				if (id <= MAX_MQTT_CONNECTIONS)
-				{
-					mqtt[id].socket_state = MQTT_STATE_DISCONNECTED;
-					mqtt[id].connected = false;
-				}
+		if (mqtt_state_reported & (1 << i))
+			continue;
+
 #ifdef DEBUG_BG95
-				log("MQTT closed");
+		if (mqtt[i].connected)
+			log("mqtt client " + String(i) + " was disconnected without notice");
+#endif
+		mqtt[i].socket_state = MQTT_STATE_DISCONNECTED;
+		mqtt[i].connected = false;
+		mqtt[i].opened = false;
+#ifdef MQTT_JOURNAL
+		journal_session_lost(i);
 #endif
-			}
-		}
 	}
-	else if (line.startsWith("+QMTRECV:"))
+
+	return;
+}
+
+/*
+ * private - updates state from +QMTOPEN: <client>,<result>, +QMTCLOSE: <client>,<result> and +QMTDISC: <client>,<result>
+ * +QMTOPEN: <client>,"<host>",<port> is the answer of AT+QMTOPEN? for an opened client
+ */
+void MODEMBGXX::mqtt_state_urc(String line)
+{
+	int8_t index = line.indexOf(": ");
+	int8_t comma = line.indexOf(",");
+	if (index == -1 || comma == -1)
+		return;
+
+	uint8_t clientID = line.substring(index + 2, comma).toInt();
+	if (clientID >= MAX_MQTT_CONNECTIONS)
+		return;
+
+	bool query = line.charAt(comma + 1) == '"';
+	int8_t result = line.substring(comma + 1).toInt();
+
+	if (line.startsWith("+QMTOPEN: "))
 	{
-		return mqtt_message_received(line);
+		mqtt[clientID].opened = query || result == 0;
+		if (!mqtt[clientID].opened)
+			mqtt[clientID].connected = false;
+		else if (mqtt[clientID].socket_state == MQTT_STATE_DISCONNECTED)
+			mqtt[clientID].socket_state = MQTT_STATE_INITIALIZING;
 	}
-	else if (line.startsWith("+QMTCONN: "))
+	else if (result == 0)
 	{
-		String filter = "+QMTCONN: ";
-		line = line.substring(filter.length());
-		index = line.indexOf(",");
-		if (index > -1)
-		{
-			this->_MQTT_check_in_progress = false;
-			uint8_t cidx = line.substring(0, index).toInt();
-			if (cidx < MAX_MQTT_CONNECTIONS)
-			{
-				if (line.lastIndexOf(",") != index)
-				{
-					index = line.lastIndexOf(",");
-					String state = line.substring(index + 1, index + 2);
-					if ((int)state.toInt() == 0)
-					{
-						mqtt[cidx].socket_state = MQTT_STATE_CONNECTED;
-						mqtt[cidx].connected = true;
-					}
-					else
-					{
-						mqtt[cidx].socket_state = MQTT_STATE_DISCONNECTED;
-						mqtt[cidx].connected = false;
-						switch ((int)state.toInt())
-						{
-						case 0:
-							log("mqtt client " + String(cidx) + " Connection refused - Unacceptable Protocol Version");
-							break;
-						case 1:
-							log("mqtt client " + String(cidx) + " Connection refused - Identifier Rejected");
-							break;
-						case 2:
-							log("mqtt client " + String(cidx) + " Connection refused - Server Unavailable");
-							break;
-						case 3:
-							log("mqtt client " + String(cidx) + " Connection refused - Not Authorized");
-						}
-					}
-				}
-				else
-				{
-					String state = line.substring(index + 1, index + 2);
-					if (isdigit(state.c_str()[0]))
-					{
-						mqtt[cidx].socket_state = (int)state.toInt();
-						mqtt[cidx].connected = (int)(state.toInt() == MQTT_STATE_CONNECTED);
-#ifdef DEBUG_BG95
-						if (mqtt[cidx].connected)
-							log("mqtt client " + String(cidx) + " is connected");
-						else
-							log("mqtt client " + String(cidx) + " is disconnected");
-#endif
-						return "";
-					}
-				}
-			}
-		}
+		// closed or disconnected, network connection is also closed
+		mqtt[clientID].opened = false;
+		mqtt[clientID].connected = false;
+		mqtt[clientID].socket_state = MQTT_STATE_DISCONNECTED;
 	}
-	else if (line.startsWith("+QHTTPGET: "))
+
+#ifdef DEBUG_BG95_HIGH
+	log("mqtt client " + String(clientID) + " opened: " + String(mqtt[clientID].opened) + " connected: " + String(mqtt[clientID].connected));
+#endif
+}
+
+/*
+ * private
+ */
+bool MODEMBGXX::MQTT_open(uint8_t clientID, const char *host, uint16_t port)
+{
+
+	if (clientID >= MAX_MQTT_CONNECTIONS)
+		return false;
+
+	if (mqtt[clientID].opened)
+		MQTT_close(clientID);
+
+	// +QMTOPEN sets opened
+	String s = "AT+QMTOPEN=" + String(clientID) + ",\"" + String(host) + "\"," + String(port);
+	uint32_t start = millis();
+	if (check_command_no_ok(s.c_str(), "+QMTOPEN: " + String(clientID) + ",0", 5000))
 	{
-		return _HTTP_response_received(line.substring(11));
+		if (mqtt[clientID].ssl)
+			ssl_record_connect(mqtt[clientID].sslClientID, String(host), millis() - start);
 	}
-	else if (line.startsWith("+QHTTPREADFILE: ") && this->_HTTP_request_in_progress) 
+
+	return mqtt[clientID].opened;
+}
+/*
+ * private
+ */
+bool MODEMBGXX::MQTT_isOpened(uint8_t clientID, const char *host, uint16_t port)
+{
+
+	String s = "AT+QMTOPEN?"; //+to_string(clientID)+",\""+string(settings.mqtt.host)+"\","+to_string(settings.mqtt.port);
+	String ans = "+QMTOPEN: " + String(clientID) + ",\"" + String(host) + "\"," + String(port);
+
+	return check_command(s.c_str(), ans.c_str(), 2000);
+}
+/*
+ * private
+ */
+bool MODEMBGXX::MQTT_close(uint8_t clientID)
+{
+	if (clientID >= MAX_MQTT_CONNECTIONS)
+		return false;
+
+	String s = "AT+QMTCLOSE=" + String(clientID);
+	String f = "+QMTCLOSE: " + String(clientID) + ",";
+	String response = get_command(s.c_str(), f.c_str(), 10000);
+
+	if (response.length() > 0)
 	{
-		return _HTTP_file_downloaded(line.substring(16));
+		if (isdigit(response.c_str()[0]))
+			return (int)response.toInt() == 0; // +QMTCLOSE updates state
 	}
-	else if (line.startsWith("+CME ERROR: ") && this->_HTTP_request_in_progress)
+
+	return false;
+}
+/*
+ * private - Reads data on mqtt modem buffers. Call it with high frequency
+ * No need to use if mqtt messages came on unsolicited response (current configuration)
+ */
+void MODEMBGXX::MQTT_readMessages(uint8_t clientID)
+{
+	if (clientID >= MAX_MQTT_CONNECTIONS)
+		return;
+
+	/* only channels signalled by +QMTRECV: <client>,<channel> are read */
+	for (uint8_t i = 0; i < 5 && mqtt_channels[clientID] != 0; i++)
 	{
-		return _HTTP_file_download_error(line.substring(12));
+		if ((mqtt_channels[clientID] & (1 << i)) == 0)
+			continue;
+
+		// cleared before the command, a +QMTRECV urc received meanwhile sets it again
+		mqtt_channels[clientID] &= ~(1 << i);
+		String s = "AT+QMTRECV=" + String(clientID) + "," + String(i);
+		if (!check_command(s.c_str(), "OK", "ERROR", 1000))
+			mqtt_channels[clientID] |= 1 << i; // message is still on modem, read it again on next call
 	}
-	else if (line.startsWith("OK"))
-		return "";
 
-	return line;
+	return;
+}
+
+// --- --- ---
+
+// --- HTTP ---
+bool MODEMBGXX::HTTP_config(uint8_t contextID)
+{
+	String s;
+	s = "AT+QHTTPCFG=\"contextid\"," + String(contextID);
+	if(check_command(s, "OK", 500) == false)
+		return false;
+
+	s = "AT+QHTTPCFG=\"responseheader\",0";
+	if(check_command(s, "OK", 500) == false)
+		return false;
+
+	s = "AT+QHTTPCFG=\"requestheader\",0";
+	if(check_command(s, "OK", 500) == false)
+		return false;
+
+	return true;
+}
+
+void MODEMBGXX::HTTP_GET_download(String url, String filename, 
+	void (*pending_callback)(int16_t http_status, size_t content_length),
+		void (*finished_callback)(void),
+		void (*failed_callback)(void))
+{
+	check_command("AT+QFDEL=\"" + filename + "\"", "OK", 1000);
+	this->_HTTP_download_filename = filename;
+
+	String s = "AT+QHTTPURL=" + String(url.length()) + ",5";
+	send_command(s);
+	delay(AT_WAIT_RESPONSE);
+
+	String connect_resp = read_line();
+	connect_resp.trim();
+	if(connect_resp.length() == 0)
+		connect_resp = read_line();
+	connect_resp.trim();
+	log("connect_resp = " + connect_resp);
+	if(connect_resp.indexOf("CME ERROR") > -1) {
+		return;
+	}
+	if(connect_resp.indexOf("CONNECT") < 0) {
+		#ifdef DEBUG_BG95_HIGH
+		log("no CONNECT found");
+		#endif
+		return;
+	}
+
+	if(check_command(url, "OK", 1000) != true)
+		return;	
+
+	if(check_command("AT+QHTTPGET=120", "OK", 500) != true)
+		return;
+
+	this->_HTTP_request_in_progress = true;
+
+	httpPendingCallback = pending_callback;
+	httpFinishedCallback = finished_callback;
+	httpFailedCallback = failed_callback;
 }
 
-String MODEMBGXX::mqtt_message_received(String line)
+// sample responses to parse:
+// +QHTTPGET: 0,200,970704
+// +QHTTPGET: Http timeout
+String MODEMBGXX::_HTTP_response_received(String values)
 {
+	if(!isDigit(values[0])) {
+		if(httpFailedCallback)
+			httpFailedCallback();
+		return "";
+	}
 
-	String filter = "+QMTRECV: ";
-	int index = line.indexOf(",");
-	int last_index = -1;
-	uint8_t clientID = 0;
-	if (index > -1)
-	{														 // filter found
-		String aux = line.substring(filter.length(), index); // client id
-		if (isNumeric(aux))
-		{
-			clientID = aux.toInt();
-		}
-		else
-			return "";
+	int sepindex1 = values.indexOf(",");
+	int sepindex2 = values.lastIndexOf(",");
+	uint16_t http_status = (uint16_t)values.substring(sepindex1+1,sepindex2).toInt();
+	size_t content_length = (size_t)values.substring(sepindex2+1).toInt();
+	this->_HTTP_download_content_length = content_length;
 
-		last_index = line.lastIndexOf(",");
+	if(http_status != 200) {
+		if(httpPendingCallback)
+			httpPendingCallback(http_status, content_length);
+		if(httpFailedCallback)
+			httpFailedCallback();
+		return "";
+	}
+	read_line();
 
-		if (MQTT_RECV_MODE)
-		{
+	check_command("AT+QHTTPREADFILE=\"" + this->_HTTP_download_filename + "\",300", "OK", 1000);
 
-			if (index == last_index)
-			{												// URC reporting new message
-				aux = line.substring(index + 1, index + 2); // channel
-				if (isNumeric(aux))
-				{
-					uint8_t channel = (uint8_t)aux.toInt();
-					if (channel < 5)
-						mqtt_buffer[channel] = 0; // I do not know the length of the payload that will be read
-				}
-				else
-					return "";
-				return "";
-			}
+	if(httpPendingCallback)
+		httpPendingCallback(http_status, content_length);
+		
+	return "";
+}
 
-			line = line.substring(index + 1); // null
+String MODEMBGXX::_HTTP_file_downloaded(String values)
+{
+	this->_HTTP_request_in_progress = false;
 
-			index = line.indexOf(",");
-			aux = line.substring(0, index); // msg_id
-			if (isNumeric(aux))
-			{
-				// uint16_t msg_id = (uint8_t)aux.toInt();
-				line = line.substring(index + 1);
-			}
-			else
-				return "";
+	#ifdef DEBUG_BG95_HIGH
+	log("HTTP file downloaded: " + values);
+	#endif
 
-			index = line.indexOf(",");
-			if (index > -1 && index != last_index)
-			{
-				String topic = line.substring(0, index);
-				line = line.substring(index + 1);
-				index = line.indexOf(",");
-				if (index == -1)
-					return "";
-				String len = line.substring(0, index);
-				String payload = line.substring(index + 1);
-				int len_ = len.toInt();
-
-				if (len_ != 0)
-				{
+	if(values[0] != '0' ) {	
+		if(httpFailedCallback)
+			httpFailedCallback();
+		return "";
+	}
 
-					if (!payload.endsWith("\""))
-						payload += "\n"; // it was terminated due to break line found on payload
-					uint32_t timeout = millis() + 300;
-					while (timeout > millis())
-					{
-						String response = modem->readString();
-						payload += response;
-						if (payload.length() - 2 >= len_)
-							break;
-					}
+	// bool size_valid = check_command("AT+QFLST=\""+this->_HTTP_download_filename+"\"", 
+	// 	"+QFLST: \""+this->_HTTP_download_filename+"\"," + String(this->_HTTP_download_content_length),
+	// 	1000
+	// );
+	// if(!size_valid) {
+	// 	#ifdef DEBUG_BG95_HIGH
+	// 	log("downloaded file size does not match http response content-length");
+	// 	#endif
+	// 	if(httpFailedCallback)
+	// 		httpFailedCallback();
+	// 	return "";
+	// }
 
-					if (payload.length() - 2 >= len_)
-					{
-						payload = payload.substring(1, len_ + 1);
-					}
-					else if (payload.length() < len_)
-					{
-						log("!! payload is incomplete");
-					}
-					Serial.printf("payload len %d \n", payload.length());
-					Serial.println(payload);
-				}
-				else
-					payload = "";
+	if(httpFinishedCallback)
+		httpFinishedCallback();
+	return "";
+}
 
-				if (parseMQTTmessage != NULL)
-					parseMQTTmessage(clientID, topic, payload);
-			}
-		}
-		else
-		{
+String MODEMBGXX::_HTTP_file_download_error(String line)
+{
+	this->_HTTP_request_in_progress = false;
 
-			aux = line.substring(index + 1, index + 2); // channel
-			if (isNumeric(aux))
-			{
-				uint8_t channel = (uint8_t)aux.toInt();
-				if (channel < 5)
-					mqtt_buffer[channel] = 0;	  // I do not know the length of the payload that will be read
-				line = line.substring(index + 2); // null
-			}
-			else
-				return "";
+	#ifdef DEBUG_BG95_HIGH
+	log("file download error: " + line);
+	get_command("AT+QFLST=\"*\"");
+	#endif
+	return "";
+}
+// --- --- ---
 
-			index = line.indexOf(",");
-			if (index > -1)
-			{ // has topic
-				line = line.substring(index + 1);
-				index = line.indexOf(",");
-				if (index > -1 && index != last_index)
-				{
-					String topic = line.substring(0, index);
-					String payload = line.substring(index + 1);
-					if (parseMQTTmessage != NULL)
-						parseMQTTmessage(clientID, topic, payload);
-				}
-			}
-		}
+// --- FILE ---
+
+/*
+ * uploads data to UFS as filename (AT+QFUPL), an existing file is replaced
+ *
+ * returns true if succeed
+ */
+bool MODEMBGXX::FILE_upload(String filename, const uint8_t *data, size_t size)
+{
+	/*
+	AT+QFUPL=filename,size,timeout
+	CONNECT
+	...
+	+QFUPL: size,checksum
+	OK
+	*/
+	FILE_delete(filename); // QFUPL fails if file exists
+
+	if (!check_command_no_ok("AT+QFUPL=\"" + filename + "\"," + String(size) + ",60", "CONNECT", "ERROR", 5000))
+		return false;
+
+	size_t offset = 0;
+	while (offset < size)
+	{
+		size_t len = size - offset;
+		if (len > 1024)
+			len = 1024;
+		modem->write(data + offset, len);
+		offset += len;
 	}
+	modem->flush();
 
-	return "";
+	return wait_command("+QFUPL: " + String(size), 10000);
 }
 
-// deprecated
-void MODEMBGXX::read_data(uint8_t index, String command, uint16_t bytes)
+/*
+ * deletes filename from UFS
+ *
+ * returns true if succeed
+ */
+bool MODEMBGXX::FILE_delete(String filename)
 {
-// 4 assumes MAX_CONNECTIONS will be under 10 (0 to 9)
+	return check_command("AT+QFDEL=\"" + filename + "\"", "OK", "ERROR", 1000);
+}
+
+void MODEMBGXX::FILE_get_chunk(String filename, char *buf, size_t size, size_t offset, size_t* read_bytes)
+{
+	/* 
+	AT+QFOPEN=filename,2
+	+QFOPEN: filehandle
+	OK
+	AT+QFSEEK=filehandle,offset,0
+	OK
+	AT+QFREAD=filehandle,size
+	CONNECT read_length\r
+	...
+	OK
+	AT+QFCLOSE=filehandle
+	OK
+	*/
+	String s = get_command_critical("AT+QFOPEN=\""+filename+"\",2", "+QFOPEN: ", 1000);
+	if(!isDigit(s[0])) {
+		*read_bytes = 0;
+		return;
+	}
+
+	int filehandle = s.toInt();
+
+	bool ok = check_command("AT+QFSEEK=" + String(filehandle) + "," + String(offset) + ",0", "OK");
+	if(!ok) {
+		*read_bytes = 0;
+		check_command("AT+QFCLOSE=" + String(filehandle), "OK");
+		return;
+	}
+
+	send_command("AT+QFREAD=" + String(filehandle) + "," + String(size));
+	delay(AT_WAIT_RESPONSE);
+
+	s = ""; // holds file handle until CONNECT arrives
+
+	uint32_t timeout = 1000 + millis();
+	while(timeout >= millis())
+	{
+		if(modem->available()) {
+			String response = read_line();
+
+			response.trim();
+
+			if (response.length() == 0)
+				continue; // garbage
+
 #ifdef DEBUG_BG95_HIGH
-	log("[read_data] '" + command + "'");
+			log("<< " + response);
 #endif
 
-	// command = command.substring(4, command.length() - 2);
+			String filter = "CONNECT ";
+			if (response.startsWith(filter))
+				s = response.substring(filter.length());
+		} 
+		if (s.length() > 0)
+			break;
 
-	// bytes = command.toInt();
+		delay(AT_WAIT_RESPONSE);
+	}
 
 #ifdef DEBUG_BG95_HIGH
-	log("[read_data] available bytes (" + String(index) + ") = " + String(bytes));
+	log("QFREAD CONNECT output = " + s);
 #endif
-
-	if (bytes == 0)
+	if(s.length() == 0 || !isDigit(s[0])) {
+		*read_bytes = 0;
+		check_command("AT+QFCLOSE=" + String(filehandle), "OK");
 		return;
+	}
+	*read_bytes = s.toInt();
+	if (*read_bytes > size)
+		*read_bytes = size;
 
-	if (bytes + index < CONNECTION_BUFFER)
-	{
-		command.toCharArray(&buffers[index][buffer_len[index]], bytes);
-		buffer_len[index] += bytes;
+	size_t bytes_really_read = modem->readBytes(buf, *read_bytes);
+	if(bytes_really_read != *read_bytes) {
+		*read_bytes = 0;
 	}
-	else
-		log("buffer is full");
 
-	/**
-	 * This previous read can take "forever" and expire the connection state,
-	 * so in this particular case, we will assume the connection is still valid
-	 * and reset the timestamp.
-	 **/
-	connected_until[index] = millis() + CONNECTION_STATE;
+	wait_command("OK", 1000);
+	check_command("AT+QFCLOSE=" + String(filehandle), "OK");
 
-#ifdef DEBUG_BG95_HIGH
-	log("[read_data] all bytes read, in buffer " + String(buffer_len[index]) + " bytes");
-#endif
+	return;
+}
 
-	while (modem->available())
+
+// --- --- ---
+
+// --- private MQTT ---
+
+/*
+ * private - issues AT+QMTPUBEX with payload length and writes payload after '>' prompt
+ */
+bool MODEMBGXX::mqtt_send_publish(uint8_t clientID, uint16_t msg_id, uint8_t qos, uint8_t retain, String topic, const uint8_t *payload, uint16_t len)
+{
+	if (!mqtt_publish_prompt(clientID, msg_id, qos, retain, topic, len))
+		return false;
+
+	modem->write(payload, len);
+	modem->flush();
+	return true;
+}
+
+/*
+ * private - issues AT+QMTPUBEX and waits for '>', caller writes len bytes next
+ */
+bool MODEMBGXX::mqtt_publish_prompt(uint8_t clientID, uint16_t msg_id, uint8_t qos, uint8_t retain, String topic, uint16_t len)
+{
+	String s = "AT+QMTPUBEX=" + String(clientID) + "," + String(msg_id) + "," + String(qos) + "," + String(retain) + ",\"" + topic + "\"," + String(len);
+	return check_command_no_ok(s, ">", "ERROR");
+}
+
+/*
+ * private - waits for +QMTPUB of a publish
+ *
+ * returns result of +QMTPUB, -1 if it didn't arrive
+ */
+int8_t MODEMBGXX::mqtt_wait_published(uint8_t clientID, uint16_t msg_id)
+{
+	String f = "+QMTPUB: " + String(clientID) + "," + String(msg_id) + ",";
+	uint32_t timeout = millis() + 15000;
+	while (timeout >= millis())
 	{
-		String line = modem->readStringUntil(AT_TERMINATOR);
+		if (modem->available())
+		{
+			String response = read_line();
 
-		line.trim();
+			response.trim();
 
-		if (line == "OK")
-			break;
+			if (response.length() == 0)
+				continue;
 
-		if (!parse_command_line(line, true))
-		{
 #ifdef DEBUG_BG95_HIGH
-			log("[read_data] ? = '" + line + "'");
+			log("<< " + response);
 #endif
-		}
-	}
-
-	return tcp_check_data_pending();
-}
-
-bool MODEMBGXX::open_pdp_context(uint8_t contextID)
-{
-	if (contextID == 0 || contextID > MAX_CONNECTIONS)
-		return false;
 
-	if (op.technology == 0)
-		return false;
+			if (response.startsWith(f))
+			{
+				response = response.substring(f.length(), f.length() + 1);
+				if (isdigit(response.c_str()[0]))
+				{
+#ifdef DEBUG_BG95_HIGH
+					log("message sent");
+#endif
+					return (int)response.toInt();
+				}
+				return -1;
+			}
 
-	if (apn[contextID - 1].connected)
-		return false;
+			if (response == "ERROR" || response.indexOf("+CME ERROR") > -1)
+				return -1;
 
-	apn[contextID - 1].retry *= 2;
-	if (apn[contextID - 1].retry > 6 * 60 * 60 * 1000)
-		apn[contextID - 1].retry = 6 * 60 * 60 * 1000;
+			parse_command_line(response);
+		}
 
-	if (!check_command("AT+QIACT=" + String(contextID), "OK", "ERROR", 30000))
-	{
-		close_pdp_context(contextID);
-		return false;
+		delay(AT_WAIT_RESPONSE);
 	}
-	return true;
+	return -1;
 }
 
-bool MODEMBGXX::close_pdp_context(uint8_t tcp_cid)
+/*
+ * private - handles +QMTPUB: <client>,<msg_id>,<result>[,<value>] of tracked async publishes
+ */
+void MODEMBGXX::mqtt_published_urc(String line)
 {
+	int8_t index = line.indexOf(",");
+	if (index == -1)
+		return;
 
-	if (tcp_cid < 1 || tcp_cid > MAX_CONNECTIONS)
-		return false;
+	uint8_t clientID = line.substring(0, index).toInt();
+	line = line.substring(index + 1);
+	index = line.indexOf(",");
+	if (index == -1)
+		return;
 
-	return check_command("AT+QIDEACT=" + String(tcp_cid), "OK", "ERROR");
-}
+	uint16_t msg_id = line.substring(0, index).toInt();
+	int8_t result = line.substring(index + 1, index + 2).toInt();
 
-bool MODEMBGXX::disable_pdp(uint8_t tcp_cid)
-{
+	if (result == 1)
+		return; // retransmission, still in flight
 
-	if (tcp_cid < 1 || tcp_cid > MAX_CONNECTIONS)
-		return false;
+	bool journaled = false;
+#ifdef MQTT_JOURNAL
+	journaled = journal_remove(clientID, msg_id);
+#endif
 
-	if (!check_command("AT+CGACT=0," + String(tcp_cid), "OK", "ERROR", 10000))
-		return false;
+	for (uint8_t i = 0; i < MQTT_INFLIGHT_WINDOW; i++)
+	{
+		if (!mqtt_inflight[i].used || mqtt_inflight[i].clientID != clientID || mqtt_inflight[i].msg_id != msg_id)
+			continue;
 
-#ifdef DEBUG_BG95
-	log("PDP disabled");
-#endif
+		mqtt_inflight[i].used = false;
+		if (mqttOnPublished != NULL)
+			mqttOnPublished(clientID, msg_id, result);
+		return;
+	}
 
-	return true;
+	// publish that was waiting for ack on journal
+	if (journaled && mqttOnPublished != NULL)
+		mqttOnPublished(clientID, msg_id, result);
 }
 
-bool MODEMBGXX::enable_pdp(uint8_t tcp_cid)
+/*
+ * private - fails async publishes without answer
+ */
+void MODEMBGXX::mqtt_check_inflight()
 {
+	for (uint8_t i = 0; i < MQTT_INFLIGHT_WINDOW; i++)
+	{
+		if (!mqtt_inflight[i].used)
+			continue;
 
-	if (tcp_cid < 1 || tcp_cid > MAX_CONNECTIONS)
-		return false;
-
-	if (!check_command("AT+CGACT=1," + String(tcp_cid), "OK", "ERROR", 10000))
-		return false;
+		if (millis() - mqtt_inflight[i].sent_at < MQTT_INFLIGHT_TIMEOUT)
+			continue;
 
+		mqtt_inflight[i].used = false;
+#ifdef MQTT_JOURNAL
+		// ack was lost with modem session, result is reported after it is replayed
+		if (journal_mark_replay(mqtt_inflight[i].clientID, mqtt_inflight[i].msg_id))
+			continue;
+#endif
 #ifdef DEBUG_BG95
-	log("PDP enabled");
+		log("mqtt publish " + String(mqtt_inflight[i].msg_id) + " timed out");
 #endif
-
-	return true;
+		if (mqttOnPublished != NULL)
+			mqttOnPublished(mqtt_inflight[i].clientID, mqtt_inflight[i].msg_id, -1);
+	}
 }
 
-int16_t MODEMBGXX::get_rssi()
+/*
+ * private - returns batch of topic, -1 if topic is not batched
+ */
+int8_t MODEMBGXX::mqtt_batch_find(uint8_t clientID, String topic)
 {
-
-	if (rssi_until > millis())
+	for (uint8_t i = 0; i < MQTT_BATCH_TOPICS; i++)
 	{
-		return rssi_last;
+		if (mqtt_batch[i].used && mqtt_batch[i].clientID == clientID && topic == mqtt_batch[i].topic)
+			return i;
 	}
+	return -1;
+}
 
-	rssi_until = millis() + 20000;
-
-	String command = "AT+QCSQ";
-	String response = get_command(command, "+QCSQ: ", 300);
-
-	response.trim();
-	if (response.length() == 0)
-		return 0;
-
-	int p = response.indexOf(",");
-	String tech = response.substring(0, p);
-	tech.replace("\"", "");
-#ifdef DEBUG_BG95_HIGH
-	log("tech in use: " + tech);
-#endif
-	if (tech == "NBIoT")
-		op.technology = NB;
-	else if (tech == "GSM")
-		op.technology = GPRS;
-	else if (tech == "eMTC")
-		op.technology = CATM1;
-	else if (tech == "NOSERVICE")
-		op.technology = 0;
-
-	memset(op.tech_string, 0, sizeof(op.tech_string));
-	memcpy(op.tech_string, tech.c_str(), sizeof(op.tech_string));
-
-	response = response.substring(p + 1);
-	p = response.indexOf(",");
-	if (p > -1)
-		response = response.substring(0, p);
+/*
+ * private - adds payload to batch
+ *
+ * returns false if it doesn't fit
+ */
+bool MODEMBGXX::mqtt_batch_append(uint8_t batch, const uint8_t *payload, uint16_t len)
+{
+	MQTTBatch *b = &mqtt_batch[batch];
 
-	int rssi = 0;
-	if (isNumeric(response))
+	// json arrays need '[' or ',' before payload and room for ']' on send, records need their length
+	uint16_t overhead = 2;
+	if ((uint32_t)b->len + overhead + len > MQTT_BATCH_SIZE)
 	{
-		rssi = response.toInt();
-#ifdef DEBUG_BG95_HIGH
-		log("rssi: " + response);
-#endif
+		if (b->count > 0)
+			mqtt_batch_send(batch);
+		if ((uint32_t)b->len + overhead + len > MQTT_BATCH_SIZE)
+			return false;
 	}
 
-	if (rssi != 0)
-		rssi_last = rssi;
-
-	rssi_until = millis() + 5000;
-	return rssi_last;
-
-	/*
-	for CSQ command
-	if (rssi == 0) {
-		rssi_last = -115;
-	} else if (rssi == 1) {
-		rssi_last = -111;
-	} else if (rssi == 31) {
-		rssi_last = -52;
-	} else if (rssi >= 2 && rssi <= 30) {
-		rssi_last = -110 + (rssi * 56 / 29);
-	} else {
-		rssi_last = 99;
+	if (b->format == MQTT_BATCH_JSON)
+	{
+		b->data[b->len++] = b->count == 0 ? '[' : ',';
+	}
+	else
+	{
+		b->data[b->len++] = len >> 8;
+		b->data[b->len++] = len & 0xFF;
 	}
-	*/
-}
 
-int16_t MODEMBGXX::rssi()
-{
+	memcpy(&b->data[b->len], payload, len);
+	b->len += len;
 
-	return rssi_last;
+	if (b->count == 0)
+		b->first_at = millis();
+	b->count++;
+
+	return true;
 }
 
-String MODEMBGXX::technology()
+/*
+ * private - msg_id for a batch publish, taken when it is sent.
+ * Ids of clientID still waiting for ack (journal or async publishes) are skipped
+ */
+uint16_t MODEMBGXX::mqtt_batch_msg_id(uint8_t clientID)
 {
+	while (true)
+	{
+		uint16_t msg_id = mqtt_batch_next_id++;
+		if (msg_id == 0)
+			continue;
 
-	return String(op.tech_string);
+		bool in_use = false;
+		for (uint8_t i = 0; i < MQTT_INFLIGHT_WINDOW; i++)
+		{
+			if (mqtt_inflight[i].used && mqtt_inflight[i].clientID == clientID && mqtt_inflight[i].msg_id == msg_id)
+				in_use = true;
+		}
+#ifdef MQTT_JOURNAL
+		for (uint8_t i = 0; i < MQTT_JOURNAL_SLOTS; i++)
+		{
+			if (mqtt_journal[i].used && mqtt_journal[i].clientID == clientID && mqtt_journal[i].msg_id == msg_id)
+				in_use = true;
+		}
+#endif
+		if (!in_use)
+			return msg_id;
+	}
 }
 
-// use it to get network clock
-bool MODEMBGXX::get_clock(tm *t)
+/*
+ * private - publish batch, data is kept if it fails
+ */
+bool MODEMBGXX::mqtt_batch_send(uint8_t batch)
 {
-	String response = get_command("AT+CCLK?", "+CCLK: ", 300);
-
-	if (response.length() == 0)
-		return false;
+	MQTTBatch *b = &mqtt_batch[batch];
+	if (b->count == 0)
+		return true;
 
-	int8_t index = 0;
+	uint16_t len = b->len;
+	if (b->format == MQTT_BATCH_JSON)
+		b->data[len++] = ']';
 
-	index = response.indexOf("/");
-	if (index == -1)
+	uint16_t msg_id = b->qos > 0 ? mqtt_batch_msg_id(b->clientID) : 0;
+	int8_t result = mqtt_publish_direct(b->clientID, msg_id, b->qos, 0, String(b->topic), b->data, len);
+	if (result != 0 && result != 3)
+	{
+		b->first_at = millis(); // wait before trying it again
 		return false;
+	}
 
-	t->tm_year = (int)response.substring(index - 2, index).toInt();
-	response = response.substring(index + 1);
+#ifdef DEBUG_BG95
+	log("mqtt batch of " + String(b->count) + " messages sent to " + String(b->topic));
+#endif
 
-	// log("year: "+String(t->tm_year));
-	// log("response: "+response);
+	b->len = 0;
+	b->count = 0;
+	return true;
+}
 
-	index = response.indexOf("/");
-	if (index == -1)
-		return false;
+/*
+ * private - publish batches older than MQTT_BATCH_MAX_AGE
+ */
+void MODEMBGXX::mqtt_check_batches()
+{
+	for (uint8_t i = 0; i < MQTT_BATCH_TOPICS; i++)
+	{
+		if (!mqtt_batch[i].used || mqtt_batch[i].count == 0)
+			continue;
 
-	t->tm_mon = (int)response.substring(index - 2, index).toInt();
-	response = response.substring(index + 1);
+		if (millis() - mqtt_batch[i].first_at >= MQTT_BATCH_MAX_AGE)
+			mqtt_batch_send(i);
+	}
+}
 
-	// log("month: "+String(t->tm_mon));
-	// log("response: "+response);
+#ifdef MQTT_COMPRESSION
+/*
+ * private - returns index of compressed topic, -1 if not found
+ */
+int8_t MODEMBGXX::mqtt_compress_find(uint8_t clientID, const char *topic, uint16_t topic_len)
+{
+	for (uint8_t i = 0; i < MQTT_COMPRESS_TOPICS; i++)
+	{
+		if (!mqtt_compress[i].used || mqtt_compress[i].clientID != clientID)
+			continue;
 
-	index = response.indexOf(",");
-	if (index > 0)
-		t->tm_mday = (int)response.substring(index - 2, index).toInt();
-	response = response.substring(index + 1);
+		if (strlen(mqtt_compress[i].topic) == topic_len && memcmp(mqtt_compress[i].topic, topic, topic_len) == 0)
+			return i;
+	}
 
-	// log("day: "+String(t->tm_mday));
-	// log("response: "+response);
+	return -1;
+}
 
-	index = response.indexOf(":");
+/*
+ * private - replaces payload by its compressed version and appends MQTT_COMPRESS_SUFFIX to topic,
+ * keeps them if topic is not compressed or compression doesn't save bytes
+ */
+void MODEMBGXX::mqtt_compress_payload(uint8_t clientID, String &topic, const uint8_t *&payload, uint16_t &len)
+{
+	int8_t index = mqtt_compress_find(clientID, topic.c_str(), topic.length());
 	if (index == -1)
-		return false;
+		return;
 
-	t->tm_hour = (int)response.substring(index - 2, index).toInt();
-	response = response.substring(index + 1);
+	if (len == 0)
+		return;
 
-	// log("hour: "+String(t->tm_hour));
-	// log("response: "+response);
+	// output must be smaller than payload to be worth it
+	uint16_t out_size = len - 1 < MQTT_COMPRESS_BUFFER ? len - 1 : MQTT_COMPRESS_BUFFER;
 
-	index = response.indexOf(":");
-	if (index == -1)
-		return false;
+	size_t compressed = lzss_compress(payload, len, mqtt_compress_tx, out_size, mqtt_compress[index].dict, mqtt_compress[index].dict_len);
+	if (compressed == 0)
+		return;
 
-	t->tm_min = (int)response.substring(index - 2, index).toInt();
-	response = response.substring(index + 1);
+	#ifdef DEBUG_BG95
+	log("mqtt payload compressed " + String(len) + " -> " + String(compressed));
+	#endif
 
-	// log("min: "+String(t->tm_min));
-	// log("response: "+response);
+	topic += MQTT_COMPRESS_SUFFIX;
+	payload = mqtt_compress_tx;
+	len = compressed;
+}
+#endif
 
-	bool minus = false;
-	index = response.indexOf("+");
-	if (index == -1)
-	{
-		index = response.indexOf("-");
-		minus = true;
+/*
+ * private - stores handler on topic trie of clientID, NULL handler removes route.
+ * Each node is one topic level, children are a linked list of siblings
+ *
+ * returns false if there are no free nodes or a level is too long
+ */
+bool MODEMBGXX::mqtt_route_add(uint8_t clientID, const char *topic, MQTTHandler handler)
+{
+	if (mqtt_route_count == 0)
+	{
+		for (uint8_t i = 0; i < MAX_MQTT_CONNECTIONS; i++)
+			mqtt_route_root[i] = -1;
 	}
 
-	t->tm_sec = (int)response.substring(index - 2, index).toInt();
-	response = response.substring(index + 1);
-
-	// log("sec: "+String(t->tm_sec));
+	if (handler == NULL)
+	{
+		mqtt_route_remove(&mqtt_route_root[clientID], topic);
+		return true;
+	}
 
-	if (t->tm_year < 19)
-		return false;
+	const char *full_topic = topic;
+	int8_t *link = &mqtt_route_root[clientID];
+	int8_t node = -1;
 
-	if (response.toInt() != 0)
+	while (true)
 	{
-		if (minus)
+		const char *end = strchr(topic, '/');
+		uint8_t len = end != NULL ? end - topic : strlen(topic);
+		if (len >= sizeof(mqtt_routes[0].level))
 		{
-			tz = -response.toInt() / 4 * 3600;
-			tz -= response.toInt() % 4 * 15 * 60;
-
-			t->tm_hour -= response.toInt() / 4;
-			t->tm_min -= response.toInt() % 4 * 15;
+			mqtt_route_remove(&mqtt_route_root[clientID], full_topic);
+			return false;
 		}
-		else
-		{
-			tz = response.toInt() / 4 * 3600;
-			tz += response.toInt() % 4 * 15 * 60;
 
-			t->tm_hour += response.toInt() / 4;
-			t->tm_min += response.toInt() % 4 * 15;
+		// look for level between siblings
+		node = *link;
+		while (node != -1)
+		{
+			if (strlen(mqtt_routes[node].level) == len && strncmp(mqtt_routes[node].level, topic, len) == 0)
+				break;
+			node = mqtt_routes[node].next;
 		}
-	}
 
-	return true;
-}
-
-int32_t MODEMBGXX::get_tz()
-{
-	return tz;
-}
+		if (node == -1)
+		{
+			if (mqtt_route_free != -1)
+			{
+				node = mqtt_route_free;
+				mqtt_route_free = mqtt_routes[node].next;
+			}
+			else if (mqtt_route_count < MQTT_ROUTE_NODES)
+				node = mqtt_route_count++;
+			else
+			{
+				// release levels created for this topic
+				mqtt_route_remove(&mqtt_route_root[clientID], full_topic);
+				return false;
+			}
 
-void MODEMBGXX::sync_clock_ntp(bool force)
-{
+			memset(mqtt_routes[node].level, 0, sizeof(mqtt_routes[node].level));
+			memcpy(mqtt_routes[node].level, topic, len);
+			mqtt_routes[node].child = -1;
+			mqtt_routes[node].handler = NULL;
+			mqtt_routes[node].next = *link;
+			*link = node;
+		}
 
-	if (clock_sync_timeout < millis() || force)
-		clock_sync_timeout = millis() + (3600 * 1000);
-	else
-		return;
+		if (end == NULL)
+			break;
 
-	if (!apn[0].connected)
-		return;
+		topic = end + 1;
+		link = &mqtt_routes[node].child;
+	}
 
-	get_command("AT+QNTP=1,\"pool.ntp.org\",123", "+QNTP: ", 60000);
+	mqtt_routes[node].handler = handler;
+	return true;
 }
 
-void MODEMBGXX::update_sys_clock()
+/*
+ * private - clears handler of topic, starting on siblings of link, and moves levels
+ * left without handler and children to the free list
+ */
+void MODEMBGXX::mqtt_route_remove(int8_t *link, const char *topic)
 {
+	const char *end = strchr(topic, '/');
+	uint8_t len = end != NULL ? end - topic : strlen(topic);
 
-	struct tm t;
-	if (get_clock(&t))
+	int8_t node = *link;
+	while (node != -1)
 	{
+		if (strlen(mqtt_routes[node].level) == len && strncmp(mqtt_routes[node].level, topic, len) == 0)
+			break;
+		link = &mqtt_routes[node].next;
+		node = *link;
+	}
 
-		int y = t.tm_year;
-		int mo = t.tm_mon;
-		int d = t.tm_mday;
-		int h = t.tm_hour;
-		int m = t.tm_min;
-		int s = t.tm_sec;
-
-#ifdef DEBUG_BG95
-		log_output->printf("date(yyyy/mm/dd hh:mm:ss) - %d/%d/%d %d:%d:%d \n", y + 2000, mo, d, h, m, s);
-		log("tz: " + String(tz));
-#endif
+	if (node == -1)
+		return; // nothing to remove
 
-		setTime(h, m, s, d, mo, y);
+	if (end == NULL)
+		mqtt_routes[node].handler = NULL;
+	else
+		mqtt_route_remove(&mqtt_routes[node].child, end + 1);
 
-		log_output->println(now());
+	if (mqtt_routes[node].handler == NULL && mqtt_routes[node].child == -1)
+	{
+		*link = mqtt_routes[node].next;
+		mqtt_routes[node].next = mqtt_route_free;
+		mqtt_route_free = node;
 	}
 }
 
-String MODEMBGXX::scan_cells()
+/*
+ * private - calls handlers of routes matching topic levels, starting on node siblings
+ *
+ * @topic - remaining levels, not null terminated
+ * @len - length of remaining levels
+ *
+ * returns number of handlers called
+ */
+uint8_t MODEMBGXX::mqtt_route_match(int8_t node, const char *topic, uint16_t len, uint8_t clientID, const char *full_topic, const uint8_t *payload, uint16_t payload_len)
 {
-#ifdef DEBUG_BG95
-	log("getting cells information..");
-#endif
-
-	// send_command("AT+CNETSCAN");
-	send_command("AT+QENG=\"NEIGHBOURCELL\"");
-	delay(AT_WAIT_RESPONSE);
+	uint8_t matches = 0;
 
-	uint32_t timeout = millis() + 50000;
-	String cells = "";
+	const char *end = (const char *)memchr(topic, '/', len);
+	uint16_t level_len = end != NULL ? end - topic : len;
 
-	uint16_t counter = 0;
-	while (timeout >= millis())
+	for (; node != -1; node = mqtt_routes[node].next)
 	{
-		if (modem->available())
+		MQTTRoute *route = &mqtt_routes[node];
+
+		if (route->level[0] == '#' && route->level[1] == '\0')
 		{
-			String response = modem->readStringUntil(AT_TERMINATOR);
-			counter += response.length();
-			response.trim();
+			if (route->handler != NULL)
+			{
+				route->handler(clientID, full_topic, payload, payload_len);
+				matches++;
+			}
+			continue;
+		}
 
-			if (response.length() == 0)
-				continue;
+		bool wildcard = route->level[0] == '+' && route->level[1] == '\0';
+		if (!wildcard && (strlen(route->level) != level_len || strncmp(route->level, topic, level_len) != 0))
+			continue;
 
-			log(response);
+		if (end != NULL)
+		{
+			matches += mqtt_route_match(route->child, end + 1, len - level_len - 1, clientID, full_topic, payload, payload_len);
+			continue;
+		}
 
-			if (response == "ERROR")
-				return "";
-			else if (response == "OK")
-			{
-#ifdef DEBUG_BG95
-				log("[cells info] response = '" + response + "'");
-#endif
-				return cells;
-			}
-			else
-				cells += response;
+		// last level
+		if (route->handler != NULL)
+		{
+			route->handler(clientID, full_topic, payload, payload_len);
+			matches++;
+		}
 
-			if (counter >= 255)
+		// parent level also matches "level/#"
+		for (int8_t child = route->child; child != -1; child = mqtt_routes[child].next)
+		{
+			if (strcmp(mqtt_routes[child].level, "#") == 0 && mqtt_routes[child].handler != NULL)
 			{
-				log("!! overflow");
-				return cells;
+				mqtt_routes[child].handler(clientID, full_topic, payload, payload_len);
+				matches++;
 			}
 		}
-
-		delay(AT_WAIT_RESPONSE);
 	}
-	return cells;
+
+	return matches;
 }
 
-String MODEMBGXX::get_position()
+/*
+ * private - delivers message to handlers of matching subscriptions, or to callback registered on MQTT_init if none matches
+ */
+void MODEMBGXX::mqtt_route(uint8_t clientID, const char *topic, uint16_t topic_len, const uint8_t *payload, uint16_t len)
 {
-#ifdef DEBUG_BG95
-	log("getting cells information..");
-#endif
-	log(get_command("AT+QGPSCFG=\"gnssconfig\""));
-
-	if (!check_command("AT+QGPS=1", "OK", "ERROR", 400))
-		return "";
+	char full_topic[128];
+	if (topic_len >= sizeof(full_topic))
+	{
+		log("mqtt topic is too long, message discarded");
+		return;
+	}
+	memcpy(full_topic, topic, topic_len);
+	full_topic[topic_len] = '\0';
 
-	String response = "";
-	// uint32_t timeout = millis() + 120000;
-	uint32_t timeout = millis() + 20000;
-	while (millis() < timeout)
+#ifdef MQTT_COMPRESSION
+	uint16_t suffix_len = strlen(MQTT_COMPRESS_SUFFIX);
+	if (topic_len > suffix_len && strcmp(&full_topic[topic_len - suffix_len], MQTT_COMPRESS_SUFFIX) == 0)
 	{
-		response = get_command("AT+QGPSLOC=2", "+QGPSLOC: ", 300);
-#ifdef DEBUG_BG95
-		log(response);
-		log("response len: " + String(response.length()));
-#endif
-		if (response.length() > 0)
+		int8_t index = mqtt_compress_find(clientID, full_topic, topic_len - suffix_len);
+		if (index != -1)
 		{
-			check_command("AT+QGPSEND", "OK", "ERROR", 400);
-			return response;
+			size_t decompressed = lzss_decompress(payload, len, mqtt_compress_rx, MQTT_COMPRESS_BUFFER, mqtt_compress[index].dict, mqtt_compress[index].dict_len);
+			if (decompressed == 0)
+			{
+				log("mqtt payload can't be decompressed, message discarded");
+				return;
+			}
+			mqtt_compress_rx[decompressed] = '\0';
+
+			topic_len -= suffix_len;
+			full_topic[topic_len] = '\0';
+			payload = mqtt_compress_rx;
+			len = decompressed;
 		}
-		delay(2000);
 	}
+#endif
 
-	check_command("AT+QGPSEND", "OK", "ERROR", 400);
-	/*
-
-	check_command("AT+QGPS=1", "OK", "ERROR", 400);
+	if (mqtt_route_count > 0 && mqtt_route_root[clientID] != -1)
+	{
+		if (mqtt_route_match(mqtt_route_root[clientID], full_topic, topic_len, clientID, full_topic, payload, len) > 0)
+			return;
+	}
 
-	check_command("AT+QGPSCFG=\"nmeasrc\",1", "OK", "ERROR", 400);
+	// callbacks of MQTT_init and MQTT_set_callback receive topic between quotes
+	bool (*callback)(uint8_t, String, String) = parseMQTTclient[clientID] != NULL ? parseMQTTclient[clientID] : parseMQTTmessage;
+	if (callback != NULL)
+		callback(clientID, "\"" + String(full_topic) + "\"", String((const char *)payload));
+}
 
-	check_command("AT+QGPSGNMEA=\"GGA\"", "OK", "ERROR", 400);
+/*
+ * private - runs open, connect and subscribe sequence of supervised clients
+ */
+void MODEMBGXX::mqtt_supervise()
+{
+	for (uint8_t i = 0; i < MAX_MQTT_CONNECTIONS; i++)
+	{
+		MQTTSupervisor *sv = &mqtt_supervisor[i];
+		if (!sv->active)
+			continue;
 
-	check_command("AT+QGPSGNMEA=\"RMC\"", "OK", "ERROR", 400);
+		if (mqtt[i].connected && sv->subscribed)
+			continue;
 
-	check_command("AT+QGPSGNMEA=\"GSV\"", "OK", "ERROR", 400);
+		if (sv->next_attempt > millis())
+			continue;
 
-	check_command("AT+QGPSGNMEA=\"GSA\"", "OK", "ERROR", 400);
+		// an opened context is progress, connect goes on the same attempt
+		bool ok = has_context(mqtt[i].contextID) || open_pdp_context(mqtt[i].contextID);
+		if (ok && !mqtt[i].connected)
+			ok = MQTT_connect(i, sv->uid, sv->user, sv->pass, sv->host, sv->port, sv->clean_session);
 
-	check_command("AT+QGPSGNMEA=\"VTG\"", "OK", "ERROR", 400);
+		if (ok)
+			ok = mqtt_supervise_resubscribe(i);
 
-	check_command("AT+QGPSGNMEA=\"GNS\"", "OK", "ERROR", 400);
+		if (ok)
+		{
+			sv->backoff = 0;
+			sv->subscribed = true;
+#ifdef DEBUG_BG95
+			log("mqtt client " + String(i) + " is connected and subscribed");
+#endif
+			continue;
+		}
 
-	check_command("AT+QGPSCFG=\"nmeasrc\",0", "OK", "ERROR", 400);
-	*/
-	return response;
-}
+		// exponential backoff, next attempt between half and full delay
+		if (sv->backoff == 0)
+			sv->backoff = MQTT_RECONNECT_MIN;
+		else if (sv->backoff < MQTT_RECONNECT_MAX / 2)
+			sv->backoff *= 2;
+		else
+			sv->backoff = MQTT_RECONNECT_MAX;
 
-bool MODEMBGXX::set_priority_mode(int priority_type, bool save)
-{
-	if (priority_type != PRIORITY_GNSS && priority_type != PRIORITY_WWAN)
-		return false;
-	
-	return check_command("AT+QGPSCFG=\"priority\"," + String(priority_type) + "," + String(int(save)), "OK", 300);
-}
+		sv->next_attempt = millis() + sv->backoff / 2 + esp_random() % (sv->backoff / 2 + 1);
+		sv->subscribed = false;
 
-bool MODEMBGXX::switch_radio_off()
-{
 #ifdef DEBUG_BG95
-	log("switch radio off");
+		log("mqtt client " + String(i) + " will retry in " + String(sv->next_attempt - millis()) + " ms");
 #endif
-	if (check_command("AT+CFUN=0", "OK", "ERROR", 15000))
-	{
-		for (uint8_t i = 0; i < MAX_CONNECTIONS; i++)
-		{
-			apn[i].connected = false;
-		}
-		for (uint8_t i = 0; i < MAX_TCP_CONNECTIONS; i++)
-		{
-			data_pending[i] = false;
-			tcp[i].connected = false;
-		}
-		for (uint8_t i = 0; i < MAX_MQTT_CONNECTIONS; i++)
-		{
-			mqtt[i].connected = false;
-		}
-		return true;
 	}
-	else
-		return false;
 }
 
-String MODEMBGXX::get_imei()
+/*
+ * private - sends remembered subscriptions, 5 topics on each AT+QMTSUB
+ */
+bool MODEMBGXX::mqtt_supervise_resubscribe(uint8_t clientID)
 {
-	if (imei != "")
-		return imei;
-
-	String command = "AT+CGSN";
-	imei = get_command(command, 300);
-	return imei;
-}
+	MQTTSupervisor *sv = &mqtt_supervisor[clientID];
 
-String MODEMBGXX::get_ccid()
-{
-	String command = "AT+QCCID";
-	return get_command(command, "+QCCID: ", 1000);
-}
+	String topics[5];
+	uint8_t qos[5];
+	uint8_t i = 0;
+	while (i < sv->topics)
+	{
+		uint8_t len = 0;
+		while (len < 5 && i < sv->topics)
+		{
+			topics[len] = sv->topic[i];
+			qos[len] = sv->qos[i];
+			len++;
+			i++;
+		}
 
-String MODEMBGXX::get_imsi()
-{
-	String command = "AT+CIMI";
-	return get_command(command, 300);
-}
+		if (++sv->msg_id == 0)
+			sv->msg_id = 1;
 
-String MODEMBGXX::get_ip(uint8_t cid)
-{
-	if (cid == 0 || cid > MAX_CONNECTIONS)
-		return "";
+		if (!MQTT_subscribeTopics(clientID, sv->msg_id, topics, qos, len))
+			return false;
+	}
 
-	String command = "AT+CGPADDR=" + String(cid);
-	return get_command(command, "+CGPADDR: " + String(cid) + ",", 300);
+	return true;
 }
 
-// --- MQTT ---
+#ifdef MQTT_OUTBOX
+// --- private MQTT outbox ---
+/*
+ * Messages published while disconnected are appended to a circular log on LittleFS.
+ * Record: <len:2><clientID:1><qos:1><retain:1><msg_id:2><topic_len:1><topic><payload_len:2><payload>
+ * A record never wraps, OUTBOX_WRAP on the length tells reader to continue on offset 0.
+ * Order is kept per client: records of disconnected clients are skipped, records sent ahead of
+ * the head get OUTBOX_SENT on clientID and are released once head reaches them.
+ * Head, tail and count are kept on OUTBOX_INDEX so messages survive reboots
+ */
+
 /*
- * init mqtt
- *
- * @callback - register callback to parse mqtt messages
+ * private - mounts LittleFS and loads outbox index
  */
-void MODEMBGXX::MQTT_init(bool (*callback)(uint8_t, String, String))
+bool MODEMBGXX::outbox_begin()
 {
-	parseMQTTmessage = callback;
+	if (outbox_ready)
+		return true;
 
-	uint8_t i = 0;
-	while (i < MAX_MQTT_CONNECTIONS)
+	if (!LittleFS.begin(true))
 	{
-		mqtt[i++].active = false;
+		log("outbox: LittleFS is not available");
+		return false;
+	}
+
+	outbox_head = 0;
+	outbox_tail = 0;
+	outbox_count = 0;
+
+	if (LittleFS.exists(OUTBOX_LOG) && LittleFS.exists(OUTBOX_INDEX))
+	{
+		uint32_t index[3];
+		File f = LittleFS.open(OUTBOX_INDEX, FILE_READ);
+		if (f && f.read((uint8_t *)index, sizeof(index)) == sizeof(index) && index[0] < MQTT_OUTBOX_SIZE && index[1] <= MQTT_OUTBOX_SIZE)
+		{
+			outbox_head = index[0];
+			outbox_tail = index[1];
+			outbox_count = index[2];
+		}
+		f.close();
+	}
+	else
+	{
+		File f = LittleFS.open(OUTBOX_LOG, FILE_WRITE);
+		f.close();
 	}
+
+	outbox_count_clients();
+
+#ifdef DEBUG_BG95
+	log("outbox: " + String(MQTT_outbox_pending()) + " messages pending");
+#endif
+
+	outbox_ready = true;
+	return true;
 }
 
 /*
- * setup mqtt
- *
- * @clientID - supports 5 clients, yet is limited to MAX_MQTT_CONNECTIONS
- * @contextID - index of TCP tcp[] - choose 1 connection
- * @willTopic - topic to be sent if mqtt loses connection
- * @willPayload - payload to be sent with will topic
+ * private - reads header of record at offset, continues on offset 0 after OUTBOX_WRAP
  *
- * returns true if configuration was succeed
+ * returns offset of record, -1 if log is corrupted
  */
-bool MODEMBGXX::MQTT_setup(uint8_t clientID, uint8_t contextID, String willTopic, String willPayload, uint16_t keepalive)
+int32_t MODEMBGXX::outbox_read_header(fs::File &f, uint32_t offset, uint16_t *record_len, uint8_t *header)
 {
-#ifdef DEBUG_BG95
-	log("Setup: clientID:" + String(clientID) + " contextID:" + String(contextID) + " willTopic:" + willTopic + " willPayload:" + willPayload);
-#endif
+	*record_len = OUTBOX_WRAP;
+	if (offset + 2 <= MQTT_OUTBOX_SIZE)
+	{
+		f.seek(offset);
+		f.read((uint8_t *)record_len, 2);
+	}
+	if (*record_len == OUTBOX_WRAP)
+	{
+		offset = 0;
+		f.seek(offset);
+		f.read((uint8_t *)record_len, 2);
+	}
 
-	if (clientID >= MAX_MQTT_CONNECTIONS)
-		return false;
+	if (*record_len < 8 || offset + 2 + *record_len > MQTT_OUTBOX_SIZE)
+		return -1;
 
-	mqtt[clientID].contextID = contextID;
-	mqtt[clientID].clientID = clientID;
-	mqtt[clientID].active = true;
+	if (f.read(header, 6) != 6 || *record_len < 8 + header[5])
+		return -1;
 
-	String s = "AT+QMTCFG=\"pdpcid\"," + String(clientID) + "," + String(mqtt[clientID].contextID);
-	check_command(s.c_str(), "OK", 2000);
-	// return false;
+	return offset;
+}
 
-	/*
-	 * By the BG96 MQTT Application Note V1.1:
-	 *
-	 * +QMTCFG: "recv/mode",<msg_recv_mode>[,<msg_len_enable>]
-	 *
-	 * <msg_recv_mode> Integer type. The MQTT message receiving mode.
-	 *   0 MQTT message received from server will be contained in URC
-	 *   1 MQTT message received from server will not be contained in URC
-	 * <msg_len_enable> Integer type.
-	 *   0 Length of MQTT message received from server will not be contained in URC
-	 *   1 Length of MQTT message received from server will be contained in URC
-	 *
-	 * URC = Unsolicited Result Code
-	 */
+/*
+ * private - counts messages waiting of each client
+ */
+void MODEMBGXX::outbox_count_clients()
+{
+	memset(outbox_client_count, 0, sizeof(outbox_client_count));
 
-	// store messages on buffer, report payload_len on read
-	s = "AT+QMTCFG=\"recv/mode\"," + String(clientID) + "," + String(MQTT_RECV_MODE) + "," + String(MQTT_RECV_MODE);
-	check_command(s.c_str(), "OK", 2000);
-	// return false;
+	File f = LittleFS.open(OUTBOX_LOG, FILE_READ);
+	if (!f)
+		return;
 
-	s = "AT+QMTCFG=\"will\"," + String(clientID) + ",1,2,1,\"" + willTopic + "\",\"" + willPayload + "\"";
-	check_command(s.c_str(), "OK", 2000);
-	// return false;
+	uint32_t offset = outbox_head;
+	uint16_t record_len;
+	uint8_t header[6];
+	for (uint32_t i = 0; i < outbox_count; i++)
+	{
+		int32_t at = outbox_read_header(f, offset, &record_len, header);
+		if (at == -1)
+		{
+			log("outbox: log is corrupted, messages discarded");
+			outbox_count = 0;
+			memset(outbox_client_count, 0, sizeof(outbox_client_count));
+			outbox_save_index();
+			break;
+		}
 
-	s = "AT+QMTCFG=\"keepalive\"," + String(clientID) + "," + String(keepalive);
-	check_command(s.c_str(), "OK", 2000);
+		if (header[0] < MAX_MQTT_CONNECTIONS)
+			outbox_client_count[header[0]]++;
 
-	return true;
+		offset = at + 2 + record_len;
+	}
+	f.close();
 }
 
-bool MODEMBGXX::MQTT_set_ssl(uint8_t clientID, uint8_t contextID, uint8_t sslClientID)
+/*
+ * private - stores head, tail and count
+ */
+void MODEMBGXX::outbox_save_index()
 {
-	String s = "AT+QMTCFG=\"ssl\"," + String(clientID) + ",1," + String(sslClientID);
-	if (!check_command(s.c_str(), "OK", 2000))
-		return false;
-	return set_ssl(sslClientID);
+	if (outbox_count == 0)
+	{
+		outbox_head = 0;
+		outbox_tail = 0;
+	}
+
+	uint32_t index[3] = {outbox_head, outbox_tail, outbox_count};
+	File f = LittleFS.open(OUTBOX_INDEX, FILE_WRITE);
+	f.write((uint8_t *)index, sizeof(index));
+	f.close();
 }
 
 /*
- * Connects to a mqtt broker
- *
- * @clientID: 0-5, limited to MAX_CONNECTIONS
- * @uid: id to register device on broker
- * @uid: uid to register device on broker
- * @user: credential
- * @pass: credential
- * @host: DNS or IP
- * @port: default 1883
- * @cleanSession: default 1 to start a clean session in broker
+ * private - appends message to outbox
  *
- * return true if connection is open
+ * returns false if outbox is full or not available
  */
-bool MODEMBGXX::MQTT_connect(uint8_t clientID, const char *uid, const char *user, const char *pass, const char *host, uint16_t port, uint8_t cleanSession)
+bool MODEMBGXX::outbox_store(uint8_t clientID, uint16_t msg_id, uint8_t qos, uint8_t retain, String topic, const uint8_t *payload, uint16_t len)
 {
-	if (clientID >= MAX_CONNECTIONS)
+	if (!outbox_ready || topic.length() > 255)
 		return false;
 
-	String host_str = String(host);
-	memset(mqtt[clientID].host, 0, sizeof(mqtt[clientID].host));
-	memcpy(mqtt[clientID].host, host_str.c_str(), host_str.length());
+	uint32_t size = 8 + topic.length() + 2 + len;
+	if (size > MQTT_OUTBOX_SIZE / 2)
+		return false;
 
-#ifdef DEBUG_BG95
-	log("Connect: " + String(host) + " cleanSession:" + String(cleanSession));
-#endif
-	if (!MQTT_isOpened(clientID, host, port))
+	if (outbox_count == 0)
 	{
-		String s = "AT+QMTCFG=\"session\"," + String(clientID) + "," + String(cleanSession);
-		check_command(s.c_str(), "OK", 2000);
-
-		if (!MQTT_open(clientID, host, port))
-			return false;
+		outbox_head = 0;
+		outbox_tail = 0;
 	}
 
-	uint8_t state = mqtt[clientID].socket_state;
+	uint32_t offset = outbox_tail;
+	bool wrap = false;
 
-	if (state == MQTT_STATE_DISCONNECTING)
+	if (outbox_count > 0 && outbox_tail <= outbox_head)
 	{
-		MQTT_close(clientID);
-		MQTT_disconnect(clientID);
-		MQTT_readAllBuffers(clientID);
-		return false;
+		// free space is between tail and head
+		if (outbox_tail + size > outbox_head)
+			return false;
 	}
-
-	if (state != MQTT_STATE_CONNECTING && state != MQTT_STATE_CONNECTED)
+	else if (outbox_tail + size > MQTT_OUTBOX_SIZE)
 	{
-		String s = "AT+QMTCONN=" + String(clientID) + ",\"" + String(uid) + "\",\"" + String(user) + "\",\"" + String(pass) + "\"";
-		if (check_command_no_ok(s.c_str(), "+QMTCONN: " + String(clientID) + ",0,0", 5000))
-			mqtt[clientID].socket_state = MQTT_STATE_CONNECTED;
+		if (outbox_count > 0 && size > outbox_head)
+			return false;
+		wrap = true;
+		offset = 0;
 	}
 
-	if (mqtt[clientID].socket_state == MQTT_STATE_CONNECTED)
+	File f = LittleFS.open(OUTBOX_LOG, "r+");
+	if (!f)
+		return false;
+
+	if (wrap && outbox_tail + 2 <= MQTT_OUTBOX_SIZE)
 	{
-		mqtt[clientID].connected = true;
+		uint16_t marker = OUTBOX_WRAP;
+		f.seek(outbox_tail);
+		f.write((uint8_t *)&marker, 2);
 	}
 
-	return mqtt[clientID].connected;
-}
-
-/*
- * return true if connection is open
- */
-bool MODEMBGXX::MQTT_connected(uint8_t clientID)
-{
-	if (clientID > MAX_MQTT_CONNECTIONS)
+	uint8_t header[8];
+	uint16_t record_len = size - 2;
+	memcpy(&header[0], &record_len, 2);
+	header[2] = clientID;
+	header[3] = qos;
+	header[4] = retain;
+	memcpy(&header[5], &msg_id, 2);
+	header[7] = topic.length();
+
+	f.seek(offset);
+	f.write(header, sizeof(header));
+	f.write((const uint8_t *)topic.c_str(), topic.length());
+	f.write((uint8_t *)&len, 2);
+	size_t written = f.write(payload, len);
+	f.close();
+
+	if (written != len)
 		return false;
 
-	if(this->_MQTT_check_in_progress == false)
-		return mqtt[clientID].connected;
-	else
-		return mqtt_previous[clientID].connected;
+	outbox_tail = offset + size;
+	outbox_count++;
+	outbox_client_count[clientID]++;
+	outbox_save_index();
+
+#ifdef DEBUG_BG95
+	log("outbox: message stored, " + String(MQTT_outbox_pending()) + " pending");
+#endif
+
+	return true;
 }
 
 /*
- * 0 Failed to close connection
- *	1 Connection closed successfully
+ * private - sends oldest message of a connected client, messages of disconnected clients wait without
+ * blocking the others. Payload is streamed from flash to modem, one message each MQTT_OUTBOX_DRAIN_INTERVAL
  */
-int8_t MODEMBGXX::MQTT_disconnect(uint8_t clientID)
+void MODEMBGXX::outbox_drain()
 {
-	if (clientID >= MAX_CONNECTIONS)
-		return clientID;
-
-	String s = "AT+QMTDISC=" + String(clientID);
-	String f = "+QMTDISC: " + String(clientID) + ",";
-	String response = get_command(s.c_str(), f.c_str(), 5000);
-
-	if (response.length() > 0)
-	{
-		int8_t rsp = -1;
-		if (isdigit(response.c_str()[0]))
-			rsp = (int)response.toInt();
+	if (!outbox_ready || outbox_count == 0)
+		return;
 
-		if (rsp == 0)
-			mqtt[clientID].connected = false;
+	if (outbox_next_drain > millis())
+		return;
 
-		return (mqtt[clientID].connected == 0);
-	}
-	else
-		return 0;
-}
+	outbox_next_drain = millis() + MQTT_OUTBOX_DRAIN_INTERVAL;
 
-/*
- * return true if has succeed
- */
-bool MODEMBGXX::MQTT_subscribeTopic(uint8_t clientID, uint16_t msg_id, String topic, uint8_t qos)
-{
-	if (clientID >= MAX_CONNECTIONS)
-		return clientID;
+	File f = LittleFS.open(OUTBOX_LOG, "r+");
+	if (!f)
+		return;
 
-	String s;
-	s.reserve(512);
-	s = "AT+QMTSUB=" + String(clientID) + "," + String(msg_id);
-	s += ",\"" + topic + "\"," + String(qos);
+	uint32_t offset = outbox_head;
+	uint16_t record_len = 0;
+	uint8_t header[6];
+	bool at_head = true; // records before offset were sent
+	bool released = false;
+	int32_t found = -1;
 
-	String f = "+QMTSUB: " + String(clientID) + "," + String(msg_id) + ",";
-	// logging.println("BGxx","String: ",s);
-	// String response = getAtCommandResponseNoOK(s.c_str(),f.c_str(),18000);
-	String response = get_command_no_ok(s.c_str(), f.c_str(), 18000);
-	int8_t index = response.indexOf(",");
-#ifdef DEBUG_BG95_HIGH
-	log("response: " + String(response));
-#endif
-	if (index > -1)
+	uint32_t records = outbox_count;
+	for (uint32_t i = 0; i < records; i++)
 	{
-		response = response.substring(0, index);
-		if (isNumeric(response))
+		int32_t at = outbox_read_header(f, offset, &record_len, header);
+		if (at == -1)
 		{
-			if ((int8_t)response.toInt() == 0)
+			f.close();
+			log("outbox: log is corrupted, messages discarded");
+			outbox_count = 0;
+			memset(outbox_client_count, 0, sizeof(outbox_client_count));
+			outbox_save_index();
+			return;
+		}
+		offset = at + 2 + record_len;
+
+		if (header[0] == OUTBOX_SENT)
+		{
+			if (at_head)
 			{
-#ifdef DEBUG_BG95_HIGH
-				log("packet sent successfully");
-#endif
-				return true;
+				outbox_head = offset;
+				outbox_count--;
+				released = true;
 			}
+			continue;
+		}
+
+		if (header[0] < MAX_MQTT_CONNECTIONS && mqtt[header[0]].connected)
+		{
+			found = at;
+			break;
 		}
+
+		at_head = false;
 	}
-	return false;
-}
 
-/*
- * return true if has succeed
- */
-bool MODEMBGXX::MQTT_subscribeTopics(uint8_t clientID, uint16_t msg_id, String topic[], uint8_t qos[], uint8_t len)
-{
-	if (clientID >= MAX_CONNECTIONS)
-		return clientID;
+	if (released)
+		outbox_save_index();
 
-	String s;
-	s.reserve(512);
-	s = "AT+QMTSUB=" + String(clientID) + "," + String(msg_id);
-	uint8_t i = 0;
-	while (i < len)
+	if (found == -1)
 	{
-		s += ",\"" + topic[i] + "\"," + String(qos[i]);
-		i++;
+		f.close();
+		return;
 	}
 
-	String f = "+QMTSUB: " + String(clientID) + "," + String(msg_id) + ",";
+	char topic[256];
+	uint16_t len = 0;
+	bool valid = f.read((uint8_t *)topic, header[5]) == header[5];
+	valid = valid && f.read((uint8_t *)&len, 2) == 2;
+	valid = valid && record_len == 8 + header[5] + len;
+	if (!valid)
+	{
+		f.close();
+		log("outbox: log is corrupted, messages discarded");
+		outbox_count = 0;
+		memset(outbox_client_count, 0, sizeof(outbox_client_count));
+		outbox_save_index();
+		return;
+	}
 
-	String response = get_command_no_ok(s.c_str(), f.c_str(), 18000);
-	int8_t index = response.indexOf(",");
-#ifdef DEBUG_BG95_HIGH
-	log("response: " + String(response));
-#endif
-	if (index > -1)
+	topic[header[5]] = '\0';
+	uint8_t clientID = header[0];
+	uint8_t qos = header[1];
+	uint8_t retain = header[2];
+	uint16_t msg_id = 0;
+	if (qos > 0)
+		memcpy(&msg_id, &header[3], 2);
+
+	if (!mqtt_publish_prompt(clientID, msg_id, qos, retain, String(topic), len))
 	{
-		response = response.substring(0, index);
-		if (isNumeric(response))
-		{
-			if ((int8_t)response.toInt() == 0)
-			{
-#ifdef DEBUG_BG95_HIGH
-				log("packet sent successfully");
-#endif
-				return true;
-			}
-		}
+		f.close();
+		return;
+	}
+
+	uint8_t chunk[64];
+	uint16_t left = len;
+	while (left > 0)
+	{
+		uint16_t n = left > sizeof(chunk) ? sizeof(chunk) : left;
+		n = f.read(chunk, n);
+		if (n == 0)
+			break;
+		modem->write(chunk, n);
+		left -= n;
+	}
+	modem->flush();
+
+	// only a missing answer is retried, result 2 is a definitive failure that would hold the client
+	int8_t result = mqtt_wait_published(clientID, msg_id);
+	if (result == -1)
+	{
+		f.close();
+		return; // try it again later
+	}
+
+	if (result == 2)
+	{
+		outbox_dropped++;
+		log("outbox: message to " + String(topic) + " failed to send, discarded");
+	}
+
+	outbox_client_count[clientID]--;
+	if (at_head)
+	{
+		outbox_head = found + 2 + record_len;
+		outbox_count--;
+	}
+	else
+	{
+		uint8_t sent = OUTBOX_SENT;
+		f.seek(found + 2);
+		f.write(&sent, 1);
 	}
-	return false;
+	f.close();
+	outbox_save_index();
 }
+#endif
 
 /*
- * return true if has succeed
+ * messages waiting on outbox (MQTT_OUTBOX), 0 if outbox is disabled
  */
-int8_t MODEMBGXX::MQTT_unSubscribeTopic(uint8_t clientID, uint16_t msg_id, String topic[], uint8_t len)
+uint32_t MODEMBGXX::MQTT_outbox_pending()
 {
-	if (clientID >= MAX_CONNECTIONS)
-		return clientID;
-
-	String s = "AT+QMTUNS=" + String(clientID) + "," + String(msg_id);
-	uint8_t i = 0;
-	while (i < len)
-	{
-		s += "," + topic[i];
-		i++;
-	}
+#ifdef MQTT_OUTBOX
+	uint32_t pending = 0;
+	for (uint8_t i = 0; i < MAX_MQTT_CONNECTIONS; i++)
+		pending += outbox_client_count[i];
+	return pending;
+#else
+	return 0;
+#endif
+}
 
-	String f = "+QMTUNS: " + String(clientID) + "," + String(msg_id) + ",";
-	String response = get_command(s.c_str(), f.c_str(), 10000);
-	response = response.substring(0, 1);
-	return (int8_t)response.toInt();
+/*
+ * messages discarded from outbox because publish failed (+QMTPUB result 2), 0 if outbox is disabled
+ */
+uint32_t MODEMBGXX::MQTT_outbox_dropped()
+{
+#ifdef MQTT_OUTBOX
+	return outbox_dropped;
+#else
+	return 0;
+#endif
 }
 
 /*
- *	return
- *	-1 error
- *	0 Packet sent successfully and ACK received from server (message that published when <qos>=0 does not require ACK)
- *	1 Packet retransmission
- *	2 Failed to send packet
+ * discard messages waiting on outbox (MQTT_OUTBOX)
  */
-int8_t MODEMBGXX::MQTT_publish(uint8_t clientID, uint16_t msg_id, uint8_t qos, uint8_t retain, String topic, String msg)
+void MODEMBGXX::MQTT_outbox_clear()
 {
-	if (clientID >= MAX_CONNECTIONS)
-		return clientID;
+#ifdef MQTT_OUTBOX
+	if (!outbox_ready)
+		return;
+	outbox_count = 0;
+	memset(outbox_client_count, 0, sizeof(outbox_client_count));
+	outbox_save_index();
+#endif
+}
 
-	if (!mqtt[clientID].connected)
-		return -1;
+#ifdef MQTT_JOURNAL
+// --- private MQTT journal ---
+/*
+ * Qos 1/2 publishes waiting for ack are kept on JOURNAL_FILE, one fixed record per slot:
+ * <used:1><clientID:1><qos:1><retain:1><msg_id:2><topic_len:1><reserved:1><payload_len:2><topic:64><payload:MQTT_JOURNAL_PAYLOAD>
+ * A record is cleared when +QMTPUB reports success or failure. Records left by a reboot, or whose ack
+ * was lost on a modem reset, are published again with the same msg_id once their client is connected
+ */
 
-	String payload = msg;
+/*
+ * private - mounts LittleFS and loads journal slots
+ */
+bool MODEMBGXX::journal_begin()
+{
+	if (journal_ready)
+		return true;
 
-	uint32_t msg_id_ = msg_id;
-	if (qos == 0)
-		msg_id_ = 0;
+	if (!LittleFS.begin(true))
+	{
+		log("journal: LittleFS is not available");
+		return false;
+	}
 
-	if (!payload.startsWith("\""))
-		payload = "\"" + payload + "\"";
+	memset(mqtt_journal, 0, sizeof(mqtt_journal));
 
-	String s = "AT+QMTPUBEX=" + String(clientID) + "," + String(msg_id_) + "," + String(qos) + "," + String(retain) + ",\"" + topic + "\"," + payload;
-	String f = "+QMTPUB: " + String(clientID) + "," + String(msg_id_) + ",";
+	File f = LittleFS.open(JOURNAL_FILE, FILE_READ);
+	if (f && f.size() == (size_t)JOURNAL_RECORD * MQTT_JOURNAL_SLOTS)
+	{
+		uint8_t header[JOURNAL_HEADER];
+		for (uint8_t i = 0; i < MQTT_JOURNAL_SLOTS; i++)
+		{
+			f.seek((uint32_t)i * JOURNAL_RECORD);
+			if (f.read(header, sizeof(header)) != sizeof(header) || header[0] != 1 || header[1] >= MAX_MQTT_CONNECTIONS)
+				continue;
 
-	String response = get_command_no_ok_critical(s.c_str(), f.c_str(), 15000);
-	response = response.substring(0, 1);
-	if (response.length() > 0)
+			mqtt_journal[i].used = true;
+			mqtt_journal[i].replay = true;
+			mqtt_journal[i].clientID = header[1];
+			memcpy(&mqtt_journal[i].msg_id, &header[4], 2);
+		}
+		f.close();
+	}
+	else
 	{
-		if (isdigit(response.c_str()[0]))
+		if (f)
+			f.close();
+
+		// empty slots
+		f = LittleFS.open(JOURNAL_FILE, FILE_WRITE);
+		if (!f)
+			return false;
+		uint8_t zero[64];
+		memset(zero, 0, sizeof(zero));
+		uint32_t left = (uint32_t)JOURNAL_RECORD * MQTT_JOURNAL_SLOTS;
+		while (left > 0)
 		{
-#ifdef DEBUG_BG95_HIGH
-			log("message sent");
-#endif
-			return (int)response.toInt();
+			uint32_t n = left > sizeof(zero) ? sizeof(zero) : left;
+			f.write(zero, n);
+			left -= n;
 		}
+		f.close();
 	}
-	return -1;
+
+#ifdef DEBUG_BG95
+	log("journal: " + String(MQTT_journal_pending()) + " messages waiting for ack");
+#endif
+
+	journal_ready = true;
+	return true;
 }
 
 /*
- * Forces reading data from mqtt modem buffers
- * call it only if unsolicited messages are not being processed
+ * private - writes publish to a free slot, msg_id of clientID must be unique while waiting for ack
+ *
+ * returns slot, -1 if journal is full, not available or message doesn't fit,
+ * -2 if msg_id is already on journal (message must not be sent)
  */
-void MODEMBGXX::MQTT_readAllBuffers(uint8_t clientID)
+int8_t MODEMBGXX::journal_store(uint8_t clientID, uint16_t msg_id, uint8_t qos, uint8_t retain, String topic, const uint8_t *payload, uint16_t len)
 {
-	if (clientID >= MAX_CONNECTIONS)
-		return;
+	if (!journal_ready || topic.length() > JOURNAL_TOPIC || len > MQTT_JOURNAL_PAYLOAD)
+		return -1;
 
-	String s = "";
-	if (MQTT_connected(clientID))
+	int8_t slot = -1;
+	for (uint8_t i = 0; i < MQTT_JOURNAL_SLOTS; i++)
 	{
-		for (uint8_t i = 0; i < 5; i++)
+		// msg_id is still waiting for ack, it may be a message from before a reboot
+		if (mqtt_journal[i].used && mqtt_journal[i].clientID == clientID && mqtt_journal[i].msg_id == msg_id)
 		{
-			s = "AT+QMTRECV=" + String(clientID) + "," + String(i);
-			get_command(s.c_str(), 400);
-			mqtt_buffer[i] = -1;
+#ifdef DEBUG_BG95
+			log("journal: msg_id " + String(msg_id) + " is waiting for ack, message refused");
+#endif
+			return -2;
 		}
+		if (!mqtt_journal[i].used && slot == -1)
+			slot = i;
+	}
+	if (slot == -1)
+	{
+#ifdef DEBUG_BG95
+		log("journal: full, message " + String(msg_id) + " is not journaled");
+#endif
+		return -1;
 	}
 
-	return;
+	File f = LittleFS.open(JOURNAL_FILE, "r+");
+	if (!f)
+		return -1;
+
+	uint8_t header[JOURNAL_HEADER];
+	header[0] = 1;
+	header[1] = clientID;
+	header[2] = qos;
+	header[3] = retain;
+	memcpy(&header[4], &msg_id, 2);
+	header[6] = topic.length();
+	header[7] = 0;
+	memcpy(&header[8], &len, 2);
+
+	// payload before header, a record is only valid once header is written
+	f.seek((uint32_t)slot * JOURNAL_RECORD + JOURNAL_HEADER);
+	f.write((const uint8_t *)topic.c_str(), topic.length());
+	f.seek((uint32_t)slot * JOURNAL_RECORD + JOURNAL_HEADER + JOURNAL_TOPIC);
+	size_t written = f.write(payload, len);
+	f.seek((uint32_t)slot * JOURNAL_RECORD);
+	written += f.write(header, sizeof(header));
+	f.close();
+
+	if (written != len + sizeof(header))
+		return -1;
+
+	mqtt_journal[slot].used = true;
+	mqtt_journal[slot].replay = false;
+	mqtt_journal[slot].clientID = clientID;
+	mqtt_journal[slot].msg_id = msg_id;
+
+	return slot;
 }
 
 /*
- * private - Updates mqtt.socket_state of each initialized connection
+ * private - clears slot of publish
  *
- *	0 MQTT is disconnected
- *	1 MQTT is initializing
- *	2 MQTT is connecting
- *	3 MQTT is connected
- *	4 MQTT is disconnecting
+ * returns true if publish was journaled
  */
-void MODEMBGXX::MQTT_checkConnection()
+bool MODEMBGXX::journal_remove(uint8_t clientID, uint16_t msg_id)
 {
-	this->_MQTT_check_in_progress = true;
-
-	for (uint8_t i = 0; i < MAX_MQTT_CONNECTIONS; i++)
+	for (uint8_t i = 0; i < MQTT_JOURNAL_SLOTS; i++)
 	{
-		mqtt_previous[i].connected = mqtt[i].connected;
-
-		mqtt[i].connected = false;
-		mqtt[i].socket_state = MQTT_STATE_DISCONNECTED;
-	}
+		if (!mqtt_journal[i].used || mqtt_journal[i].clientID != clientID || mqtt_journal[i].msg_id != msg_id)
+			continue;
 
-	String s = "AT+QMTCONN?";
-	String res = get_command(s.c_str(), 2000);
+		mqtt_journal[i].used = false;
 
-	return;
+		File f = LittleFS.open(JOURNAL_FILE, "r+");
+		if (f)
+		{
+			uint8_t used = 0;
+			f.seek((uint32_t)i * JOURNAL_RECORD);
+			f.write(&used, 1);
+			f.close();
+		}
+		return true;
+	}
+	return false;
 }
 
 /*
- * private
+ * private - publish will be sent again once its client is connected
+ *
+ * returns true if publish was journaled
  */
-bool MODEMBGXX::MQTT_open(uint8_t clientID, const char *host, uint16_t port)
+bool MODEMBGXX::journal_mark_replay(uint8_t clientID, uint16_t msg_id)
 {
-
-	if (clientID >= MAX_CONNECTIONS)
-		return clientID;
-
-	if (MQTT_connected(clientID))
-	{
-		mqtt[clientID].connected = true;
-	}
-	else
+	for (uint8_t i = 0; i < MQTT_JOURNAL_SLOTS; i++)
 	{
-		MQTT_close(clientID);
-		String s = "AT+QMTOPEN=" + String(clientID) + ",\"" + String(host) + "\"," + String(port);
-		if (check_command_no_ok(s.c_str(), "+QMTOPEN: " + String(clientID) + ",0", 5000))
-			mqtt[clientID].connected = true;
-		else
-			mqtt[clientID].connected = false;
+		if (mqtt_journal[i].used && mqtt_journal[i].clientID == clientID && mqtt_journal[i].msg_id == msg_id)
+		{
+			mqtt_journal[i].replay = true;
+			return true;
+		}
 	}
-
-	return mqtt[clientID].connected;
+	return false;
 }
+
 /*
- * private
+ * private - modem session of clientID was lost (-1 for all clients), its journaled publishes won't get an ack
+ * and are published again once the client is connected
  */
-bool MODEMBGXX::MQTT_isOpened(uint8_t clientID, const char *host, uint16_t port)
+void MODEMBGXX::journal_session_lost(int8_t clientID)
 {
-
-	String s = "AT+QMTOPEN?"; //+to_string(clientID)+",\""+string(settings.mqtt.host)+"\","+to_string(settings.mqtt.port);
-	String ans = "+QMTOPEN: " + String(clientID) + ",\"" + String(host) + "\"," + String(port);
-
-	return check_command(s.c_str(), ans.c_str(), 2000);
+	for (uint8_t i = 0; i < MQTT_JOURNAL_SLOTS; i++)
+	{
+		if (mqtt_journal[i].used && (clientID == -1 || mqtt_journal[i].clientID == clientID))
+			mqtt_journal[i].replay = true;
+	}
 }
+
 /*
- * private
+ * private - publishes again one message whose ack was lost, if its client is connected.
+ * AT+QMTPUBEX has no dup flag, message keeps its msg_id so broker and application can recognise it.
+ * Result is delivered to the callback set on MQTT_set_callback_on_published
  */
-bool MODEMBGXX::MQTT_close(uint8_t clientID)
+void MODEMBGXX::journal_replay()
 {
-	if (clientID >= MAX_CONNECTIONS)
-		return clientID;
+	if (!journal_ready || journal_next_replay > millis())
+		return;
 
-	String s = "AT+QMTCLOSE=" + String(clientID);
-	String f = "+QMTCLOSE: " + String(clientID) + ",";
-	String response = get_command(s.c_str(), f.c_str(), 10000);
+	journal_next_replay = millis() + MQTT_JOURNAL_REPLAY_INTERVAL;
 
-	if (response.length() > 0)
+	int8_t slot = -1;
+	for (uint8_t i = 0; i < MQTT_JOURNAL_SLOTS; i++)
 	{
-		if (isdigit(response.c_str()[0]))
+		if (mqtt_journal[i].used && mqtt_journal[i].replay && mqtt[mqtt_journal[i].clientID].connected)
 		{
-			mqtt[clientID].connected = false;
-			return (int)response.toInt() == 0;
+			slot = i;
+			break;
 		}
 	}
+	if (slot == -1)
+		return;
 
-	return false;
-}
-/*
- * private - Reads data on mqtt modem buffers. Call it with high frequency
- * No need to use if mqtt messages came on unsolicited response (current configuration)
- */
-void MODEMBGXX::MQTT_readMessages(uint8_t clientID)
-{
-	if (clientID >= MAX_MQTT_CONNECTIONS)
+	File f = LittleFS.open(JOURNAL_FILE, FILE_READ);
+	if (!f)
 		return;
 
-	String s = "";
-	int8_t i = 0;
+	uint8_t header[JOURNAL_HEADER];
+	char topic[JOURNAL_TOPIC + 1];
+	uint16_t len = 0;
 
-	/* check if a buffer has messages */
-	if (mqtt_pool_timeout < millis())
+	f.seek((uint32_t)slot * JOURNAL_RECORD);
+	bool valid = f.read(header, sizeof(header)) == sizeof(header) && header[6] <= JOURNAL_TOPIC;
+	valid = valid && f.read((uint8_t *)topic, header[6]) == header[6];
+	if (valid)
 	{
-		mqtt_pool = true;
-		mqtt_pool_timeout = millis() + 60000;
+		memcpy(&len, &header[8], 2);
+		valid = len <= MQTT_JOURNAL_PAYLOAD;
 	}
-	else
-		mqtt_pool = false;
 
-	while (i < 5)
+	if (!valid)
 	{
-		if (mqtt_pool || mqtt_buffer[i] != -1)
-		{
-			s = "AT+QMTRECV=" + String(clientID) + "," + String(i);
-			get_command(s.c_str(), 400);
-			mqtt_buffer[i] = -1;
-		}
-		i++;
+		f.close();
+		log("journal: slot " + String(slot) + " is corrupted, message discarded");
+		journal_remove(mqtt_journal[slot].clientID, mqtt_journal[slot].msg_id);
+		return;
 	}
 
-	return;
-}
+	topic[header[6]] = '\0';
+	uint8_t clientID = mqtt_journal[slot].clientID;
+	uint16_t msg_id = mqtt_journal[slot].msg_id;
 
-// --- --- ---
+#ifdef DEBUG_BG95
+	log("journal: publishing again message " + String(msg_id) + " of client " + String(clientID));
+#endif
 
-// --- HTTP ---
-bool MODEMBGXX::HTTP_config(uint8_t contextID)
-{
-	String s;
-	s = "AT+QHTTPCFG=\"contextid\"," + String(contextID);
-	if(check_command(s, "OK", 500) == false)
-		return false;
+	if (!mqtt_publish_prompt(clientID, msg_id, header[2], header[3], String(topic), len))
+	{
+		f.close();
+		return;
+	}
 
-	s = "AT+QHTTPCFG=\"responseheader\",0";
-	if(check_command(s, "OK", 500) == false)
-		return false;
+	f.seek((uint32_t)slot * JOURNAL_RECORD + JOURNAL_HEADER + JOURNAL_TOPIC);
+	uint8_t chunk[64];
+	uint16_t left = len;
+	while (left > 0)
+	{
+		uint16_t n = left > sizeof(chunk) ? sizeof(chunk) : left;
+		n = f.read(chunk, n);
+		if (n == 0)
+			break;
+		modem->write(chunk, n);
+		left -= n;
+	}
+	modem->flush();
+	f.close();
 
-	s = "AT+QHTTPCFG=\"requestheader\",0";
-	if(check_command(s, "OK", 500) == false)
-		return false;
+	int8_t result = mqtt_wait_published(clientID, msg_id);
+	if (result == -1)
+		return; // try it again later
 
-	return true;
+	// retransmissions are completed by +QMTPUB urc
+	mqtt_journal[slot].replay = false;
+	if (result == 1)
+		return;
+
+	journal_remove(clientID, msg_id);
+	if (mqttOnPublished != NULL)
+		mqttOnPublished(clientID, msg_id, result);
 }
+#endif
 
-void MODEMBGXX::HTTP_GET_download(String url, String filename, 
-	void (*pending_callback)(int16_t http_status, size_t content_length),
-		void (*finished_callback)(void),
-		void (*failed_callback)(void))
+/*
+ * messages waiting for ack on journal (MQTT_JOURNAL), 0 if journal is disabled
+ */
+uint8_t MODEMBGXX::MQTT_journal_pending()
 {
-	check_command("AT+QFDEL=\"" + filename + "\"", "OK", 1000);
-	this->_HTTP_download_filename = filename;
-
-	String s = "AT+QHTTPURL=" + String(url.length()) + ",5";
-	send_command(s);
-	delay(AT_WAIT_RESPONSE);
+	uint8_t count = 0;
+#ifdef MQTT_JOURNAL
+	for (uint8_t i = 0; i < MQTT_JOURNAL_SLOTS; i++)
+	{
+		if (mqtt_journal[i].used)
+			count++;
+	}
+#endif
+	return count;
+}
 
-	String connect_resp = modem->readStringUntil(AT_TERMINATOR);
-	connect_resp.trim();
-	if(connect_resp.length() == 0)
-		connect_resp = modem->readStringUntil(AT_TERMINATOR);
-	connect_resp.trim();
-	log("connect_resp = " + connect_resp);
-	if(connect_resp.indexOf("CME ERROR") > -1) {
-		return;
+/*
+ * discard messages waiting for ack on journal (MQTT_JOURNAL), they won't be published again
+ */
+void MODEMBGXX::MQTT_journal_clear()
+{
+#ifdef MQTT_JOURNAL
+	for (uint8_t i = 0; i < MQTT_JOURNAL_SLOTS; i++)
+	{
+		if (mqtt_journal[i].used)
+			journal_remove(mqtt_journal[i].clientID, mqtt_journal[i].msg_id);
 	}
-	if(connect_resp.indexOf("CONNECT") < 0) {
-		#ifdef DEBUG_BG95_HIGH
-		log("no CONNECT found");
-		#endif
-		return;
+#endif
+}
+
+/*
+ * private - a qos 1 message is delivered again if broker didn't get its ack (e.g. connection was lost).
+ * Messages with same msg_id, topic and payload received within MQTT_DEDUP_WINDOW are duplicates.
+ * Disabled by default (MQTT_DEDUP_ENTRIES 0), brokers that reuse the lowest free msg_id can send
+ * identical messages with the same msg_id that are not redeliveries, on qos 1 and 2
+ *
+ * returns true if message is duplicated, otherwise remembers it
+ */
+bool MODEMBGXX::mqtt_duplicate(uint8_t clientID, uint16_t msg_id, const char *topic, uint16_t topic_len, const uint8_t *payload, uint16_t len)
+{
+#if MQTT_DEDUP_ENTRIES > 0
+	// FNV-1a
+	uint32_t hash = 2166136261UL;
+	for (uint16_t i = 0; i < topic_len; i++)
+		hash = (hash ^ (uint8_t)topic[i]) * 16777619UL;
+	for (uint16_t i = 0; i < len; i++)
+		hash = (hash ^ payload[i]) * 16777619UL;
+
+	for (uint8_t i = 0; i < MQTT_DEDUP_ENTRIES; i++)
+	{
+		MQTTDedup *d = &mqtt_dedup[i];
+		if (d->msg_id == msg_id && d->clientID == clientID && d->hash == hash && millis() - d->received_at < MQTT_DEDUP_WINDOW)
+			return true;
 	}
 
-	if(check_command(url, "OK", 1000) != true)
-		return;	
+	MQTTDedup *d = &mqtt_dedup[mqtt_dedup_next];
+	d->clientID = clientID;
+	d->msg_id = msg_id;
+	d->hash = hash;
+	d->received_at = millis();
+	mqtt_dedup_next = (mqtt_dedup_next + 1) % MQTT_DEDUP_ENTRIES;
+#endif
+	return false;
+}
 
-	if(check_command("AT+QHTTPGET=120", "OK", 500) != true)
-		return;
+// --- private TCP ---
+
+/*
+ * read tcp buffers from modem
+ */
+void MODEMBGXX::tcp_check_data_pending()
+{
+	for (uint8_t index = 0; index < MAX_TCP_CONNECTIONS; index++)
+	{
+		if (!data_pending[index])
+			continue;
 
-	this->_HTTP_request_in_progress = true;
+		// full buffer, wait for tcp_recv to free space
+		if (buffer_len[index] >= CONNECTION_BUFFER)
+			continue;
 
-	httpPendingCallback = pending_callback;
-	httpFinishedCallback = finished_callback;
-	httpFailedCallback = failed_callback;
+		tcp_read_buffer(index);
+	}
 }
 
-// sample responses to parse:
-// +QHTTPGET: 0,200,970704
-// +QHTTPGET: Http timeout
-String MODEMBGXX::_HTTP_response_received(String values)
+/*
+ * private - registers a datagram stored on buffer
+ *
+ * @header - +QIRD response without prefix: <len>[,"<remote ip>",<remote port>]
+ */
+void MODEMBGXX::udp_push_datagram(uint8_t index, String header, uint16_t len)
 {
-	if(!isDigit(values[0])) {
-		if(httpFailedCallback)
-			httpFailedCallback();
-		return "";
+	if (datagram_count[index] >= MAX_UDP_DATAGRAMS)
+	{
+		// keep buffer and datagram list aligned
+		buffer_len[index] -= len;
+		tcp[index].stats.dropped_bytes += len;
+		log("datagram list is full, datagram discarded");
+		return;
 	}
 
-	int sepindex1 = values.indexOf(",");
-	int sepindex2 = values.lastIndexOf(",");
-	uint16_t http_status = (uint16_t)values.substring(sepindex1+1,sepindex2).toInt();
-	size_t content_length = (size_t)values.substring(sepindex2+1).toInt();
-	this->_HTTP_download_content_length = content_length;
+	Datagram *dgram = &datagrams[index][datagram_count[index]];
+	dgram->len = len;
+	memset(dgram->ip, 0, sizeof(dgram->ip));
 
-	if(http_status != 200) {
-		if(httpPendingCallback)
-			httpPendingCallback(http_status, content_length);
-		if(httpFailedCallback)
-			httpFailedCallback();
-		return "";
+	int8_t i = header.indexOf(",");
+	int8_t last_i = header.lastIndexOf(",");
+	if (i > -1 && last_i > i)
+	{
+		String ip = header.substring(i + 1, last_i);
+		ip.replace("\"", "");
+		strncpy(dgram->ip, ip.c_str(), sizeof(dgram->ip) - 1);
+		dgram->port = header.substring(last_i + 1).toInt();
+	}
+	else
+	{
+		// udp client, remote is the connected peer
+		strncpy(dgram->ip, tcp[index].server, sizeof(dgram->ip) - 1);
+		dgram->port = tcp[index].port;
 	}
-	modem->readStringUntil(AT_TERMINATOR);
-
-	check_command("AT+QHTTPREADFILE=\"" + this->_HTTP_download_filename + "\",300", "OK", 1000);
 
-	if(httpPendingCallback)
-		httpPendingCallback(http_status, content_length);
-		
-	return "";
+	datagram_count[index]++;
 }
 
-String MODEMBGXX::_HTTP_file_downloaded(String values)
+/*
+ * private - clears counters of clientID, called on connect
+ */
+void MODEMBGXX::tcp_reset_stats(uint8_t clientID)
 {
-	this->_HTTP_request_in_progress = false;
-
-	#ifdef DEBUG_BG95_HIGH
-	log("HTTP file downloaded: " + values);
-	#endif
-
-	if(values[0] != '0' ) {	
-		if(httpFailedCallback)
-			httpFailedCallback();
-		return "";
-	}
+	memset(&tcp[clientID].stats, 0, sizeof(tcp[clientID].stats));
+	tcp[clientID].stats.since = millis();
+	tcp[clientID].stats.buffer_high_water = buffer_len[clientID];
+	connected_since[clientID] = millis();
+}
 
-	// bool size_valid = check_command("AT+QFLST=\""+this->_HTTP_download_filename+"\"", 
-	// 	"+QFLST: \""+this->_HTTP_download_filename+"\"," + String(this->_HTTP_download_content_length),
-	// 	1000
-	// );
-	// if(!size_valid) {
-	// 	#ifdef DEBUG_BG95_HIGH
-	// 	log("downloaded file size does not match http response content-length");
-	// 	#endif
-	// 	if(httpFailedCallback)
-	// 		httpFailedCallback();
-	// 	return "";
-	// }
+/*
+ * private - keeps the highest buffer occupation of clientID
+ */
+void MODEMBGXX::tcp_update_high_water(uint8_t clientID)
+{
+	if (buffer_len[clientID] > tcp[clientID].stats.buffer_high_water)
+		tcp[clientID].stats.buffer_high_water = buffer_len[clientID];
+}
 
-	if(httpFinishedCallback)
-		httpFinishedCallback();
-	return "";
+void MODEMBGXX::tcp_reset_send_window(uint8_t clientID)
+{
+	tcp[clientID].sent_bytes = 0;
+	tcp[clientID].acked_bytes = 0;
+	tcp[clientID].unacked_bytes = 0;
+	tcp[clientID].send_blocked = false;
+	tcp[clientID].send_status_until = 0;
 }
 
-String MODEMBGXX::_HTTP_file_download_error(String line)
+/*
+ * refresh window of blocked connections and notify when they can be written again
+ */
+void MODEMBGXX::tcp_check_send_window()
 {
-	this->_HTTP_request_in_progress = false;
+	for (uint8_t index = 0; index < MAX_TCP_CONNECTIONS; index++)
+	{
+		if (!tcp[index].connected || !tcp[index].send_blocked)
+			continue;
 
-	#ifdef DEBUG_BG95_HIGH
-	log("file download error: " + line);
-	get_command("AT+QFLST=\"*\"");
-	#endif
-	return "";
-}
-// --- --- ---
+		if (tcp[index].send_status_until > millis())
+			continue;
 
-// --- FILE ---
+		tcp_send_status(index, NULL, NULL, NULL);
 
-void MODEMBGXX::FILE_get_chunk(String filename, char *buf, size_t size, size_t offset, size_t* read_bytes)
-{
-	/* 
-	AT+QFOPEN=filename,2
-	+QFOPEN: filehandle
-	OK
-	AT+QFSEEK=filehandle,offset,0
-	OK
-	AT+QFREAD=filehandle,size
-	CONNECT read_length\r
-	...
-	OK
-	AT+QFCLOSE=filehandle
-	OK
-	*/
-	String s = get_command_critical("AT+QFOPEN=\""+filename+"\",2", "+QFOPEN: ", 1000);
-	if(!isDigit(s[0])) {
-		*read_bytes = 0;
-		return;
+		if (tcp[index].unacked_bytes < TCP_MAX_UNACKED)
+		{
+			tcp[index].send_blocked = false;
+			if (tcpOnWritable != NULL)
+				tcpOnWritable(index);
+		}
 	}
+}
 
-	int filehandle = s.toInt();
-
-	bool ok = check_command("AT+QFSEEK=" + String(filehandle) + "," + String(offset) + ",0", "OK");
-	if(!ok) {
-		*read_bytes = 0;
+/*
+ * private - reads data pushed after a recv urc (direct push mode) straight to buffer.
+ * A tcp stream that doesn't fit on buffer can't be delivered whole, the connection is marked as
+ * disconnected and closed from loop
+ *
+ * @header - <len>[,"<remote ip>",<remote port>]
+ */
+void MODEMBGXX::tcp_push_data(uint8_t index, String header)
+{
+	uint16_t len = header.toInt();
+	if (len == 0)
 		return;
-	}
 
-	send_command("AT+QFREAD=" + String(filehandle) + "," + String(size));
-	delay(AT_WAIT_RESPONSE);
+	uint16_t left_space = CONNECTION_BUFFER - buffer_len[index];
+	uint16_t n = 0;
+	bool broken = tcp[index].proto == SOCKET_TCP && (!tcp[index].connected || len > left_space);
 
-	uint32_t timeout = 1000 + millis();
-	while(timeout >= millis())
+	// a datagram is stored entirely or discarded, a stream only if nothing was lost before
+	if (len <= left_space && !broken)
 	{
-		if(modem->available()) {
-			String response = modem->readStringUntil(AT_TERMINATOR);
+		n = modem->readBytes(&buffers[index][buffer_len[index]], len);
+		buffer_len[index] += n;
+		tcp[index].stats.bytes_received += n;
+		tcp_update_high_water(index);
+		if (tcp[index].proto != SOCKET_TCP)
+			udp_push_datagram(index, header, n);
+	}
 
-			response.trim();
+	if (n < len)
+	{
+		if (tcp[index].proto != SOCKET_TCP)
+			log("udp datagram of " + String(len) + " bytes doesn't fit on buffer, dropped");
+		else if (tcp[index].connected)
+		{
+			log("buffer of connection " + String(index) + " overflowed, stream is broken and will be closed");
+			tcp[index].connected = false;
+			close_pending |= 1 << index;
+		}
+		tcp[index].stats.dropped_bytes += len - n;
+		char discard[32];
+		uint16_t left = len - n;
+		while (left > 0)
+		{
+			uint16_t chunk = left > sizeof(discard) ? sizeof(discard) : left;
+			uint16_t read = modem->readBytes(discard, chunk);
+			if (read == 0)
+				break;
+			left -= read;
+		}
+	}
+}
 
-			if (response.length() == 0)
-				continue; // garbage
+/*
+ * private - drains data of a connection from modem.
+ * Reads until modem reports no more data (+QIRD: 0), which also re-enables the recv URC.
+ * If buffer becomes full, data_pending is kept and reading resumes on loop once tcp_recv frees space
+ */
+void MODEMBGXX::tcp_read_buffer(uint8_t index, uint16_t wait)
+{
+	// parse what arrived meanwhile, urcs can't be lost
+	while (modem->available())
+	{
+		String line = read_line();
 
-#ifdef DEBUG_BG95_HIGH
-			log("<< " + response);
-#endif
+		line.trim();
 
-			String filter = "CONNECT ";
-			if (response.startsWith(filter))
-				s = response.substring(filter.length());
-		} 
-		if (s.length() > 0)
-			break;
+		if (line.length() == 0)
+			continue;
 
-		delay(AT_WAIT_RESPONSE);
+		parse_command_line(line, true);
 	}
 
-	log("QFREAD CONNECT output = " + s);
-	if(!isDigit(s[0])) {
-		*read_bytes = 0;
-		return;
-	}
-	*read_bytes = s.toInt();
+	if (read_size[index] < TCP_READ_MIN)
+		read_size[index] = TCP_READ_MIN;
 
-	size_t bytes_really_read = modem->readBytes(buf, *read_bytes);
-	log("bytes_really_read = " + String(bytes_really_read));
-	log("buf: ");
-	for(int i = 0; i < 10; i++)
-		log(String((int)buf[i]) + " ");
-	if(bytes_really_read != *read_bytes) {
-		*read_bytes = 0;
-	}
+	data_pending[index] = true;
 
-	wait_command("OK", 1000);
-	check_command("AT+QFCLOSE=" + String(filehandle), "OK");
+	while (data_pending[index])
+	{
+		uint16_t left_space = CONNECTION_BUFFER - buffer_len[index];
+		if (left_space == 0)
+			return;
 
-	return;
-}
+		// a datagram is read at once and modem discards what exceeds the request,
+		// wait for udp_recv to free space for the biggest one
+		if (tcp[index].proto != SOCKET_TCP && left_space < UDP_MAX_DATAGRAM)
+			return;
 
+		uint16_t request = read_size[index];
+		if (request > left_space || tcp[index].proto != SOCKET_TCP)
+			request = left_space;
 
-// --- --- ---
+		int16_t len = tcp_read_block(index, request, wait);
+		if (len < 0)
+			return; // error or timeout, try again on next loop
 
-// --- private TCP ---
+		if (len == 0)
+		{
+			data_pending[index] = false;
+			return;
+		}
 
-/*
- * read tcp buffers from modem
- */
-void MODEMBGXX::tcp_check_data_pending()
-{
-	for (uint8_t index = 0; index < MAX_TCP_CONNECTIONS; index++)
-	{
-		if (!data_pending[index])
+		if (tcp[index].proto != SOCKET_TCP)
 			continue;
 
-		tcp_read_buffer(index);
+		// tune next request from this one
+		if (len == request)
+		{
+			if (read_size[index] < CONNECTION_BUFFER / 2)
+				read_size[index] *= 2;
+			else
+				read_size[index] = CONNECTION_BUFFER;
+		}
+		else
+		{
+			read_size[index] = (read_size[index] + len) / 2;
+			if (read_size[index] < TCP_READ_MIN)
+				read_size[index] = TCP_READ_MIN;
+		}
 	}
 }
 
-void MODEMBGXX::tcp_read_buffer(uint8_t index, uint16_t wait)
+/*
+ * private - issues one AT+QIRD (or AT+QSSLRECV) and stores data on buffer
+ *
+ * @request - bytes to read, must fit on buffer
+ *
+ * returns number of bytes read, -1 if command failed
+ */
+int16_t MODEMBGXX::tcp_read_block(uint8_t index, uint16_t request, uint16_t wait)
 {
-
-	while (modem->available())
-		modem->readStringUntil(AT_TERMINATOR);
-
-	int16_t left_space = CONNECTION_BUFFER - buffer_len[index];
-	if (left_space <= 10)
-		return;
-
+	String filter = "";
 	if (tcp[index].ssl)
 	{
-		send_command("AT+QSSLRECV=" + String(index) + "," + String(left_space));
+		filter = "+QSSLRECV: ";
+		send_command("AT+QSSLRECV=" + String(index) + "," + String(request));
 	}
 	else
 	{
-		send_command("AT+QIRD=" + String(index) + "," + String(left_space));
+		filter = "+QIRD: ";
+		send_command("AT+QIRD=" + String(index) + "," + String(request));
 	}
 
+	uint32_t start = millis();
 	delay(AT_WAIT_RESPONSE);
 
 	uint32_t timeout = millis() + wait;
 	String info = "";
-	bool end = false;
+	int16_t len = -1;
 
-	while (timeout >= millis() && !end)
+	while (timeout >= millis())
 	{
 		while (modem->available())
 		{
-			info = modem->readStringUntil(AT_TERMINATOR);
+			info = read_line();
 
 			info.trim();
 
 			if (info.length() == 0)
 				continue;
 
-			/*
-			if (info.startsWith("+CIPRXGET: 1," + String(index))) {
-				read_data(index, info);
-				break;
-			}
-			*/
-			if (info.startsWith("+QIRD: "))
-			{
-
-				log(info); // +QIRD
-				info = info.substring(7);
-				String size = info.substring(0, 1);
-				uint16_t len = info.toInt();
-				if (len > 0)
-				{
-					if (len + buffer_len[index] <= CONNECTION_BUFFER)
-					{
-						uint16_t n = modem->readBytes(&buffers[index][buffer_len[index]], len);
-						buffer_len[index] += n;
-					}
-					else
-					{
-						log("buffer is full, data read after this will be discarded");
-					}
-				}
-				if (buffer_len[index] == 0)
-					data_pending[index] = false;
-				else
-					data_pending[index] = true;
-
-				break;
-			}
-			else if (info.startsWith("+QSSLRECV: "))
+			if (info.startsWith(filter))
 			{
 #ifdef DEBUG_BG95_HIGH
-				log(info); // +QIRD
+				log(info);
 #endif
-				info = info.substring(11);
-				String size = info.substring(0, 1);
-				uint16_t len = info.toInt();
+				info = info.substring(filter.length());
+				len = info.toInt();
 				if (len > 0)
 				{
 					if (len + buffer_len[index] <= CONNECTION_BUFFER)
 					{
 						uint16_t n = modem->readBytes(&buffers[index][buffer_len[index]], len);
 						buffer_len[index] += n;
+						tcp[index].stats.bytes_received += n;
+						tcp_update_high_water(index);
+						if (tcp[index].proto != SOCKET_TCP)
+							udp_push_datagram(index, info, n);
 					}
 					else
 					{
-						log("buffer is full, data read after this will be discarded");
+						if (tcp[index].proto != SOCKET_TCP)
+							log("udp datagram of " + String(len) + " bytes doesn't fit on buffer, dropped");
+						else
+							log("buffer is full, data read after this will be discarded");
+						tcp[index].stats.dropped_bytes += len;
+						char discard[32];
+						uint16_t left = len;
+						while (left > 0)
+						{
+							uint16_t chunk = left > sizeof(discard) ? sizeof(discard) : left;
+							uint16_t read = modem->readBytes(discard, chunk);
+							if (read == 0)
+								break;
+							left -= read;
+						}
 					}
 				}
-				if (buffer_len[index] == 0)
-					data_pending[index] = false;
-				else
-					data_pending[index] = true;
-
-				break;
 			}
 			else if (info == "OK")
 			{
-				end = true;
-				return;
+				uint32_t rtt = millis() - start;
+				tcp[index].stats.reads++;
+				tcp[index].stats.read_ms_total += rtt;
+				if (rtt > tcp[index].stats.read_ms_max)
+					tcp[index].stats.read_ms_max = rtt;
+				return len;
 			}
-			else if (info == "ERROR")
+			else if (info == "ERROR" || info.startsWith("+CME ERROR"))
 			{
-				if (buffer_len[index] == 0)
-					data_pending[index] = false;
-				else
-					data_pending[index] = true;
-				return;
+				return -1;
 			}
 			else
 			{
@@ -2957,11 +6695,50 @@ void MODEMBGXX::tcp_read_buffer(uint8_t index, uint16_t wait)
 
 		delay(AT_WAIT_RESPONSE);
 	}
+
+	return len;
+}
+
+/*
+ * private - reads a line from modem.
+ * A +QMTRECV line stops before payload, the message is consumed here by its length (payload may contain
+ * line breaks, "OK" or "ERROR") whatever command is waiting, and an empty line is returned
+ */
+String MODEMBGXX::read_line()
+{
+	String line = "";
+	uint8_t commas = 0;
+	bool quoted = false;
+	char c;
+
+	while (modem->readBytes(&c, 1) == 1)
+	{
+		if (c == AT_TERMINATOR)
+			break;
+
+		line += c;
+
+		if (c == '"')
+			quoted = !quoted;
+		else if (c == ',' && !quoted && ++commas == 4 && line.startsWith("+QMTRECV: "))
+		{
+			mqtt_message_received(line);
+			return "";
+		}
+	}
+
+	return line;
 }
 
 void MODEMBGXX::send_command(String command, bool mute)
 {
 
+	if (data_mode)
+	{
+		log("transparent mode is active, command ignored: " + command);
+		return;
+	}
+
 #ifdef DEBUG_BG95_HIGH
 	if (!mute)
 		log(">> " + command);
@@ -2978,7 +6755,7 @@ void MODEMBGXX::send_command(uint8_t *command, uint16_t size)
 
 	if (modem->available())
 	{
-		String response = modem->readStringUntil(AT_TERMINATOR);
+		String response = read_line();
 		response.trim();
 
 		if (response.length() != 0)
@@ -3016,7 +6793,7 @@ String MODEMBGXX::get_command(String command, uint32_t timeout)
 	{
 		if (modem->available())
 		{
-			String response = modem->readStringUntil(AT_TERMINATOR);
+			String response = read_line();
 			response.trim();
 
 			if (response.length() == 0)
@@ -3055,7 +6832,7 @@ String MODEMBGXX::get_command(String command, String filter, uint32_t timeout)
 	{
 		if (modem->available())
 		{
-			String response = modem->readStringUntil(AT_TERMINATOR);
+			String response = read_line();
 
 			response.trim();
 
@@ -3103,7 +6880,7 @@ String MODEMBGXX::get_command_critical(String command, String filter, uint32_t t
 	{
 		if (modem->available())
 		{
-			String response = modem->readStringUntil(AT_TERMINATOR);
+			String response = read_line();
 
 			response.trim();
 
@@ -3150,7 +6927,7 @@ String MODEMBGXX::get_command_no_ok(String command, String filter, uint32_t time
 	{
 		if (modem->available())
 		{
-			String response = modem->readStringUntil(AT_TERMINATOR);
+			String response = read_line();
 
 			response.trim();
 
@@ -3192,7 +6969,7 @@ String MODEMBGXX::get_command_no_ok_critical(String command, String filter, uint
 	{
 		if (modem->available())
 		{
-			String response = modem->readStringUntil(AT_TERMINATOR);
+			String response = read_line();
 
 			response.trim();
 
@@ -3237,7 +7014,7 @@ bool MODEMBGXX::wait_command(String filter, uint32_t timeout)
 	{
 		if (modem->available())
 		{
-			String response = modem->readStringUntil(AT_TERMINATOR);
+			String response = read_line();
 
 			response.trim();
 
@@ -3275,7 +7052,7 @@ bool MODEMBGXX::check_command(String command, String ok_result, uint32_t wait)
 	{
 		if (modem->available())
 		{
-			String response = modem->readStringUntil(AT_TERMINATOR);
+			String response = read_line();
 
 			response.trim();
 
@@ -3311,7 +7088,7 @@ bool MODEMBGXX::check_command(String command, String ok_result, uint32_t wait)
 	/*
 	if(response_expected){
 		// check if there is an ok in the end of sentence
-		String response = modem->readStringUntil(AT_TERMINATOR);
+		String response = read_line();
 		response.trim();
 		#ifdef DEBUG_BG95_HIGH
 			log("<< " +response);
@@ -3334,7 +7111,7 @@ bool MODEMBGXX::check_command(String command, String ok_result, String error_res
 	{
 		if (modem->available())
 		{
-			String response = modem->readStringUntil(AT_TERMINATOR);
+			String response = read_line();
 
 			response.trim();
 
@@ -3383,7 +7160,7 @@ bool MODEMBGXX::check_command_no_ok(String command, String ok_result, uint32_t w
 	{
 		if (modem->available())
 		{
-			String response = modem->readStringUntil(AT_TERMINATOR);
+			String response = read_line();
 
 			response.trim();
 
@@ -3430,7 +7207,7 @@ bool MODEMBGXX::check_command_no_ok(String command, String ok_result, String err
 	{
 		if (modem->available())
 		{
-			String response = modem->readStringUntil(AT_TERMINATOR);
+			String response = read_line();
 
 			response.trim();
 
@@ -3469,7 +7246,7 @@ void MODEMBGXX::check_commands()
 
 	if (modem->available())
 	{
-		String response = modem->readStringUntil(AT_TERMINATOR);
+		String response = read_line();
 
 		response.trim();
 
@@ -7,6 +7,15 @@
 #include "mbedtls/md.h"
 
 #include "editable_macros.h"
+#include "esp32-BG95-lzss.hpp"
+
+#if UDP_MAX_DATAGRAM > CONNECTION_BUFFER
+#error "UDP_MAX_DATAGRAM can't exceed CONNECTION_BUFFER"
+#endif
+
+#ifdef MQTT_OUTBOX
+#include <FS.h>
+#endif
 
 #define GSM 1
 #define GPRS 2
@@ -21,6 +30,23 @@
 #define UNKNOWN 4
 #define ROAMING 5
 
+// SOCKET TYPES
+#define SOCKET_TCP 0
+#define SOCKET_UDP 1
+#define SOCKET_UDP_SERVICE 2
+#define SOCKET_TCP_LISTENER 3
+
+// SOCKET ACCESS MODES
+#define TCP_ACCESS_BUFFER 0
+#define TCP_ACCESS_PUSH 1
+#define TCP_ACCESS_TRANSPARENT 2
+
+#define MQTT_BATCH_JSON 0
+#define MQTT_BATCH_LENGTH_PREFIXED 1
+
+// handler of a subscription, topic is null terminated and without quotes
+typedef void (*MQTTHandler)(uint8_t clientID, const char *topic, const uint8_t *payload, uint16_t len);
+
 #define MQTT_STATE_DISCONNECTED 0
 #define MQTT_STATE_INITIALIZING 1
 #define MQTT_STATE_CONNECTING 2
@@ -43,6 +69,24 @@
 class MODEMBGXX
 {
 public:
+	// per connection counters, see tcp_stats
+	struct TCPStats
+	{
+		uint32_t since; // millis of connection
+		uint32_t bytes_sent;
+		uint32_t bytes_received;
+		uint32_t dropped_bytes;		// discarded because buffer was full
+		uint16_t buffer_high_water; // highest buffer occupation
+		uint32_t sends;
+		uint32_t prompt_ms_total;	// AT+QISEND until '>'
+		uint32_t prompt_ms_max;
+		uint32_t send_ok_ms_total;	// data written until SEND OK
+		uint32_t send_ok_ms_max;
+		uint32_t reads;
+		uint32_t read_ms_total;		// AT+QIRD until OK
+		uint32_t read_ms_max;
+	};
+
 	HardwareSerial *log_output = &Serial;
 	HardwareSerial *modem = &Serial2;
 
@@ -100,6 +144,10 @@ public:
 	bool set_error_message_format(int n);
 
 	bool set_ssl(uint8_t ssl_cid);
+	bool ssl_configure(uint8_t ssl_cid, uint8_t sslversion = 4, uint16_t ciphersuite = 0xFFFF, uint8_t seclevel = 0, bool sni = true);
+	bool ssl_session_resumption(uint8_t ssl_cid, bool enable = true);
+	bool ssl_set_certificates(uint8_t ssl_cid, const char *cacert, const char *clientcert = NULL, const char *clientkey = NULL);
+	bool ssl_metrics(uint8_t ssl_cid, uint32_t *connects, uint32_t *full_ms, uint32_t *resumed_ms);
 
 	//
 	/*
@@ -181,15 +229,66 @@ public:
 
 	// --- TCP ---
 	void tcp_set_callback_on_close(void (*callback)(uint8_t clientID));
+	/*
+	 * called when a connection that was refusing data can be written again
+	 */
+	void tcp_set_callback_on_writable(void (*callback)(uint8_t clientID));
 	bool tcp_connect(uint8_t clientID, String host, uint16_t port, uint16_t wait = 10000);
 	bool tcp_connect(uint8_t contextID, uint8_t clientID, String host, uint16_t port, uint16_t wait = 10000);
+	bool tcp_connect(uint8_t contextID, uint8_t clientID, String proto, String host, uint16_t port, uint16_t wait = 10000);
 	bool tcp_connect_ssl(uint8_t contextID, uint8_t sslClientID, uint8_t clientID, String host, uint16_t port, uint16_t wait = 10000);
+	bool tcp_set_access_mode(uint8_t clientID, uint8_t mode);
+	bool tcp_transparent_escape();
+	bool tcp_transparent_resume();
+	bool tcp_transparent_active();
 	bool tcp_connected(uint8_t clientID);
 	bool tcp_close(uint8_t clientID);
 	bool tcp_send(uint8_t clientID, const char *data, uint16_t size);
 	uint16_t tcp_recv(uint8_t clientID, char *data, uint16_t size);
 	uint16_t tcp_has_data(uint8_t clientID);
+	/*
+	 * reads send window from modem (AT+QISEND=<id>,0)
+	 */
+	bool tcp_send_status(uint8_t clientID, uint32_t *sent, uint32_t *acked, uint32_t *unacked);
+	bool tcp_stats(uint8_t clientID, TCPStats *stats);
+	/*
+	 * returns true if size bytes can be sent without exceeding TCP_MAX_UNACKED
+	 */
+	bool tcp_writable(uint8_t clientID, uint16_t size = 1);
+	/*
+	 * returns last known number of bytes sent but not acknowledged by remote
+	 */
+	uint32_t tcp_unacked(uint8_t clientID);
 	void tcp_check_data_pending();
+	/*
+	 * reads pending urcs and connection data, lighter than loop()
+	 */
+	void tcp_poll();
+
+	bool tcp_listen(uint8_t contextID, uint8_t clientID, uint16_t local_port, uint16_t wait = 10000);
+	int8_t tcp_accept(uint8_t serverID, String *remote_ip = NULL, uint16_t *remote_port = NULL);
+	uint8_t tcp_pending_accepts(uint8_t serverID);
+
+	// --- TCP POOL ---
+	bool tcp_keepalive(uint8_t idle, uint8_t interval, uint8_t count);
+	int8_t tcp_pool_acquire(uint8_t contextID, String host, uint16_t port, int8_t sslClientID = -1, uint16_t wait = 10000);
+	void tcp_pool_release(uint8_t clientID);
+
+	// --- UDP ---
+	/*
+	 * udp sockets share clientIDs and buffers with tcp connections
+	 */
+	bool udp_connect(uint8_t contextID, uint8_t clientID, String host, uint16_t port, uint16_t wait = 10000);
+	bool udp_open_service(uint8_t contextID, uint8_t clientID, uint16_t local_port, uint16_t wait = 10000);
+	bool udp_send_to(uint8_t clientID, String ip, uint16_t port, const char *data, uint16_t size);
+	uint8_t udp_send_batch(uint8_t clientID, String ip, uint16_t port, const char *data[], const uint16_t size[], uint8_t count);
+	uint16_t udp_recv(uint8_t clientID, char *data, uint16_t size, String *ip = NULL, uint16_t *port = NULL);
+	uint16_t udp_has_data(uint8_t clientID);
+
+	// --- DNS ---
+	String dns_resolve(uint8_t contextID, String host, uint32_t wait = 10000);
+	bool dns_prefetch(uint8_t contextID, String host);
+	void dns_flush();
 
 	// --- CLOCK ---
 	/*
@@ -225,15 +324,40 @@ public:
 
 	// --- MQTT ---
 	void MQTT_init(bool (*callback)(uint8_t clientID, String topic, String payload));
+	void MQTT_set_callback(uint8_t clientID, bool (*callback)(uint8_t clientID, String topic, String payload));
 	bool MQTT_setup(uint8_t clientID, uint8_t contextID, String willTopic, String willPayload, uint16_t keepalive = 60);
 	bool MQTT_set_ssl(uint8_t clientID, uint8_t contextID, uint8_t sslClientID);
 	bool MQTT_connect(uint8_t clientID, const char *uid, const char *user, const char *pass, const char *host, uint16_t port = 1883, uint8_t cleanSession = 1);
 	bool MQTT_connected(uint8_t clientID);
+	bool MQTT_supervise(uint8_t clientID, const char *uid, const char *user, const char *pass, const char *host, uint16_t port = 1883, uint8_t cleanSession = 1);
+	bool MQTT_supervise_subscribe(uint8_t clientID, String topic, uint8_t qos);
+	void MQTT_supervise_stop(uint8_t clientID);
 	int8_t MQTT_disconnect(uint8_t clientID);
 	bool MQTT_subscribeTopic(uint8_t clientID, uint16_t msg_id, String topic, uint8_t qos);
+	bool MQTT_subscribeTopic(uint8_t clientID, uint16_t msg_id, String topic, uint8_t qos, MQTTHandler handler);
 	bool MQTT_subscribeTopics(uint8_t clientID, uint16_t msg_id, String topic[], uint8_t qos[], uint8_t len);
 	int8_t MQTT_unSubscribeTopic(uint8_t clientID, uint16_t msg_id, String topic[], uint8_t len);
 	int8_t MQTT_publish(uint8_t clientID, uint16_t msg_id, uint8_t qos, uint8_t retain, String topic, String msg);
+	int8_t MQTT_publish(uint8_t clientID, uint16_t msg_id, uint8_t qos, uint8_t retain, String topic, const uint8_t *payload, uint16_t len);
+	bool MQTT_publish_async(uint8_t clientID, uint16_t msg_id, uint8_t qos, uint8_t retain, String topic, const uint8_t *payload, uint16_t len);
+	uint8_t MQTT_inflight(uint8_t clientID);
+	void MQTT_set_callback_on_published(void (*callback)(uint8_t clientID, uint16_t msg_id, int8_t result));
+	uint32_t MQTT_outbox_pending();
+	uint32_t MQTT_outbox_dropped();
+	bool MQTT_batch(uint8_t clientID, String topic, uint8_t qos = 0, uint8_t format = MQTT_BATCH_JSON);
+	void MQTT_batch_remove(uint8_t clientID, String topic);
+	void MQTT_batch_flush();
+	void MQTT_outbox_clear();
+	uint8_t MQTT_journal_pending();
+	void MQTT_journal_clear();
+#ifdef MQTT_COMPRESSION
+	bool MQTT_compress(uint8_t clientID, String topic, const uint8_t *dict = NULL, uint16_t dict_len = 0);
+	void MQTT_compress_remove(uint8_t clientID, String topic);
+#endif
+	void MQTT_set_stream_handler(uint32_t threshold,
+		void (*begin)(uint8_t clientID, const char *topic, uint32_t total_len),
+		void (*data)(uint8_t clientID, const uint8_t *chunk, uint16_t len),
+		void (*end)(uint8_t clientID, bool complete));
 	void MQTT_readAllBuffers(uint8_t clientID);
 
 	// --- HTTP ---
@@ -244,6 +368,8 @@ public:
 		void (*failed_callback)(void));
 
 	// --- FILE ---
+	bool FILE_upload(String filename, const uint8_t *data, size_t size);
+	bool FILE_delete(String filename);
 	void FILE_get_chunk(String filename, char *buf, size_t size, size_t offset, size_t* read_bytes);
 
 	void log_status();
@@ -288,19 +414,157 @@ private:
 		uint8_t connectID; // connect id 0-11
 		bool ssl;
 		uint8_t sslClientID;
+		uint8_t proto;	   // SOCKET_TCP, SOCKET_UDP, SOCKET_UDP_SERVICE or SOCKET_TCP_LISTENER
+		uint8_t access_mode; // TCP_ACCESS_BUFFER, TCP_ACCESS_PUSH or TCP_ACCESS_TRANSPARENT
 		uint8_t socket_state;
 		bool active;
 		bool connected;
+		uint32_t sent_bytes;   // total bytes accepted by modem
+		uint32_t acked_bytes;  // total bytes acknowledged by remote
+		uint32_t unacked_bytes;
+		bool send_blocked;	   // tcp_send was refused due to a full window
+		uint32_t send_status_until;
+		bool pooled;		   // managed by tcp_pool_acquire
+		bool in_use;		   // pooled connection given to caller
+		uint32_t idle_since;
+		TCPStats stats;
+	};
+
+	struct Datagram
+	{
+		uint16_t len;
+		char ip[46]; // fits ipv6 sources
+		uint16_t port;
+	};
+
+	struct Incoming
+	{
+		uint8_t connectID; // accepted connection
+		uint8_t serverID;  // listener that accepted it
+	};
+
+	struct DNS
+	{
+		char host[64];
+		char ip[40];
+		uint8_t contextID;
+		uint32_t expires; // millis
+		bool used;
+	};
+
+	struct DNSPrefetch
+	{
+		char host[64];
+		uint8_t contextID; // 0 if not used
+	};
+
+	struct SSLProfile
+	{
+		bool defined;
+		uint8_t sslversion;
+		uint16_t ciphersuite;
+		uint8_t seclevel;
+		bool sni;
+		bool session; // tls session resumption
+		char cacert[32];
+		char clientcert[32];
+		char clientkey[32];
+		// connect time metrics
+		char last_host[64];
+		uint32_t connects;
+		uint32_t full_ms;
+		uint32_t resumed;
+		uint32_t resumed_total_ms;
+	};
+
+	struct MQTTInflight
+	{
+		bool used;
+		uint8_t clientID;
+		uint16_t msg_id;
+		uint32_t sent_at;
+	};
+
+#ifdef MQTT_JOURNAL
+	struct MQTTJournal
+	{
+		bool used;
+		bool replay; // ack was lost, publish again once client is connected
+		uint8_t clientID;
+		uint16_t msg_id;
+	};
+#endif
+
+	struct MQTTDedup
+	{
+		uint8_t clientID;
+		uint16_t msg_id;
+		uint32_t hash; // of topic and payload
+		uint32_t received_at;
+	};
+
+	struct MQTTSupervisor
+	{
+		bool active;
+		char uid[64];
+		char user[64];
+		char pass[64];
+		char host[64];
+		uint16_t port;
+		uint8_t clean_session;
+		uint32_t backoff; // millis, 0 after a successful connection
+		uint32_t next_attempt;
+		uint16_t msg_id;
+		bool subscribed;
+		uint8_t topics;
+		char topic[MQTT_SUPERVISOR_TOPICS][64];
+		uint8_t qos[MQTT_SUPERVISOR_TOPICS];
+	};
+
+	struct MQTTRoute
+	{
+		char level[24]; // topic level, + and # are wildcards
+		int8_t child;	// first node of next level
+		int8_t next;	// sibling on same level
+		MQTTHandler handler;
+	};
+
+	struct MQTTBatch
+	{
+		bool used;
+		uint8_t clientID;
+		char topic[64];
+		uint8_t qos;
+		uint8_t format; // MQTT_BATCH_JSON or MQTT_BATCH_LENGTH_PREFIXED
+		uint16_t count;
+		uint32_t first_at;
+		uint16_t len;
+		uint8_t data[MQTT_BATCH_SIZE];
 	};
 
+#ifdef MQTT_COMPRESSION
+	struct MQTTCompress
+	{
+		bool used;
+		uint8_t clientID;
+		char topic[64];
+		const uint8_t *dict; // owned by caller
+		uint16_t dict_len;
+	};
+#endif
+
 	struct MQTT
 	{
 		char host[64];
 		uint8_t contextID; // index for TCP tcp[] 1-16, limited to MAX_CONNECTIONS
-		uint8_t clientID;  // client id 0-5 (limited to MAX_MQTT_CONNECTIONS)
+		uint8_t clientID;  // client id 0-5, limited to MAX_MQTT_CONNECTIONS
 		uint8_t socket_state;
 		bool active;
-		bool connected;
+		bool opened;	// network connection to broker (AT+QMTOPEN)
+		bool connected; // mqtt session (AT+QMTCONN)
+		bool ssl;
+		uint8_t sslClientID;
+		uint16_t port;
 	};
 
 	Modem op = {
@@ -324,12 +588,18 @@ private:
 	// pending texts
 	SMS message[MAX_SMS];
 
-	int8_t mqtt_buffer[5] = {-1, -1, -1, -1, -1}; // index of msg to read
+	uint8_t mqtt_channels[MAX_MQTT_CONNECTIONS]; // bitmap of channels with messages to read, per client
+	// payload of last message received, reused for each one
+	uint8_t mqtt_rx_buffer[MQTT_RX_BUFFER + 1];
+	// messages bigger than this go to stream handlers
+	uint32_t mqtt_stream_threshold = MQTT_RX_BUFFER;
 
 	APN apn[MAX_CONNECTIONS];
 	TCP tcp[MAX_TCP_CONNECTIONS];
 	MQTT mqtt[MAX_MQTT_CONNECTIONS];
-	MQTT mqtt_previous[MAX_MQTT_CONNECTIONS];
+	// clients listed on last AT+QMTCONN?
+	uint8_t mqtt_state_reported = 0;
+	uint32_t mqtt_check_until = 0;
 
 	mbedtls_md_context_t ctx;
 
@@ -343,12 +613,47 @@ private:
 	uint16_t buffer_len[MAX_TCP_CONNECTIONS];
 	// data pending of each connection
 	bool data_pending[MAX_TCP_CONNECTIONS];
+	// size of next read request, tuned from previous reads
+	uint16_t read_size[MAX_TCP_CONNECTIONS];
 	// validity of each connection state
 	uint32_t connected_until[MAX_TCP_CONNECTIONS];
 	// last connection start
 	uint32_t connected_since[MAX_TCP_CONNECTIONS];
 	// data buffer for each connection
 	char buffers[MAX_TCP_CONNECTIONS][CONNECTION_BUFFER];
+	// datagrams stored on each buffer (udp sockets)
+	Datagram datagrams[MAX_TCP_CONNECTIONS][MAX_UDP_DATAGRAMS];
+	uint8_t datagram_count[MAX_TCP_CONNECTIONS];
+	// connections accepted by listeners waiting for tcp_accept
+	Incoming accept_queue[TCP_ACCEPT_QUEUE];
+	uint8_t accept_count = 0;
+	// bitmap of modem connectIDs (0-11) to close from loop, no command is sent while a urc is parsed
+	uint16_t close_pending = 0;
+	// connection in transparent access mode
+	int8_t transparent_id = -1;
+	// uart is a pipe to transparent connection
+	bool data_mode = false;
+	uint32_t transparent_last_write = 0;
+	// millis +++ was sent, 0 if no escape is in progress
+	uint32_t transparent_escape_at = 0;
+	// escape is checking if "NO CARRIER" came from modem
+	bool transparent_confirming = false;
+	// keepalive was configured, or tried, for pooled connections
+	bool pool_keepalive_set = false;
+
+	// --- SSL ---
+	// profiles requested
+	SSLProfile ssl_profile[MAX_SSL_CONTEXTS];
+	// settings already sent to modem
+	SSLProfile ssl_applied[MAX_SSL_CONTEXTS];
+
+	// --- DNS ---
+	DNS dns_cache[DNS_CACHE_SIZE];
+	DNSPrefetch dns_prefetch_hosts[DNS_CACHE_SIZE];
+	bool dns_prefetch_pending[MAX_CONNECTIONS];
+	// cache slot being resolved
+	int8_t dns_lookup = -1;
+	int8_t dns_lookup_ips = 0;
 	// --- --- ---
 
 	uint32_t rssi_until = 20000;
@@ -366,8 +671,52 @@ private:
 	uint32_t next_retry = 0;
 	uint32_t clock_sync_timeout = 0;
 
-	bool mqtt_pool = false;
-	uint32_t mqtt_pool_timeout = 0;
+	// async publishes waiting for +QMTPUB
+	MQTTInflight mqtt_inflight[MQTT_INFLIGHT_WINDOW];
+
+#ifdef MQTT_JOURNAL
+	// slots of journal on LittleFS
+	MQTTJournal mqtt_journal[MQTT_JOURNAL_SLOTS];
+	bool journal_ready = false;
+	uint32_t journal_next_replay = 0;
+#endif
+
+#if MQTT_DEDUP_ENTRIES > 0
+	// received messages with msg_id, to discard redeliveries
+	MQTTDedup mqtt_dedup[MQTT_DEDUP_ENTRIES];
+	uint8_t mqtt_dedup_next = 0;
+#endif
+
+	// reconnection of supervised clients
+	MQTTSupervisor mqtt_supervisor[MAX_MQTT_CONNECTIONS];
+
+	// topic trie of each client, routes messages to subscription handlers
+	MQTTRoute mqtt_routes[MQTT_ROUTE_NODES];
+	int8_t mqtt_route_root[MAX_MQTT_CONNECTIONS];
+	uint8_t mqtt_route_count = 0; // nodes ever used, freed ones go to mqtt_route_free
+	int8_t mqtt_route_free = -1;
+
+	// publishes aggregated by topic
+	MQTTBatch mqtt_batch[MQTT_BATCH_TOPICS];
+	uint16_t mqtt_batch_next_id = 0xF000; // msg_ids of batches, far from the ones applications usually take
+
+#ifdef MQTT_COMPRESSION
+	// topics with compressed payloads
+	MQTTCompress mqtt_compress[MQTT_COMPRESS_TOPICS];
+	uint8_t mqtt_compress_tx[MQTT_COMPRESS_BUFFER];
+	uint8_t mqtt_compress_rx[MQTT_COMPRESS_BUFFER + 1];
+#endif
+
+#ifdef MQTT_OUTBOX
+	bool outbox_ready = false;
+	uint32_t outbox_head = 0;  // offset of oldest message
+	uint32_t outbox_tail = 0;  // offset of next message
+	uint32_t outbox_count = 0; // records between head and tail
+	uint32_t outbox_client_count[MAX_MQTT_CONNECTIONS] = {0}; // messages waiting of each client
+	uint32_t outbox_dropped = 0; // messages broker refused (+QMTPUB result 2)
+	uint32_t outbox_next_drain = 0;
+#endif
+
 	/*
 	 * check if modem is ready (if it's listening for AT commands)
 	 */
@@ -406,7 +755,37 @@ private:
 	bool configure_radio_mode(uint8_t radio, uint16_t cops, bool force = false);
 
 	// --- TCP ---
+	bool tcp_open(uint8_t contextID, uint8_t clientID, uint8_t proto, String host, uint16_t port, uint16_t local_port, uint16_t wait);
+	bool socket_send(uint8_t clientID, String ip, uint16_t port, const char *data, uint16_t size);
+	uint16_t buffer_take(uint8_t clientID, char *data, uint16_t size, uint16_t len);
+	void udp_push_datagram(uint8_t index, String header, uint16_t len);
+	void tcp_incoming(String params);
+	void tcp_check_close_pending();
+	void tcp_push_data(uint8_t index, String header);
+	void tcp_transparent_read();
+	void tcp_pool_check();
+	bool tcp_pool_healthy(uint8_t clientID);
+	bool buffer_ends_with(uint8_t index, const char *suffix);
 	void tcp_read_buffer(uint8_t index, uint16_t wait = 100);
+	int16_t tcp_read_block(uint8_t index, uint16_t request, uint16_t wait);
+	void tcp_reset_stats(uint8_t clientID);
+	void tcp_update_high_water(uint8_t clientID);
+	void tcp_reset_send_window(uint8_t clientID);
+	void tcp_check_send_window();
+
+	// --- SSL ---
+	void ssl_default_profile(uint8_t ssl_cid);
+	bool ssl_apply(uint8_t ssl_cid);
+	void ssl_record_connect(uint8_t ssl_cid, String host, uint32_t duration);
+	bool ssl_store_file(String filename, const uint8_t *data, size_t size);
+	void sha256(const uint8_t *data, size_t size, uint8_t *digest);
+
+	// --- DNS ---
+	void dns_invalidate(uint8_t contextID, String host);
+	int8_t dns_find(uint8_t contextID, String host);
+	void dns_urc(String params);
+	void dns_check_prefetch();
+	bool is_ip_address(String host);
 
 	// --- NETWORK STATE ---
 	int16_t get_rssi();
@@ -422,8 +801,49 @@ private:
 	bool MQTT_isOpened(uint8_t clientID, const char *host, uint16_t port);
 	bool MQTT_close(uint8_t clientID);
 	void MQTT_checkConnection();
-	bool _MQTT_check_in_progress = false;
+	void mqtt_state_urc(String line);
+	void mqtt_supervise();
+	bool mqtt_supervise_resubscribe(uint8_t clientID);
 	void MQTT_readMessages(uint8_t clientID);
+	bool mqtt_send_publish(uint8_t clientID, uint16_t msg_id, uint8_t qos, uint8_t retain, String topic, const uint8_t *payload, uint16_t len);
+	bool mqtt_publish_prompt(uint8_t clientID, uint16_t msg_id, uint8_t qos, uint8_t retain, String topic, uint16_t len);
+	int8_t mqtt_wait_published(uint8_t clientID, uint16_t msg_id);
+	void mqtt_published_urc(String line);
+	bool mqtt_route_add(uint8_t clientID, const char *topic, MQTTHandler handler);
+	void mqtt_route_remove(int8_t *link, const char *topic);
+	uint8_t mqtt_route_match(int8_t node, const char *topic, uint16_t len, uint8_t clientID, const char *full_topic, const uint8_t *payload, uint16_t payload_len);
+	void mqtt_route(uint8_t clientID, const char *topic, uint16_t topic_len, const uint8_t *payload, uint16_t len);
+	uint16_t mqtt_read_payload(uint32_t len);
+	void mqtt_discard_payload(uint32_t left);
+	void mqtt_stream_payload(uint8_t clientID, const char *topic, uint16_t topic_len, uint32_t len);
+	int8_t mqtt_publish_direct(uint8_t clientID, uint16_t msg_id, uint8_t qos, uint8_t retain, String topic, const uint8_t *payload, uint16_t len);
+	int8_t mqtt_batch_find(uint8_t clientID, String topic);
+	bool mqtt_batch_append(uint8_t batch, const uint8_t *payload, uint16_t len);
+	bool mqtt_batch_send(uint8_t batch);
+	uint16_t mqtt_batch_msg_id(uint8_t clientID);
+	void mqtt_check_batches();
+#ifdef MQTT_COMPRESSION
+	int8_t mqtt_compress_find(uint8_t clientID, const char *topic, uint16_t topic_len);
+	void mqtt_compress_payload(uint8_t clientID, String &topic, const uint8_t *&payload, uint16_t &len);
+#endif
+#ifdef MQTT_OUTBOX
+	bool outbox_begin();
+	void outbox_save_index();
+	int32_t outbox_read_header(fs::File &f, uint32_t offset, uint16_t *record_len, uint8_t *header);
+	void outbox_count_clients();
+	bool outbox_store(uint8_t clientID, uint16_t msg_id, uint8_t qos, uint8_t retain, String topic, const uint8_t *payload, uint16_t len);
+	void outbox_drain();
+#endif
+#ifdef MQTT_JOURNAL
+	bool journal_begin();
+	int8_t journal_store(uint8_t clientID, uint16_t msg_id, uint8_t qos, uint8_t retain, String topic, const uint8_t *payload, uint16_t len);
+	bool journal_remove(uint8_t clientID, uint16_t msg_id);
+	bool journal_mark_replay(uint8_t clientID, uint16_t msg_id);
+	void journal_session_lost(int8_t clientID);
+	void journal_replay();
+#endif
+	bool mqtt_duplicate(uint8_t clientID, uint16_t msg_id, const char *topic, uint16_t topic_len, const uint8_t *payload, uint16_t len);
+	void mqtt_check_inflight();
 
 	// process pending SMS messages
 	void process_sms(uint8_t index);
@@ -431,6 +851,7 @@ private:
 	// Read and parse data from modem serial port
 	String check_messages();
 
+	String read_line();
 	String parse_command_line(String line, bool set_data_pending = true);
 	void read_data(uint8_t index, String command, uint16_t bytes);
 